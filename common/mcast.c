@@ -16,6 +16,19 @@
 
 #include <mcast.h>
 
+static int sockfd_to_family (int sock_fd);
+
+/* the address family a socket was created with, or -1 with errno set */
+static int sockfd_to_family (int sock_fd)
+{
+	struct sockaddr_storage ss;
+	socklen_t len = sizeof (ss);
+
+	if (getsockname (sock_fd, (struct sockaddr *) &ss, &len) < 0)
+		return (-1);
+	return ss.ss_family;
+}
+
 /* The following founctions return 0 if OK, -1 on error.  If there is an
    error, errno will be set appropriately. */
 int mcast_join (int sock_fd, const struct sockaddr *sa, socklen_t salen,
@@ -104,8 +117,61 @@ int mcast_leave (int sock_fd, const struct sockaddr *sa, socklen_t salen)
 
 int mcast_set_if (int sock_fd, const char *ifname, u_int ifindex)
 {
-  errno = ENOTSUP;
-  return -1;
+	switch (sockfd_to_family (sock_fd))
+	{
+	case AF_INET:
+	{
+		struct in_addr inaddr;
+		struct ifreq ifreq;
+
+		if (ifindex > 0)
+		{
+			if (if_indextoname (ifindex, ifreq.ifr_name) == NULL)
+			{
+				errno = ENXIO; /* if not found */
+				return (-1);
+			}
+			goto doioctl;
+		}
+		else if (ifname != NULL)
+		{
+			strncpy (ifreq.ifr_name, ifname, IFNAMSIZ);
+		doioctl:
+			if (ioctl (sock_fd, SIOCGIFADDR, &ifreq) < 0)
+				return (-1);
+			memcpy (&inaddr,
+				&((struct sockaddr_in *) &ifreq.ifr_addr)->
+				sin_addr,
+				sizeof (struct in_addr));
+		}
+		else
+		{
+			/* back to whatever the routing table says */
+			inaddr.s_addr = htonl (INADDR_ANY);
+		}
+
+		return (setsockopt (sock_fd, IPPROTO_IP, IP_MULTICAST_IF,
+				    &inaddr, sizeof (inaddr)));
+	}
+#ifdef IPV6
+	case AF_INET6:
+	{
+		u_int index = ifindex;
+
+		if (index == 0 && ifname != NULL &&
+		    (index = if_nametoindex (ifname)) == 0)
+		{
+			errno = ENXIO; /* if name not found */
+			return (-1);
+		}
+		return (setsockopt (sock_fd, IPPROTO_IPV6, IPV6_MULTICAST_IF,
+				    &index, sizeof (index)));
+	}
+#endif // IPV6
+	default:
+		errno = EPROTONOSUPPORT;
+		return (-1);
+	}
 }
 
 int mcast_set_loop (int sock_fd, int onoff)
@@ -134,8 +200,26 @@ int mcast_set_loop (int sock_fd, int onoff)
 
 int mcast_set_ttl (int sock_fd, int ttl)
 {
-  errno = ENOTSUP;
-  return -1;
+	switch (sockfd_to_family (sock_fd))
+	{
+	case AF_INET:
+	{
+		u_char val = ttl;
+		return (setsockopt (sock_fd, IPPROTO_IP, IP_MULTICAST_TTL,
+				    &val, sizeof (val)));
+	}
+#ifdef IPV6
+	case AF_INET6:
+	{
+		int hop = ttl;
+		return (setsockopt (sock_fd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS,
+				    &hop, sizeof (hop)));
+	}
+#endif // IPV6
+	default:
+		errno = EPROTONOSUPPORT;
+		return (-1);
+	}
 }
 
 /* returns non-negative interface index if OK, -1 on error */
@@ -0,0 +1,195 @@
+/* wire.c
+ * ------
+ *
+ * Encoding and decoding routines for the binary protocol described in
+ * wire.h.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <cliserv.h>
+#include <protocol.h>
+#include <wire.h>
+
+/* Local prototypes */
+static int wire_reserve (wire_buf_t *buf, size_t extra);
+
+void wire_buf_init (wire_buf_t *buf)
+{
+	memset (buf, 0, sizeof (wire_buf_t));
+}
+
+void wire_buf_free (wire_buf_t *buf)
+{
+	free (buf->data);
+	memset (buf, 0, sizeof (wire_buf_t));
+}
+
+static int wire_reserve (wire_buf_t *buf, size_t extra)
+{
+	unsigned char *new_data;
+	size_t new_cap;
+
+	if (buf->error)
+		return (-1);
+	if (buf->len + extra <= buf->cap)
+		return 0;
+
+	new_cap = (buf->len + extra) * 2;
+	if ((new_data = realloc (buf->data, new_cap)) == NULL)
+	{
+		buf->error = TRUE;
+		return (-1);
+	}
+	buf->data = new_data;
+	buf->cap  = new_cap;
+	return 0;
+}
+
+void wire_begin (wire_buf_t *buf, wire_type_t type)
+{
+	/* start a new message, throwing away whatever was there */
+	buf->len   = 0;
+	buf->error = FALSE;
+	wire_put_u8 (buf, WIRE_MAGIC);
+	wire_put_u8 (buf, type);
+}
+
+void wire_put_u8 (wire_buf_t *buf, unsigned int value)
+{
+	if (wire_reserve (buf, 1) < 0)
+		return;
+	buf->data[buf->len++] = value & 0xff;
+}
+
+size_t wire_encode_varint (unsigned char *out, unsigned long value)
+{
+	size_t len = 0;
+
+	while (value >= 0x80)
+	{
+		out[len++] = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	out[len++] = value;
+	return len;
+}
+
+void wire_put_varint (wire_buf_t *buf, unsigned long value)
+{
+	if (wire_reserve (buf, WIRE_VARINT_MAX_LEN) < 0)
+		return;
+	buf->len += wire_encode_varint (buf->data + buf->len, value);
+}
+
+void wire_put_bytes (wire_buf_t *buf, const void *data, size_t len)
+{
+	if (wire_reserve (buf, len) < 0)
+		return;
+	memcpy (buf->data + buf->len, data, len);
+	buf->len += len;
+}
+
+void wire_put_string (wire_buf_t *buf, const char *str)
+{
+	size_t len = strlen (str);
+
+	wire_put_varint (buf, len);
+	wire_put_bytes (buf, str, len);
+}
+
+void wire_put_status (wire_buf_t *buf, const char *name, int status,
+		      unsigned long uptime, unsigned long no_users)
+{
+	wire_put_string (buf, name);
+	wire_put_u8 (buf, status);
+	if (status == LINK_UP)
+	{
+		wire_put_varint (buf, uptime);
+		wire_put_varint (buf, no_users);
+	}
+}
+
+int wire_is_binary (const void *data, size_t len)
+{
+	return (len >= WIRE_HEADER_LEN &&
+		((const unsigned char *)data)[0] == WIRE_MAGIC);
+}
+
+int wire_open (wire_reader_t *reader, const void *data, size_t len)
+{
+	if (!wire_is_binary (data, len))
+	{
+		errno = EINVAL;
+		return (-1);
+	}
+	reader->pos   = (const unsigned char *)data + WIRE_HEADER_LEN;
+	reader->end   = (const unsigned char *)data + len;
+	reader->error = FALSE;
+	return ((const unsigned char *)data)[1];
+}
+
+unsigned int wire_get_u8 (wire_reader_t *reader)
+{
+	if (reader->error || reader->pos >= reader->end)
+	{
+		reader->error = TRUE;
+		return 0;
+	}
+	return *reader->pos++;
+}
+
+unsigned long wire_get_varint (wire_reader_t *reader)
+{
+	unsigned long value = 0;
+	int shift;
+
+	for (shift = 0; shift < WIRE_VARINT_MAX_LEN * 7; shift += 7)
+	{
+		unsigned int byte = wire_get_u8 (reader);
+
+		if (reader->error)
+			return 0;
+		value |= (unsigned long)(byte & 0x7f) << shift;
+		if ((byte & 0x80) == 0)
+			return value;
+	}
+	reader->error = TRUE; /* runaway varint */
+	return 0;
+}
+
+const char *wire_get_string (wire_reader_t *reader, size_t *len)
+{
+	const char *str;
+
+	*len = wire_get_varint (reader);
+	if (reader->error || *len > (size_t)(reader->end - reader->pos))
+	{
+		reader->error = TRUE;
+		*len = 0;
+		return NULL;
+	}
+	str = (const char *)reader->pos;
+	reader->pos += *len;
+	return str;
+}
+
+int wire_get_status (wire_reader_t *reader, wire_status_t *status)
+{
+	status->name   = wire_get_string (reader, &status->name_len);
+	status->status = wire_get_u8 (reader);
+	status->uptime = status->no_users = 0;
+	if (status->status == LINK_UP)
+	{
+		status->uptime   = wire_get_varint (reader);
+		status->no_users = wire_get_varint (reader);
+	}
+	if (reader->error || status->status > LINK_DISCONNECTING)
+	{
+		errno = EINVAL;
+		return (-1);
+	}
+	return 0;
+}
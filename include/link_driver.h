@@ -0,0 +1,51 @@
+/* link_driver.h
+ * -------------
+ *
+ * The interface between the link server and a link driver: the code that
+ * actually brings a device's link up and takes it down again, inside the
+ * server rather than in a shell command.  A driver is a shared object
+ * exporting a link_driver_t called link_driver (LINK_DRIVER_SYMBOL), and
+ * is chosen for a device with
+ *
+ *   driver = "<name>"
+ *   driver_arg = "<whatever the driver wants, eg an interface>"
+ *
+ * in its [Device] section.  <name> is one of the drivers built into the
+ * server ("netlink"), or failing that a file for dlopen() to find.  A
+ * device with no driver runs its link_up/link_down/link_force_down
+ * commands, as ever.
+ *
+ * Every call is made from the server's main loop, so it has to be quick:
+ * start the work and return, rather than wait for the link to settle.
+ */
+
+#ifndef _LINK_DRIVER_H_
+#define _LINK_DRIVER_H_
+
+#define LINK_DRIVER_VERSION 1
+#define LINK_DRIVER_SYMBOL  "link_driver"
+
+/* what poll() says about a link */
+#define LINK_DRIVER_LINK_DOWN 0
+#define LINK_DRIVER_LINK_UP   1
+
+typedef struct _link_driver_t
+{
+	int         version; /* LINK_DRIVER_VERSION */
+	const char *name;
+
+	/* Each of these is given the device's name and its driver_arg ("" if
+	   it hasn't one), and returns 0 once the link has been told, or -1
+	   with errno set. */
+	int (*up)         (const char *device, const char *arg);
+	int (*down)       (const char *device, const char *arg);
+	int (*force_down) (const char *device, const char *arg);
+
+	/* Whether the link really is up, LINK_DRIVER_LINK_UP or _DOWN, or -1
+	   if it can't tell.  Asked once a second while the device is
+	   connecting or disconnecting, and does the job of the notify peer.
+	   May be NULL, leaving that to the peer. */
+	int (*poll)       (const char *device, const char *arg);
+} link_driver_t;
+
+#endif // _LINK_DRIVER_H_
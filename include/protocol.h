@@ -20,6 +20,8 @@
 #define CLIENT_FORCE_DOWN           CLIENT_PREFIX "FORCE_DOWN " /* <device> */
 #define CLIENT_STATUS               CLIENT_PREFIX "STATUS " /* <device> */
 #define CLIENT_CLIENT_STATUS        CLIENT_PREFIX "CLIENT_STATUS"
+#define CLIENT_SNAPSHOT             CLIENT_PREFIX "SNAPSHOT"
+#define CLIENT_LOG                  CLIENT_PREFIX "LOG " /* [<n> ]<device> */
 
 /* Server */
 #define SERVER_PREFIX               "SERVER "
@@ -30,9 +32,14 @@
 #define SERVER_STATUS_CONNECTING                  "\tCONNECTING"
 #define SERVER_STATUS_DISCONNECTING               "\tDISCONNECTING"
 #define SERVER_CLIENT_STATUS        SERVER_PREFIX "CLIENT_STATUS " /* ... */
+#define SERVER_LOG                  SERVER_PREFIX "LOG " /* <device>\n... */
+#define SERVER_FRAGMENT             SERVER_PREFIX "FRAGMENT " /* <id> ... */
 
 /* Server broadcast messages */
 #define BROADCAST_PREFIX            "BROADCAST "
 #define BROADCAST_INIT              BROADCAST_PREFIX "INIT"
 #define BROADCAST_STATUS            BROADCAST_PREFIX "STATUS " /* ... */
 #define BROADCAST_QUIT              BROADCAST_PREFIX "QUIT"
+#define BROADCAST_SNAPSHOT          BROADCAST_PREFIX "SNAPSHOT " /* <seq> */
+#define BROADCAST_DELTA             BROADCAST_PREFIX "DELTA " /* <seq> */
+#define BROADCAST_FRAGMENT          BROADCAST_PREFIX "FRAGMENT " /* <id> ... */
@@ -0,0 +1,114 @@
+/* wire.h
+ * ------
+ *
+ * The compact binary encoding of the protocol in protocol.h, shared by
+ * the server, the peer and the clients.  See README.protocol for the
+ * layout of each message.
+ *
+ * A binary message starts with WIRE_MAGIC, which is never the first byte
+ * of a text message, so both encodings can arrive on the same port.  Next
+ * comes the message type, then its fields:
+ *
+ *   u8      - a single byte (status enums)
+ *   varint  - an unsigned number, 7 bits a byte, low bits first, with the
+ *             top bit set on every byte but the last (times, counts and
+ *             sequence numbers)
+ *   string  - a varint length followed by that many bytes, no NUL
+ */
+
+#ifndef _WIRE_H_
+#define _WIRE_H_
+
+#include <stddef.h>
+
+#define WIRE_MAGIC          0xB1 /* not ASCII */
+#define WIRE_HEADER_LEN     2    /* magic and type */
+#define WIRE_VARINT_MAX_LEN 10   /* 64 bits, 7 at a time */
+
+typedef enum _wire_type_t
+{
+	/* Notification peer: <string device> */
+	WIRE_NOTIFY_ISUP          = 0x01,
+	WIRE_NOTIFY_ISDOWN        = 0x02,
+
+	/* Client: no fields, or <string device> for UP to STATUS, or
+	   <varint lines> <string device> for LOG */
+	WIRE_CLIENT_PING          = 0x10,
+	WIRE_CLIENT_DEVICES       = 0x11,
+	WIRE_CLIENT_UP            = 0x12,
+	WIRE_CLIENT_DOWN          = 0x13,
+	WIRE_CLIENT_FORCE_DOWN    = 0x14,
+	WIRE_CLIENT_STATUS        = 0x15,
+	WIRE_CLIENT_CLIENT_STATUS = 0x16,
+	WIRE_CLIENT_SNAPSHOT      = 0x17,
+	WIRE_CLIENT_LOG           = 0x18,
+
+	/* Server */
+	WIRE_SERVER_DEVICES       = 0x20, /* <count> (<name> <description>)* */
+	WIRE_SERVER_STATUS        = 0x21, /* <status record> */
+	WIRE_SERVER_CLIENT_STATUS = 0x22, /* <count> <device>* */
+	WIRE_SERVER_FRAGMENT      = 0x23, /* <id> <index> <count> <bytes> */
+	WIRE_SERVER_LOG           = 0x24, /* <device> <output> */
+
+	/* Server broadcasts */
+	WIRE_BROADCAST_INIT       = 0x30,
+	WIRE_BROADCAST_STATUS     = 0x31, /* <count> <status record>* */
+	WIRE_BROADCAST_QUIT       = 0x32,
+	WIRE_BROADCAST_SNAPSHOT   = 0x33, /* <seq> <count> <status record>* */
+	WIRE_BROADCAST_DELTA      = 0x34, /* <seq> <count> <status record>* */
+	WIRE_BROADCAST_FRAGMENT   = 0x35  /* <id> <index> <count> <bytes> */
+} wire_type_t;
+
+/* a status record is <string device> <u8 status>, followed by
+   <varint uptime> <varint no_users> if the status is LINK_UP */
+typedef struct _wire_status_t
+{
+	const char    *name;      /* not NUL terminated */
+	size_t         name_len;
+	int            status;    /* a device_status_t */
+	unsigned long  uptime;
+	unsigned long  no_users;
+} wire_status_t;
+
+/* a message being built.  The buffer grows as needed and is kept for the
+   next message; error is set (and stays set) if it couldn't grow. */
+typedef struct _wire_buf_t
+{
+	unsigned char *data;
+	size_t         len;
+	size_t         cap;
+	int            error;
+} wire_buf_t;
+
+/* a message being taken apart.  error is set by any read past the end,
+   after which every read returns 0 or NULL. */
+typedef struct _wire_reader_t
+{
+	const unsigned char *pos;
+	const unsigned char *end;
+	int                  error;
+} wire_reader_t;
+
+/* building - check buf->error once at the end */
+void wire_buf_init    (wire_buf_t *buf);
+void wire_buf_free    (wire_buf_t *buf);
+void wire_begin       (wire_buf_t *buf, wire_type_t type);
+void wire_put_u8      (wire_buf_t *buf, unsigned int value);
+void wire_put_varint  (wire_buf_t *buf, unsigned long value);
+void wire_put_string  (wire_buf_t *buf, const char *str);
+void wire_put_bytes   (wire_buf_t *buf, const void *data, size_t len);
+void wire_put_status  (wire_buf_t *buf, const char *name, int status,
+		       unsigned long uptime, unsigned long no_users);
+size_t wire_encode_varint (unsigned char *out, unsigned long value);
+
+/* reading - returns the message type, or -1 (errno = EINVAL) if data
+   isn't a binary message */
+int            wire_is_binary  (const void *data, size_t len);
+int            wire_open       (wire_reader_t *reader, const void *data,
+				size_t len);
+unsigned int   wire_get_u8     (wire_reader_t *reader);
+unsigned long  wire_get_varint (wire_reader_t *reader);
+const char    *wire_get_string (wire_reader_t *reader, size_t *len);
+int            wire_get_status (wire_reader_t *reader, wire_status_t *status);
+
+#endif // _WIRE_H_
@@ -17,10 +17,11 @@ public class ageThread extends Thread {
 	/**
 	 * The following defaults apply to the server:
 	 * 
-	 * multicast broadcast:		every 5 seconds
+	 * multicast snapshot:		every 10 seconds (deltas in between only on changes),
+	 *						backing off to every 30 seconds while nothing changes
 	 * client timeout:			2 hours
 	 */
-	protected long serverPollFrequency = 5000; // milliseconds
+	protected long serverPollFrequency = 30000; // milliseconds, at the slowest
 	protected long serverForgetClientFrequency = 7200000; // milliseconds (2 hours)
 	
 	/**
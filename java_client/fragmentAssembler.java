@@ -0,0 +1,144 @@
+import java.util.Enumeration;
+import java.util.Hashtable;
+import java.util.StringTokenizer;
+import java.util.Vector;
+
+/**
+ * Puts back together a message which the server had to send as a series of
+ * FRAGMENTs, because it was too big for one packet:
+ *
+ *	<prefix> FRAGMENT <id> <index> <count>\n<slice>
+ *
+ * The slices, in order of index, are the bytes of the original message, prefix
+ * and all.  Fragments may arrive in any order; a message whose fragments haven't
+ * all turned up within fragmentTimeout is given up on.
+ */
+public class fragmentAssembler {
+
+	/**
+	 * The most fragments one message may have, and how long to wait for the rest
+	 * of them.
+	 */
+	public static final int  maxFragments    = 4096;
+	public static final long fragmentTimeout = 5000; // milliseconds
+
+	/**
+	 * A message which is still missing some of its fragments.
+	 */
+	protected static class partialMessage {
+		public byte   slices[][];
+		public int    received = 0;
+		public int    length = 0;
+		public long   started = System.currentTimeMillis();
+
+		public partialMessage(int count) {
+			slices = new byte[count][];
+		}
+	}
+
+	/**
+	 * The messages being put together, keyed by their id.
+	 */
+	protected Hashtable Messages = new Hashtable();
+
+	/**
+	 * Whether the first length bytes of data are a fragment, from either the
+	 * server or its broadcasts.
+	 */
+	public static boolean isFragment(byte data[], int length) {
+		StringTokenizer toke = new StringTokenizer(decode(data, 0, length), " \n");
+		if (!toke.hasMoreTokens())
+			return false;
+		toke.nextToken(); // SERVER or BROADCAST
+		return toke.hasMoreTokens() && toke.nextToken().equals(protocol.serverFragment);
+	}
+
+	/**
+	 * Adds the fragment in the first length bytes of data.  Returns the whole message
+	 * once this was the last of its fragments to arrive, or null if there are more
+	 * to come (or the fragment made no sense).
+	 */
+	public synchronized byte[] add(byte data[], int length) {
+		int newline = 0;
+		while (newline < length && data[newline] != '\n')
+			newline++;
+		if (newline == length)
+			return null;
+
+		long id;
+		int index, count;
+		try {
+			StringTokenizer toke = new StringTokenizer(decode(data, 0, newline), " ");
+			toke.nextToken(); // SERVER or BROADCAST
+			toke.nextToken(); // FRAGMENT
+			id = Long.parseLong(toke.nextToken());
+			index = Integer.parseInt(toke.nextToken());
+			count = Integer.parseInt(toke.nextToken());
+		} catch (java.util.NoSuchElementException e) {
+			return null;
+		} catch (NumberFormatException e) {
+			return null;
+		}
+		if (count <= 0 || count > maxFragments || index < 0 || index >= count)
+			return null;
+
+		expire();
+		Long key = new Long(id);
+		partialMessage message = (partialMessage)Messages.get(key);
+		if (message == null || message.slices.length != count) {
+			message = new partialMessage(count);
+			Messages.put(key, message);
+		}
+		if (message.slices[index] == null) {
+			byte slice[] = new byte[length - newline - 1];
+			System.arraycopy(data, newline + 1, slice, 0, slice.length);
+			message.slices[index] = slice;
+			message.received++;
+			message.length += slice.length;
+		}
+		if (message.received < count)
+			return null;
+
+		Messages.remove(key);
+		byte whole[] = new byte[message.length];
+		int pos = 0;
+		for (int i = 0; i < count; i++) {
+			System.arraycopy(message.slices[i], 0, whole, pos, message.slices[i].length);
+			pos += message.slices[i].length;
+		}
+
+		// Fragments of fragments?  No.
+		if (isFragment(whole, whole.length))
+			return null;
+		return whole;
+	}
+
+	/**
+	 * Gives up on any message which has been waiting too long for the rest of its
+	 * fragments - one of them must have been lost.
+	 */
+	protected void expire() {
+		long now = System.currentTimeMillis();
+		Vector expired = new Vector();
+		Enumeration keys = Messages.keys();
+		while (keys.hasMoreElements()) {
+			Object key = keys.nextElement();
+			if (now - ((partialMessage)Messages.get(key)).started > fragmentTimeout)
+				expired.addElement(key);
+		}
+		for (int i = 0; i < expired.size(); i++)
+			Messages.remove(expired.elementAt(i));
+	}
+
+	/**
+	 * Turns bytes from the server into a String.
+	 */
+	public static String decode(byte data[], int offset, int length) {
+		try {
+			return new String(data, offset, length, "UTF8");
+		} catch (java.io.UnsupportedEncodingException e) {
+			// If this happens, We're fu'd anyway.
+			throw new Error(e.getLocalizedMessage());
+		}
+	}
+}
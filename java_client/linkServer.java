@@ -19,6 +19,7 @@ class linkServer {
 	 */
 	public synchronized void reInit() throws NoSuchServerException { 
 		DevicesControlled = null; // initialised by requestDeviceList()
+		Sequence = -1;
 		requestDeviceList();
 	}
 	
@@ -103,6 +104,59 @@ class linkServer {
 		LastTalkedTo = System.currentTimeMillis();
 	}
 	
+	/**
+	 * The member variable Sequence holds the number of the last snapshot or delta
+	 * received from the server, or -1 if there hasn't been one yet.
+	 */
+	protected long Sequence = -1;
+	
+	/**
+	 * The member variable SnapshotRequested indicates the last time we asked the
+	 * server for a snapshot, so that we don't keep asking while one is on its way.
+	 */
+	protected long SnapshotRequested = 0;
+	
+	/**
+	 * Access functions for the sequence number.  updateSequence() returns false if
+	 * a delta was missed between the last message and this one.  Snapshots are
+	 * complete, so nothing can be missing before them.
+	 */
+	public long getSequence() {
+		return Sequence;
+	}
+	
+	public synchronized boolean updateSequence(long newSequence, boolean isSnapshot) {
+		boolean inOrder = isSnapshot || (Sequence >= 0 && newSequence == Sequence + 1);
+		Sequence = newSequence;
+		return inOrder;
+	}
+	
+	/**
+	 * Asks the server to multicast a snapshot.  There is no direct response - the
+	 * snapshot arrives on the multicast socket like any other broadcast.
+	 */
+	public synchronized void requestSnapshot() throws java.io.IOException {
+		if (System.currentTimeMillis() - SnapshotRequested < 2000)
+			return;
+		SnapshotRequested = System.currentTimeMillis();
+		updateLastTalkedTo();
+		serverCommunicator talk = new serverCommunicator(getAddress(), getPort());
+		talk.sendMessage(protocol.clientPrefix + " " + protocol.clientSnapshot);
+	}
+	
+	/**
+	 * The member variable Fragments puts back together the broadcasts from this server
+	 * which were too big for one packet.
+	 */
+	protected fragmentAssembler Fragments = new fragmentAssembler();
+	
+	/**
+	 * Access function for the fragment assembler.
+	 */
+	public fragmentAssembler getFragments() {
+		return Fragments;
+	}
+	
 	/**
 	 * The member variable DevicesControlled has a list of all the devices
 	 * that this server has control over.
@@ -51,7 +51,7 @@ public class multicastThread extends Thread {
 				linkServer currentServer = getServer(packet.getAddress(), packet.getPort());
 			
 				// Parse the message and deal with it
-				parseMessage(packet.getData(), currentServer);
+				parseMessage(packet.getData(), packet.getLength(), currentServer);
 			} catch (NoSuchServerException e) {
 				// Server sent us a status message then claimed not to exist. Freaky.  Just
 				// ignore the status message for now.
@@ -92,17 +92,24 @@ public class multicastThread extends Thread {
 	 * 
 	 * INIT:	Remove knwoledge of all the devices and ask for a new device list
 	 * STATUS:	Update the each of the devices' status
+	 * SNAPSHOT:	Update the each of the devices' status and note the sequence number
+	 * DELTA:	Update the devices that changed.  If a delta went missing, ask for a snapshot
 	 * QUIT:	Remove the server from our list.
+	 *
+	 * A message too big for one packet arrives as FRAGMENTs, which are put back
+	 * together and then parsed like any other.
 	 */
-	protected void parseMessage (byte messageBytes[], linkServer server) { 
-		StringTokenizer toke = null;
-		try { 
-			toke = new StringTokenizer(new String(messageBytes, "UTF8").trim(), " \n\t");
-		} catch (java.io.UnsupportedEncodingException e) { 
-			// If this happens, We're fu'd anyway.
-			throw new Error(e.getLocalizedMessage());
+	protected void parseMessage (byte messageBytes[], int length, linkServer server) { 
+		if (fragmentAssembler.isFragment(messageBytes, length)) {
+			byte whole[] = server.getFragments().add(messageBytes, length);
+			if (whole != null)
+				parseMessage(whole, whole.length, server);
+			return;
 		}
 		
+		StringTokenizer toke = new StringTokenizer(
+			fragmentAssembler.decode(messageBytes, 0, length).trim(), " \n\t");
+		
 		// The first token should be the source of the message.  This function
 		// should only receive messages from the broadcast source.
 		if (!toke.nextToken().equals(protocol.broadcastPrefix)) { 
@@ -133,6 +140,25 @@ public class multicastThread extends Thread {
 			}
 		} else if (message.equals(protocol.broadcastStatus)) {
 			server.updateDeviceStatus(toke);
+		} else if (message.equals(protocol.broadcastSnapshot)) {
+			server.updateSequence(Long.parseLong(toke.nextToken()), true);
+			server.updateDeviceStatus(toke);
+		} else if (message.equals(protocol.broadcastDelta)) {
+			long sequence = Long.parseLong(toke.nextToken());
+			if (sequence <= server.getSequence()) {
+				// A straggler from before the last snapshot.  Ignore it.
+				return;
+			}
+			boolean missed = !server.updateSequence(sequence, false);
+			server.updateDeviceStatus(toke);
+			if (missed) {
+				try {
+					server.requestSnapshot();
+				} catch (java.io.IOException e) {
+					// We'll get a snapshot soon enough anyway.
+					System.err.println("Failed to request a snapshot: " + e.getLocalizedMessage());
+				}
+			}
 		} else {
 			// TODO: warn the user of an invalid message received
 			System.err.println("Warning:  received an invalid message.");
@@ -20,6 +20,7 @@ public class protocol {
 	public static final String clientForceDown				= "FORCE_DOWN";
 	public static final String clientStatus					= "STATUS";
 	public static final String clientClientStatus			= "CLIENT_STATUS";
+	public static final String clientSnapshot				= "SNAPSHOT";
 	
 	/**
 	 * Server
@@ -32,6 +33,7 @@ public class protocol {
 	public static final String serverStatusConnecting		= "CONNECTING";
 	public static final String serverStatusDisconnecting	= "DISCONNECTING";
 	public static final String serverClientStatus			= "CLIENT_STATUS";
+	public static final String serverFragment				= "FRAGMENT";
 
 	/**
 	 * Server broadcast messages
@@ -40,6 +42,9 @@ public class protocol {
 	public static final String broadcastInit				= "INIT";
 	public static final String broadcastStatus				= "STATUS";
 	public static final String broadcastQuit				= "QUIT";
+	public static final String broadcastSnapshot			= "SNAPSHOT";
+	public static final String broadcastDelta				= "DELTA";
+	public static final String broadcastFragment			= "FRAGMENT";
 	
 	public static final int    maxPacketSize				= 400; // bytes
 }
@@ -82,13 +82,32 @@ public class serverCommunicator {
 	}
 	
 	/**
-	 * Waits for a message from the server.  If nothing turns up within a specified timeout,
+	 * Waits for a message from the server, putting it back together first if it arrives
+	 * as a series of FRAGMENTs.  Each packet is waited for as getPacket() does.
+	 */
+	public synchronized String getMessage() throws java.io.InterruptedIOException {
+		fragmentAssembler fragments = new fragmentAssembler();
+		while (true) {
+			DatagramPacket packet = getPacket();
+			byte message[] = packet.getData();
+			int length = packet.getLength();
+			if (fragmentAssembler.isFragment(message, length)) {
+				if ((message = fragments.add(message, length)) == null)
+					continue; // there's more to come
+				length = message.length;
+			}
+			return fragmentAssembler.decode(message, 0, length).trim();
+		}
+	}
+	
+	/**
+	 * Waits for a packet from the server.  If nothing turns up within a specified timeout,
 	 * raise an exception.  THe algorithm for the timeout is a simple exponential backoff
 	 * type thing.  It first tries with the specified timeout.  If that fails, then it
 	 * doubles the timeout and decrements retries.  If retries hits zero, it raises the
 	 * exception.
 	 */
-	public synchronized String getMessage() throws java.io.InterruptedIOException {
+	protected DatagramPacket getPacket() throws java.io.InterruptedIOException {
 		DatagramPacket packet = new DatagramPacket(new byte[protocol.maxPacketSize],
 												   protocol.maxPacketSize);
 		
@@ -102,9 +121,7 @@ public class serverCommunicator {
 		while (retries > 0) { 
 			try { 
 				Socket.receive(packet);
-				return new String(packet.getData(), "UTF8").trim();
-			} catch (java.io.UnsupportedEncodingException e) {
-				  throw new Error(e.getMessage());
+				return packet;
 			} catch (java.io.IOException e) { 
 				// Failed to receive information.  If we've got retries left, increase
 				// the timeout and try again.
@@ -24,6 +24,7 @@
 
 /* Global variables */
 int             g_socket_fd;
+int             g_request_fd; /* for talking back to the servers */
 pthread_mutex_t g_socket_fd_mutex = PTHREAD_MUTEX_INITIALIZER;
 server_list_t  *g_servers;
 pthread_mutex_t g_servers_mutex = PTHREAD_MUTEX_INITIALIZER;
@@ -153,6 +154,11 @@ int init_socket ()
 	if (setsockopt (g_socket_fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
 			&mreq, sizeof (mreq)) < 0)
 		return (-1);
+
+	/* the listening socket is bound to the group address, so requests
+	   to the servers go out on a socket of their own */
+	if ((g_request_fd = socket (PF_INET, SOCK_DGRAM, 0)) < 0)
+		return (-1);
 	pthread_mutex_unlock (&g_socket_fd_mutex);
 	return 0;
 }
@@ -15,7 +15,8 @@
 #define DEFAULT_CONFIG_FILE     "./link_client.conf"
 #define DEFAULT_MULTICAST_GROUP "239.255.42.42"
 #define DEFAULT_MULTICAST_PORT  6789
-#define DEFAULT_SERVER_TIMEOUT  60 /* seconds */
+#define DEFAULT_SERVER_TIMEOUT  120 /* seconds */
+#define SNAPSHOT_RETRY_TIME     2  /* seconds between snapshot requests */
 
 /* Structures */
 
@@ -33,6 +34,9 @@ typedef struct _server_t
 	struct sockaddr_in     sa;
 	time_t                 last_heard_from;
 	struct _device_list_t *devices_controlled;
+	int                    have_seq;       /* seen a snapshot or delta? */
+	unsigned long          last_seq;       /* number of the last one */
+	time_t                 snapshot_asked; /* when we last asked for one */
 } server_t;
 
 typedef struct _server_list_t
@@ -43,6 +47,7 @@ typedef struct _server_list_t
 
 /* global variables */
 extern int             g_socket_fd;
+extern int             g_request_fd;
 extern pthread_mutex_t g_socket_fd_mutex;
 extern server_list_t  *g_servers;
 extern pthread_mutex_t g_servers_mutex;
@@ -22,13 +22,54 @@
 
 #include <cliserv.h>
 #include <protocol.h>
+#include <wire.h>
 #include "client.h"
 
+#define MAX_PARTIALS     8    /* messages being reassembled at once */
+#define MAX_FRAGMENTS    4096 /* in any one message */
+#define FRAGMENT_TIMEOUT 5    /* seconds to wait for the rest of one */
+
+/* a fragmented message, waiting for the rest of its fragments */
+typedef struct _partial_t
+{
+	struct in_addr  from;
+	unsigned int    id;
+	int             count;    /* 0 if this entry is free */
+	int             received;
+	char          **slices;   /* NULL until that fragment turns up */
+	size_t         *lens;
+	time_t          started;
+} partial_t;
+
 /* Global variables */
 
+/* File-level variables */
+static partial_t s_partials[MAX_PARTIALS]; /* only used by the listener */
+
 /* Function prototypes */
 int process_command();
+int process_broadcast (server_t *server, char *message, size_t len);
+int process_binary (server_t *server, char *message, size_t len);
+int forget_devices (server_t *server);
+int forget_server (server_t *server);
+int process_fragment (server_t *server, char *fragment);
+int process_binary_fragment (server_t *server, wire_reader_t *reader);
+int add_fragment (server_t *server, unsigned long id, unsigned long index,
+		  unsigned long count, const char *slice, size_t slice_len);
+void free_partial (partial_t *partial);
 int process_status_message (server_t *server, char *message);
+int process_binary_status (server_t *server, wire_reader_t *reader);
+int process_sequenced_message (server_t *server, char *message,
+			       int is_snapshot);
+int process_binary_sequenced (server_t *server, wire_reader_t *reader,
+			      int is_snapshot);
+int check_sequence (server_t *server, unsigned long seq, int is_snapshot,
+		    int *missed);
+void missed_sequence (server_t *server, unsigned long seq);
+int update_device (server_t *server, char *device_name,
+		   device_status_t status, unsigned long uptime,
+		   unsigned long no_users);
+int request_snapshot (server_t *server);
 
 /* This is the entry point for the listener thread */
 void *listen_for_status (void *nothing)
@@ -74,7 +115,7 @@ int process_command()
 	server_t *new_server;
 	struct sockaddr_in server_sa;
 	int recv_size, server_sa_len = sizeof (server_sa);
-	char recv_buffer[MAX_RECV_BUFFER];
+	char recv_buffer[MAX_RECV_BUFFER + 1];
 
 	pthread_mutex_lock (&g_socket_fd_mutex);
 	if ((recv_size = recvfrom (g_socket_fd, recv_buffer,
@@ -101,6 +142,8 @@ int process_command()
 			return (-1);
 		new_server->sa = server_sa;
 		new_server->devices_controlled = NULL;
+		new_server->have_seq = FALSE;
+		new_server->snapshot_asked = 0;
 
 		pthread_mutex_lock (&g_servers_mutex);
 		add_server (&g_servers, new_server);
@@ -116,48 +159,26 @@ int process_command()
 	new_server->last_heard_from = time (NULL);
 	pthread_mutex_unlock (&g_servers_mutex);
 
+	return process_broadcast (new_server, recv_buffer, recv_size);
+}
+
+int process_broadcast (server_t *new_server, char *recv_buffer, size_t len)
+{
+	if (wire_is_binary (recv_buffer, len))
+		return process_binary (new_server, recv_buffer, len);
+
 	/* Parse the string for broadcast information */
 	if (strncmp (recv_buffer, BROADCAST_INIT,
 		     strlen (BROADCAST_INIT)) == 0)
 	{
 		/* Initialisation message from the server */
-		if (g_debug)
-			fprintf (stderr, "Dropping stored information about"
-				 " server %s\n",
-				 inet_ntoa(new_server->sa.sin_addr));
-		/* remove knowledge of devices controlled */
-		pthread_mutex_lock (&g_servers_mutex);
-		while (new_server->devices_controlled)
-		{
-			if (rm_device(&new_server->devices_controlled,
-				      new_server->devices_controlled->data)< 0)
-			{
-				int real_errno = errno;
-				pthread_mutex_unlock (&g_servers_mutex);
-				errno = real_errno;
-				return (-1);
-			}
-		}
-		pthread_mutex_unlock (&g_servers_mutex);
-		return 0;
+		return forget_devices (new_server);
 	}
 	else if (strncmp (recv_buffer, BROADCAST_QUIT,
 			  strlen (BROADCAST_QUIT)) == 0)
 	{
-		if (g_debug)
-			fprintf (stderr, "Server %s quitting removing entry\n",
-				 inet_ntoa(new_server->sa.sin_addr));
 		/* the server has quit.  Remove it from our list */
-		pthread_mutex_lock (&g_servers_mutex);
-		if (rm_server (&g_servers, new_server) < 0)
-		{
-			int real_errno = errno;
-			pthread_mutex_unlock (&g_servers_mutex);
-			errno = real_errno;
-			return (-1);
-		}
-		pthread_mutex_unlock (&g_servers_mutex);
-		return 0;
+		return forget_server (new_server);
 	}
 	else if (strncmp (recv_buffer, BROADCAST_STATUS,
 			  strlen (BROADCAST_STATUS)) == 0)
@@ -175,6 +196,29 @@ int process_command()
 		pthread_mutex_unlock (&g_servers_mutex);
 		return 0;
 	}
+	else if (strncmp (recv_buffer, BROADCAST_FRAGMENT,
+			  strlen (BROADCAST_FRAGMENT)) == 0)
+	{
+		/* part of a message too big for one datagram */
+		return process_fragment (
+			new_server, recv_buffer + strlen (BROADCAST_FRAGMENT));
+	}
+	else if (strncmp (recv_buffer, BROADCAST_SNAPSHOT,
+			  strlen (BROADCAST_SNAPSHOT)) == 0)
+	{
+		/* full status, starting a new run of deltas */
+		return process_sequenced_message (
+			new_server, recv_buffer + strlen (BROADCAST_SNAPSHOT),
+			TRUE);
+	}
+	else if (strncmp (recv_buffer, BROADCAST_DELTA,
+			  strlen (BROADCAST_DELTA)) == 0)
+	{
+		/* status of the devices that changed */
+		return process_sequenced_message (
+			new_server, recv_buffer + strlen (BROADCAST_DELTA),
+			FALSE);
+	}
 	else 
 	{
 		/* unrecognised message */
@@ -184,6 +228,328 @@ int process_command()
 	return 0;
 }
 
+int process_binary (server_t *server, char *message, size_t len)
+{
+	/* the binary form of the broadcasts above - see wire.h */
+	wire_reader_t reader;
+
+	switch (wire_open (&reader, message, len))
+	{
+	case WIRE_BROADCAST_INIT:
+		return forget_devices (server);
+	case WIRE_BROADCAST_QUIT:
+		return forget_server (server);
+	case WIRE_BROADCAST_STATUS:
+		return process_binary_status (server, &reader);
+	case WIRE_BROADCAST_FRAGMENT:
+		return process_binary_fragment (server, &reader);
+	case WIRE_BROADCAST_SNAPSHOT:
+		return process_binary_sequenced (server, &reader, TRUE);
+	case WIRE_BROADCAST_DELTA:
+		return process_binary_sequenced (server, &reader, FALSE);
+	default:
+		errno = ENOTSUP;
+		return (-1);
+	}
+}
+
+int forget_devices (server_t *server)
+{
+	if (g_debug)
+		fprintf (stderr, "Dropping stored information about"
+			 " server %s\n",
+			 inet_ntoa(server->sa.sin_addr));
+	/* remove knowledge of devices controlled */
+	pthread_mutex_lock (&g_servers_mutex);
+	server->have_seq = FALSE;
+	while (server->devices_controlled)
+	{
+		if (rm_device(&server->devices_controlled,
+			      server->devices_controlled->data)< 0)
+		{
+			int real_errno = errno;
+			pthread_mutex_unlock (&g_servers_mutex);
+			errno = real_errno;
+			return (-1);
+		}
+	}
+	pthread_mutex_unlock (&g_servers_mutex);
+	return 0;
+}
+
+int forget_server (server_t *server)
+{
+	if (g_debug)
+		fprintf (stderr, "Server %s quitting removing entry\n",
+			 inet_ntoa(server->sa.sin_addr));
+	pthread_mutex_lock (&g_servers_mutex);
+	if (rm_server (&g_servers, server) < 0)
+	{
+		int real_errno = errno;
+		pthread_mutex_unlock (&g_servers_mutex);
+		errno = real_errno;
+		return (-1);
+	}
+	pthread_mutex_unlock (&g_servers_mutex);
+	return 0;
+}
+
+int process_fragment (server_t *server, char *fragment)
+{
+	/* We get "<id> <index> <count>\n<slice>" */
+	unsigned long id, index, count;
+	char *pos;
+
+	id = strtoul (fragment, &pos, 10);
+	index = strtoul (pos, &pos, 10);
+	count = strtoul (pos, &pos, 10);
+	if (*pos != '\n')
+	{
+		errno = EINVAL;
+		return (-1);
+	}
+	pos++;
+	return add_fragment (server, id, index, count, pos, strlen (pos));
+}
+
+int process_binary_fragment (server_t *server, wire_reader_t *reader)
+{
+	/* <id> <index> <count> then the slice, which is the rest */
+	unsigned long id, index, count;
+
+	id = wire_get_varint (reader);
+	index = wire_get_varint (reader);
+	count = wire_get_varint (reader);
+	if (reader->error)
+	{
+		errno = EINVAL;
+		return (-1);
+	}
+	return add_fragment (server, id, index, count,
+			     (const char *)reader->pos,
+			     reader->end - reader->pos);
+}
+
+int add_fragment (server_t *server, unsigned long id, unsigned long index,
+		  unsigned long count, const char *slice, size_t slice_len)
+{
+	/* Hang on to the slice until all count of them have turned up, then
+	   put the message back together and process it as if it had
+	   arrived in one piece.  Any message that isn't complete within
+	   FRAGMENT_TIMEOUT seconds has lost a fragment, and is dropped. */
+	partial_t *partial = NULL, *oldest = NULL;
+	time_t now = time (NULL);
+	char *pos, *message;
+	size_t total_len;
+	int i, retval;
+
+	if (count == 0 || count > MAX_FRAGMENTS || index >= count)
+	{
+		errno = EINVAL;
+		return (-1);
+	}
+
+	for (i = 0; i < MAX_PARTIALS; i++)
+	{
+		partial_t *this = &s_partials[i];
+
+		if (this->count && now - this->started > FRAGMENT_TIMEOUT)
+		{
+			if (g_debug)
+				fprintf (stderr, "Gave up on message %u from "
+					 "%s (%d of %d fragments)\n",
+					 this->id, inet_ntoa (this->from),
+					 this->received, this->count);
+			free_partial (this);
+		}
+		if (this->count && this->id == id &&
+		    this->from.s_addr == server->sa.sin_addr.s_addr)
+			partial = this;
+		else if (oldest == NULL || this->count == 0 ||
+			 (oldest->count && this->started < oldest->started))
+			oldest = this;
+	}
+
+	if (partial == NULL)
+	{
+		/* the first fragment to arrive - make room for the rest,
+		   pushing out the oldest message if we have to */
+		partial = oldest;
+		free_partial (partial);
+		partial->slices = calloc (count, sizeof (char *));
+		partial->lens = calloc (count, sizeof (size_t));
+		if (partial->slices == NULL || partial->lens == NULL)
+		{
+			free_partial (partial);
+			return (-1);
+		}
+		partial->from     = server->sa.sin_addr;
+		partial->id       = id;
+		partial->count    = count;
+		partial->received = 0;
+		partial->started  = now;
+	}
+	else if (partial->count != count)
+	{
+		errno = EINVAL; /* can't both be right */
+		free_partial (partial);
+		return (-1);
+	}
+
+	if (partial->slices[index] == NULL)
+	{
+		/* binary slices may hold NULs, so they're kept by length.
+		   The extra byte keeps an empty one from looking missing */
+		if ((partial->slices[index] = malloc (slice_len + 1)) == NULL)
+			return (-1);
+		memcpy (partial->slices[index], slice, slice_len);
+		partial->lens[index] = slice_len;
+		partial->received++;
+	}
+	if (partial->received < partial->count)
+		return 0;
+
+	/* that's all of it */
+	total_len = 0;
+	for (i = 0; i < partial->count; i++)
+		total_len += partial->lens[i];
+	if ((message = malloc (total_len + 1)) == NULL)
+	{
+		free_partial (partial);
+		return (-1);
+	}
+	for (i = 0, pos = message; i < partial->count; i++)
+	{
+		memcpy (pos, partial->slices[i], partial->lens[i]);
+		pos += partial->lens[i];
+	}
+	*pos = 0;
+	free_partial (partial);
+
+	if (strncmp (message, BROADCAST_FRAGMENT,
+		     strlen (BROADCAST_FRAGMENT)) == 0 ||
+	    (wire_is_binary (message, total_len) &&
+	     (unsigned char)message[1] == WIRE_BROADCAST_FRAGMENT))
+	{
+		errno = EINVAL; /* fragments of fragments?  No. */
+		retval = -1;
+	}
+	else
+	{
+		retval = process_broadcast (server, message, total_len);
+	}
+	free (message);
+	return retval;
+}
+
+void free_partial (partial_t *partial)
+{
+	int i;
+
+	for (i = 0; partial->slices && i < partial->count; i++)
+		free (partial->slices[i]);
+	free (partial->slices);
+	free (partial->lens);
+	memset (partial, 0, sizeof (partial_t));
+}
+
+int process_sequenced_message (server_t *server, char *message,
+			       int is_snapshot)
+{
+	/* We get <seq>\n followed by a status message.  A snapshot is
+	   always taken as it stands.  A delta should be numbered one more
+	   than the last snapshot or delta; an older one is a straggler and
+	   is dropped, and a newer one means we've missed something, so ask
+	   the server for a fresh snapshot. */
+	char *status;
+	unsigned long seq = strtoul (message, &status, 10);
+	int missed, retval = 0;
+
+	if (status == message)
+	{
+		errno = EINVAL; /* no sequence number */
+		return (-1);
+	}
+
+	pthread_mutex_lock (&g_servers_mutex);
+	/* a delta still has the latest on the devices it mentions */
+	if (check_sequence (server, seq, is_snapshot, &missed))
+		retval = process_status_message (server, status);
+	pthread_mutex_unlock (&g_servers_mutex);
+
+	if (missed)
+		missed_sequence (server, seq);
+	return retval;
+}
+
+int process_binary_sequenced (server_t *server, wire_reader_t *reader,
+			      int is_snapshot)
+{
+	/* as above, for <seq> <count> <status record>* */
+	unsigned long seq = wire_get_varint (reader);
+	int missed, retval = 0;
+
+	if (reader->error)
+	{
+		errno = EINVAL;
+		return (-1);
+	}
+
+	pthread_mutex_lock (&g_servers_mutex);
+	if (check_sequence (server, seq, is_snapshot, &missed))
+		retval = process_binary_status (server, reader);
+	pthread_mutex_unlock (&g_servers_mutex);
+
+	if (missed)
+		missed_sequence (server, seq);
+	return retval;
+}
+
+int check_sequence (server_t *server, unsigned long seq, int is_snapshot,
+		    int *missed)
+{
+	/* called with g_servers_mutex held.  Returns FALSE for a straggler
+	   that should be dropped, and sets *missed if there's a gap */
+	*missed = FALSE;
+	if (!is_snapshot)
+	{
+		if (server->have_seq && seq <= server->last_seq)
+			return FALSE;
+		*missed = (!server->have_seq || seq != server->last_seq + 1);
+	}
+	server->have_seq = TRUE;
+	server->last_seq = seq;
+	return TRUE;
+}
+
+void missed_sequence (server_t *server, unsigned long seq)
+{
+	if (g_debug)
+		fprintf (stderr, "Missed a delta from server %s "
+			 "(got %lu)\n",
+			 inet_ntoa(server->sa.sin_addr), seq);
+	if (request_snapshot (server) < 0)
+		perror ("request_snapshot()");
+}
+
+int request_snapshot (server_t *server)
+{
+	/* the server multicasts the snapshot, so there's no reply to wait
+	   for.  Don't keep asking while one is on its way. */
+	time_t now = time (NULL);
+
+	if (now - server->snapshot_asked < SNAPSHOT_RETRY_TIME)
+		return 0;
+	server->snapshot_asked = now;
+
+	/* broadcasts come from the server's own port */
+	if (sendto (g_request_fd, CLIENT_SNAPSHOT, strlen (CLIENT_SNAPSHOT), 0,
+		    (struct sockaddr *) &server->sa,
+		    sizeof (server->sa)) < 0)
+		return (-1);
+	return 0;
+}
+
 int process_status_message (server_t *server, char *message)
 {
 	/* We get a message of the format <device_name>\t<device_status>\n
@@ -197,7 +563,7 @@ int process_status_message (server_t *server, char *message)
 	while ((device_name = strtok ((strtok_setup ? NULL : message),
 				      delims)) != NULL)
 	{
-		device_t *device;
+		int retval = 0;
 		strtok_setup = TRUE;
 		device_status = strtok(NULL, delims);
 
@@ -207,23 +573,6 @@ int process_status_message (server_t *server, char *message)
 			break;
 		}
 		
-		if ((device = get_device (&server->devices_controlled, 
-					  device_name)) == NULL)
-		{
-			/* the device does not exist */
-			device = malloc (sizeof (device_t));
-			if (device == NULL)
-				return (-1);
-			memset (device, 0, sizeof (device_t));
-			device->device_name = strdup (device_name);
-			if (add_device (&server->devices_controlled,
-					device) < 0)
-			{
-				return (-1);
-			}
-		}
-
-		/* We have a device, update its status */
 		if (strncmp (device_status, "UP", strlen ("UP")) == 0)
 		{
 			/* we have "UP x y" where x is connect_time and 
@@ -233,34 +582,86 @@ int process_status_message (server_t *server, char *message)
 			char *y_str = strchr (x_str, ' ') + 1;
 			x = strtoul (x_str, NULL, 0);
 			y = strtoul (y_str, NULL, 0);
-			device->status = LINK_UP;
-			device->connect_time = x;
-			device->no_users = y;
+			retval = update_device (server, device_name, LINK_UP,
+						x, y);
 		}
 		else if (strcmp (device_status, "DOWN") == 0)
-		{
-			device->status = LINK_DOWN;
-			device->connect_time = 0;
-			device->no_users = 0;
-		}
+			retval = update_device (server, device_name,
+						LINK_DOWN, 0, 0);
 		else if (strcmp (device_status, "CONNECTING") == 0)
-		{
-			device->status = LINK_CONNECTING;
-			device->connect_time = 0;
-			device->no_users = 0;
-		}
+			retval = update_device (server, device_name,
+						LINK_CONNECTING, 0, 0);
 		else if (strcmp (device_status, "DISCONNECTING") == 0)
-		{
-			device->status = LINK_DISCONNECTING;
-			device->connect_time = 0;
-			device->no_users = 0;
-		}
+			retval = update_device (server, device_name,
+						LINK_DISCONNECTING, 0, 0);
 		else
 		{
 			fprintf (stderr, "Unknown status for device %s: %s\n",
 				 device_name, device_status);
 		}
+		if (retval < 0)
+			return (-1);
+	}
+	return 0;
+}
+
+int process_binary_status (server_t *server, wire_reader_t *reader)
+{
+	/* <count> <status record>*, called with g_servers_mutex held */
+	unsigned long count = wire_get_varint (reader), i;
+
+	for (i = 0; i < count && !reader->error; i++)
+	{
+		wire_status_t status;
+		char *device_name;
+		int retval;
+
+		if (wire_get_status (reader, &status) < 0)
+			break;
+		if ((device_name = strndup (status.name,
+					    status.name_len)) == NULL)
+			return (-1);
+		retval = update_device (server, device_name, status.status,
+					status.uptime, status.no_users);
+		free (device_name);
+		if (retval < 0)
+			return (-1);
+	}
+	if (reader->error)
+	{
+		fprintf (stderr, "Truncated binary status.\n");
+		errno = EINVAL;
+		return (-1);
+	}
+	return 0;
+}
+
+int update_device (server_t *server, char *device_name,
+		   device_status_t status, unsigned long uptime,
+		   unsigned long no_users)
+{
+	device_t *device;
+
+	if ((device = get_device (&server->devices_controlled, 
+				  device_name)) == NULL)
+	{
+		/* the device does not exist */
+		device = malloc (sizeof (device_t));
+		if (device == NULL)
+			return (-1);
+		memset (device, 0, sizeof (device_t));
+		device->device_name = strdup (device_name);
+		if (add_device (&server->devices_controlled,
+				device) < 0)
+		{
+			return (-1);
+		}
 	}
+
+	/* We have a device, update its status */
+	device->status = status;
+	device->connect_time = (status == LINK_UP) ? uptime : 0;
+	device->no_users = (status == LINK_UP) ? no_users : 0;
 	return 0;
 }
 
@@ -24,7 +24,7 @@
  * debug              | number    | 0 (false)
  * multicast_group    | string    | "239.255.42.42" (site-local admin group)
  * multicast_port     | number    | 6789
- * server_timeout     | number    | 60 (seconds)
+ * server_timeout     | number    | 120 (seconds)
  *
  * Currently, escaped characters are not supported, but support may be
  * added later...  Tabs and newlines are not accepted in strings.  IP
@@ -15,6 +15,7 @@
 
 #include <cliserv.h>
 #include <protocol.h>
+#include <wire.h>
 
 #include "notify.h"
 
@@ -50,6 +51,30 @@ int main(int argc, char *argv[])
 	inet_aton(g_serv_addr, &serv.sin_addr);
 	serv.sin_port        = htons(g_serv_port);
 
+	if (g_binary)
+	{
+		/* the compact form - see wire.h */
+		wire_buf_t buf;
+
+		wire_buf_init (&buf);
+		wire_begin (&buf, g_command == UP ? WIRE_NOTIFY_ISUP
+			    : WIRE_NOTIFY_ISDOWN);
+		wire_put_string (&buf, g_device);
+		if (buf.error)
+		{
+			perror ("wire_put_string()");
+			exit (EXIT_FAILURE);
+		}
+		if (sendto (socket_fd, buf.data, buf.len, 0,
+			    (struct sockaddr *)&serv, sizeof (serv)) != buf.len)
+		{
+			perror ("sendto()");
+			exit (EXIT_FAILURE);
+		}
+		wire_buf_free (&buf);
+		return EXIT_SUCCESS;
+	}
+
 	if (g_command == UP)
 	{
 		strcpy (send_buffer, NOTIFY_ISUP);
@@ -17,5 +17,6 @@ int read_config        ();
 extern char           *g_serv_addr;
 extern unsigned short  g_serv_port;
 extern int             g_debug;
+extern int             g_binary;
 extern command_t       g_command;
 extern char *	       g_device;
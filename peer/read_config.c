@@ -24,6 +24,7 @@
  * debug         | number    | 0 (false)
  * serv_addr     | string    | "192.168.55.103" (my machine!)
  * serv_port     | number    | 9876
+ * binary        | number    | 0 (1 = send the binary encoding)
  *
  * Currently, escaped characters are not supported, but support may be
  * added later...  Tabs and newlines are not accepted in strings.  IP
@@ -51,6 +52,7 @@
 
 /* Peer variables */
 int             g_debug          = FALSE;
+int             g_binary         = FALSE;
 char           *g_config_file    = DEFAULT_CONFIG_FILE;
 char           *g_serv_addr      = DEFAULT_SERV_ADDR;
 unsigned short  g_serv_port      = DEFAULT_SERV_PORT;
@@ -302,6 +304,9 @@ int parse_peer_section (char *peer_data)
 			else if ((strcasecmp (name, "serv_port") == 0) &&
 				 number_valid)
 				g_serv_port = numeric_value;
+			else if ((strcasecmp (name, "binary") == 0) &&
+				 number_valid)
+				g_binary = numeric_value;
 			else
 				fprintf(stderr,
 					"Invalid peer option %s\n", name);
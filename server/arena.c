@@ -0,0 +1,57 @@
+/* arena.c
+ * -------
+ *
+ * A bump allocator over one block of memory.  Everything taken from an
+ * arena goes when the arena does, with a single free(), so a group of
+ * objects that live and die together (one reading of the configuration,
+ * say) needs no bookkeeping for the individual pieces.  The block never
+ * moves, so pointers into it stay good for the arena's lifetime; the
+ * flip side is that it can't grow, and the caller has to know how much
+ * it will need up front.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "server.h"
+
+#define ARENA_ALIGN sizeof (long double)
+
+int arena_init (arena_t *arena, size_t size)
+{
+	if ((arena->base = (char *)malloc (size ? size : 1)) == NULL)
+	{
+		arena->size = arena->used = 0;
+		return (-1);
+	}
+	arena->size = size;
+	arena->used = 0;
+	return 0;
+}
+
+void *arena_alloc (arena_t *arena, size_t len)
+{
+	/* len bytes, uninitialised and suitably aligned for anything */
+	size_t start = (arena->used + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+
+	if (start > arena->size || len > arena->size - start)
+	{
+		errno = ENOMEM;
+		return NULL;
+	}
+	arena->used = start + len;
+	return arena->base + start;
+}
+
+size_t arena_space (size_t len)
+{
+	/* what arena_alloc (len) can take out of an arena, at most */
+	return len + ARENA_ALIGN - 1;
+}
+
+void arena_free (arena_t *arena)
+{
+	free (arena->base);
+	arena->base = NULL;
+	arena->size = arena->used = 0;
+}
@@ -0,0 +1,176 @@
+/* client_table.c
+ * --------------
+ *
+ * The known clients, kept in an open-addressed hash table keyed on their
+ * address.  Every datagram from a client starts with a lookup here, so
+ * this is a single probe in the common case rather than a walk over every
+ * client we've heard from.
+ *
+ * Clients live in the table itself - there is no allocation per client
+ * beyond its device bitset (see list_fns.c), if it ever connects to one.
+ * Collisions are resolved by linear probing, and a deletion shifts later
+ * entries of the same run back into the gap rather than leaving a
+ * tombstone, so lookups never slow down as clients come and go.  The
+ * catch is that deleting (or growing the table) moves other clients, so
+ * a client_t pointer is only good until the next register_client() or
+ * unregister_client(); anything that keeps one (the timing wheel and the
+ * devices' member vectors) is fixed up by relocate_client() as it moves.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "server.h"
+
+#define CLIENT_TABLE_MIN_SIZE 64 /* a power of two */
+
+/* Global variables */
+client_table_t g_clients = { NULL, 0, 0 };
+
+/* Local prototypes */
+static unsigned int client_slot      (client_table_t *table,
+				      struct in_addr inet_addr);
+static int          client_table_grow (client_table_t *table);
+static void         relocate_client  (client_t *to, client_t *from);
+
+static unsigned int client_slot (client_table_t *table,
+				 struct in_addr inet_addr)
+{
+	/* where a client with this address would like to be.  Addresses on
+	   the same subnet differ in their low bits, so give the high bits a
+	   stir before masking */
+	unsigned int hash = ntohl (inet_addr.s_addr) * 2654435761u;
+
+	return (hash ^ (hash >> 16)) & (table->size - 1);
+}
+
+client_t *find_client (struct in_addr inet_addr)
+{
+	client_table_t *table = &g_clients;
+	unsigned int slot;
+
+	if (table->size == 0)
+	{
+		errno = ENODEV;
+		return NULL;
+	}
+
+	for (slot = client_slot (table, inet_addr); table->slots[slot].in_use;
+	     slot = (slot + 1) & (table->size - 1))
+	{
+		if (table->slots[slot].sa.sin_addr.s_addr == inet_addr.s_addr)
+			return &table->slots[slot];
+	}
+	errno = ENODEV;
+	return NULL; // didn't find it
+}
+
+client_t *register_client (struct sockaddr_in *cli)
+{
+	/* make an entry for a new client.  Everything but the address is
+	   left empty for the caller to fill in. */
+	client_table_t *table = &g_clients;
+	client_t *client;
+	unsigned int slot;
+
+	if (find_client (cli->sin_addr) != NULL)
+	{
+		errno = EALREADY;
+		return NULL;
+	}
+
+	/* keep the runs short - no more than half full */
+	if ((table->count + 1) * 2 > table->size &&
+	    client_table_grow (table) < 0)
+		return NULL;
+
+	slot = client_slot (table, cli->sin_addr);
+	while (table->slots[slot].in_use)
+		slot = (slot + 1) & (table->size - 1);
+
+	client = &table->slots[slot];
+	memset (client, 0, sizeof (client_t));
+	memcpy (&client->sa, cli, sizeof (struct sockaddr_in));
+	client->in_use = TRUE;
+	table->count++;
+	return client;
+}
+
+int unregister_client (client_t *client)
+{
+	/* take the client out of the table.  It should already have been
+	   disconnected from its devices. */
+	client_table_t *table = &g_clients;
+	unsigned int mask = table->size - 1;
+	unsigned int gap, slot;
+
+	if (table->size == 0 || client < table->slots ||
+	    client >= table->slots + table->size || !client->in_use)
+	{
+		errno = ENODEV;
+		return (-1);
+	}
+	wheel_cancel (&client->timeout);
+	client_membership_free (client);
+	client->in_use = FALSE;
+	table->count--;
+
+	/* anything further along the run that would rather be in the gap
+	   (or before it) moves back, leaving a new gap behind */
+	gap = client - table->slots;
+	for (slot = (gap + 1) & mask; table->slots[slot].in_use;
+	     slot = (slot + 1) & mask)
+	{
+		unsigned int home = client_slot (table,
+						 table->slots[slot].sa.sin_addr);
+
+		/* stays put if its home is between the gap and here */
+		if (((slot - home) & mask) < ((slot - gap) & mask))
+			continue;
+		relocate_client (&table->slots[gap], &table->slots[slot]);
+		gap = slot;
+	}
+	return 0;
+}
+
+static int client_table_grow (client_table_t *table)
+{
+	/* double the table (or start one), and move everybody over */
+	unsigned int old_size = table->size, i;
+	client_t *old_slots = table->slots;
+	client_t *new_slots;
+
+	table->size = old_size ? old_size * 2 : CLIENT_TABLE_MIN_SIZE;
+	if ((new_slots = calloc (table->size, sizeof (client_t))) == NULL)
+	{
+		table->size = old_size;
+		return (-1);
+	}
+	table->slots = new_slots;
+
+	for (i = 0; i < old_size; i++)
+	{
+		unsigned int slot;
+
+		if (!old_slots[i].in_use)
+			continue;
+		slot = client_slot (table, old_slots[i].sa.sin_addr);
+		while (new_slots[slot].in_use)
+			slot = (slot + 1) & (table->size - 1);
+		relocate_client (&new_slots[slot], &old_slots[i]);
+	}
+	free (old_slots);
+	return 0;
+}
+
+static void relocate_client (client_t *to, client_t *from)
+{
+	/* move a client to another slot, and point everything that knows
+	   where it was at where it is now */
+	memcpy (to, from, sizeof (client_t));
+	from->in_use = FALSE;
+
+	to->timeout.arg = to;
+	wheel_timer_moved (&to->timeout);
+	client_moved (to);
+}
@@ -0,0 +1,101 @@
+/* device_log.c
+ * ------------
+ *
+ * Keeps what each device's link commands have written, so that a client
+ * can ask for it with LOG rather than somebody having to catch it on the
+ * server's terminal (which has gone away entirely once the server has
+ * forked off as a daemon).  Each device has a ring of command_log bytes,
+ * allocated the first time one of its commands writes anything; once it
+ * fills up, the oldest output makes way for the newest.  link_exec.c reads
+ * the commands' output and puts it here.
+ */
+
+#include <string.h>
+
+#include "server.h"
+
+void device_log_write (device_t *device, const char *data, size_t len)
+{
+	/* add len bytes to the end of the device's log */
+	device_log_t *log = device->log;
+	size_t size = g_command_log, end, first;
+
+	if (size == 0 || len == 0)
+		return;
+
+	if (log == NULL)
+	{
+		log = (device_log_t *)malloc (sizeof (device_log_t) + size);
+		if (log == NULL)
+			return; /* this output is lost, that's all */
+		log->start   = 0;
+		log->len     = 0;
+		log->dropped = FALSE;
+		device->log = log;
+	}
+
+	/* only the end of something too big will be kept anyway */
+	if (len > size)
+	{
+		data += len - size;
+		len = size;
+		log->dropped = TRUE;
+	}
+	if (log->len + len > size)
+	{
+		size_t drop = log->len + len - size;
+
+		log->start   = (log->start + drop) % size;
+		log->len    -= drop;
+		log->dropped = TRUE;
+	}
+
+	end = (log->start + log->len) % size;
+	first = (len < size - end) ? len : size - end;
+	memcpy (log->data + end, data, first);
+	memcpy (log->data, data + first, len - first);
+	log->len += len;
+}
+
+size_t device_log_tail (device_t *device, unsigned long lines,
+			const char *part[2], size_t part_len[2])
+{
+	/* the last lines lines of the device's log, or all of it if lines is
+	   0.  The ring may wrap, so they come back in two parts, one after
+	   the other; either may be empty.  Returns the total length. */
+	device_log_t *log = device->log;
+	size_t size = g_command_log, begin = 0, pos, first;
+	unsigned long seen = 0;
+
+	part[0] = part[1] = "";
+	part_len[0] = part_len[1] = 0;
+	if (log == NULL || log->len == 0)
+		return 0;
+
+	/* count newlines back from the end, not counting one that finishes
+	   the last line */
+	pos = log->len - 1;
+	while (pos-- > 0)
+	{
+		if (log->data[(log->start + pos) % size] == '\n')
+		{
+			begin = pos + 1;
+			if (++seen == lines)
+				break;
+		}
+	}
+	/* short of that many, it's the lot - less whatever is left of a
+	   line that was partly dropped */
+	if (seen != lines && !log->dropped)
+		begin = 0;
+
+	pos = (log->start + begin) % size;
+	first = log->len - begin;
+	if (first > size - pos)
+		first = size - pos;
+	part[0]     = log->data + pos;
+	part_len[0] = first;
+	part[1]     = log->data;
+	part_len[1] = log->len - begin - first;
+	return log->len - begin;
+}
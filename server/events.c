@@ -0,0 +1,250 @@
+/* events.c
+ * --------
+ *
+ * A small epoll based event loop for the link server.  Sockets, timers
+ * (timerfd) and signals (signalfd) are all just file descriptors, so the
+ * main loop can wait on every one of them at once and only run the piece
+ * of work that is actually due.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/signalfd.h>
+
+#include "server.h"
+
+#define MAX_EVENTS 32
+
+typedef enum _event_kind_t
+{
+	EVENT_FD,
+	EVENT_TIMER,
+	EVENT_SIGNAL
+} event_kind_t;
+
+typedef struct _event_t
+{
+	event_kind_t     kind;
+	event_handler_t  handler;
+	void            *arg;
+} event_t;
+
+/* File-level variables */
+static int      s_epoll_fd   = -1;
+static event_t *s_events     = NULL; /* indexed by file descriptor */
+static int      s_n_events   = 0;
+static int      s_keep_going = TRUE;
+static void   (*s_batch_hook) (void) = NULL;
+
+/* Local prototypes */
+static int event_register (int fd, event_kind_t kind,
+			   event_handler_t handler, void *arg);
+
+int event_init (void)
+{
+	if (s_epoll_fd != -1) // already done
+		return 0;
+
+	if ((s_epoll_fd = epoll_create1 (EPOLL_CLOEXEC)) < 0)
+		return (-1);
+	return 0;
+}
+
+static int event_register (int fd, event_kind_t kind,
+			   event_handler_t handler, void *arg)
+{
+	struct epoll_event ev;
+
+	if (fd >= s_n_events)
+	{
+		int new_size = fd + 16;
+		event_t *new_events = realloc (s_events,
+					       new_size * sizeof (event_t));
+		if (new_events == NULL)
+			return (-1);
+		memset (new_events + s_n_events, 0,
+			(new_size - s_n_events) * sizeof (event_t));
+		s_events   = new_events;
+		s_n_events = new_size;
+	}
+
+	memset (&ev, 0, sizeof (ev));
+	ev.events  = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl (s_epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return (-1);
+
+	s_events[fd].kind    = kind;
+	s_events[fd].handler = handler;
+	s_events[fd].arg     = arg;
+	return 0;
+}
+
+int event_add (int fd, event_handler_t handler, void *arg)
+{
+	return event_register (fd, EVENT_FD, handler, arg);
+}
+
+int event_remove (int fd)
+{
+	if (fd < 0 || fd >= s_n_events || s_events[fd].handler == NULL)
+	{
+		errno = ENOENT;
+		return (-1);
+	}
+
+	/* clear the slot first - if this happens in the middle of a batch
+	   from epoll_wait(), any later event for this fd is dropped */
+	s_events[fd].handler = NULL;
+	s_events[fd].arg     = NULL;
+	return epoll_ctl (s_epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+}
+
+int event_timer_new (event_handler_t handler, void *arg)
+{
+	int timer_fd = timerfd_create (CLOCK_MONOTONIC,
+				       TFD_NONBLOCK | TFD_CLOEXEC);
+	if (timer_fd < 0)
+		return (-1);
+
+	if (event_register (timer_fd, EVENT_TIMER, handler, arg) < 0)
+	{
+		int real_errno = errno;
+		close (timer_fd);
+		errno = real_errno;
+		return (-1);
+	}
+	return timer_fd;
+}
+
+long event_now_ms (void)
+{
+	/* the clock the timers run on, in ms.  It only ever goes forwards */
+	struct timespec now;
+
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000L + now.tv_nsec / 1000000L;
+}
+
+int event_timer_set (int timer_fd, int initial_ms, int interval_ms)
+{
+	/* initial_ms == 0 disarms the timer, interval_ms == 0 makes it a
+	   one-shot */
+	struct itimerspec spec;
+
+	spec.it_value.tv_sec     = initial_ms / 1000;
+	spec.it_value.tv_nsec    = (initial_ms % 1000) * 1000000L;
+	spec.it_interval.tv_sec  = interval_ms / 1000;
+	spec.it_interval.tv_nsec = (interval_ms % 1000) * 1000000L;
+
+	return timerfd_settime (timer_fd, 0, &spec, NULL);
+}
+
+int event_signal_new (const int *signals, int n_signals,
+		      event_handler_t handler, void *arg)
+{
+	/* the signals are blocked so that they are only ever delivered
+	   through the signalfd */
+	sigset_t mask;
+	int i, signal_fd;
+
+	sigemptyset (&mask);
+	for (i = 0; i < n_signals; i++)
+		sigaddset (&mask, signals[i]);
+	if (sigprocmask (SIG_BLOCK, &mask, NULL) < 0)
+		return (-1);
+
+	if ((signal_fd = signalfd (-1, &mask, SFD_NONBLOCK | SFD_CLOEXEC))
+	    < 0)
+		return (-1);
+
+	if (event_register (signal_fd, EVENT_SIGNAL, handler, arg) < 0)
+	{
+		int real_errno = errno;
+		close (signal_fd);
+		errno = real_errno;
+		return (-1);
+	}
+	return signal_fd;
+}
+
+int event_loop (void)
+{
+	struct epoll_event events[MAX_EVENTS];
+
+	s_keep_going = TRUE;
+	while (s_keep_going)
+	{
+		int i, n_ready;
+
+		n_ready = epoll_wait (s_epoll_fd, events, MAX_EVENTS, -1);
+		if (n_ready < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return (-1);
+		}
+
+		for (i = 0; i < n_ready; i++)
+		{
+			int     fd = events[i].data.fd;
+			event_t event;
+
+			if (fd >= s_n_events || s_events[fd].handler == NULL)
+				continue; /* removed earlier in this batch */
+			/* take a copy - a handler may add events and move
+			   the table */
+			event = s_events[fd];
+
+			switch (event.kind)
+			{
+			case EVENT_TIMER:
+			{
+				/* clear the expiry count before the
+				   handler gets a chance to re-arm it */
+				uint64_t expirations;
+				if (read (fd, &expirations,
+					  sizeof (expirations)) < 0)
+					break; /* spurious wakeup */
+				event.handler (fd, event.arg);
+				break;
+			}
+			case EVENT_SIGNAL:
+			{
+				struct signalfd_siginfo info;
+				while (read (fd, &info, sizeof (info))
+				       == sizeof (info))
+				{
+					event.handler (info.ssi_signo,
+							event.arg);
+					if (s_events[fd].handler == NULL)
+						break;
+				}
+				break;
+			}
+			default:
+				event.handler (fd, event.arg);
+				break;
+			}
+		}
+
+		if (s_batch_hook != NULL)
+			s_batch_hook ();
+	}
+	return 0;
+}
+
+void event_set_batch_hook (void (*hook) (void))
+{
+	/* hook is run once after each batch of events has been handled */
+	s_batch_hook = hook;
+}
+
+void event_stop (void)
+{
+	/* the loop gives up once the current batch has been handled */
+	s_keep_going = FALSE;
+}
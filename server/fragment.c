@@ -0,0 +1,121 @@
+/* fragment.c
+ * ----------
+ *
+ * Splits messages that won't fit in a single datagram.  A message longer
+ * than MAX_SEND_BUFFER goes out as a run of datagrams of the form
+ *
+ *   <prefix>FRAGMENT <id> <index> <count>\n<slice>
+ *
+ * where the slices, taken in index order, add up to the original message.
+ * Slices end on a record delimiter (the end of a device's entry) unless
+ * one record on its own is too big to fit.
+ *
+ * Binary messages (see wire.h) are split the same way, into
+ *
+ *   <magic> <fragment type> <id> <index> <count> <slice>
+ *
+ * except that their slices are plain byte ranges of the whole message.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <stdatomic.h>
+
+#include <protocol.h>
+#include <wire.h>
+#include "server.h"
+
+/* "<id> <index> <count>\n", at their longest */
+#define FRAGMENT_NUMBERS_MAX_LEN 33
+
+/* the same, as a binary header */
+#define FRAGMENT_BINARY_HEADER_LEN (WIRE_HEADER_LEN + 3 * WIRE_VARINT_MAX_LEN)
+
+/* File-level variables */
+static atomic_uint s_next_id = 0; /* workers split their replies too */
+
+/* Local prototypes */
+static size_t slice_end (const char *message, size_t pos, size_t len,
+			 size_t max_slice, char delim);
+
+int fragment_message (const char *prefix, const char *message, size_t len,
+		      char delim, fragment_sink_t sink, void *arg)
+{
+	char datagram[MAX_SEND_BUFFER];
+	size_t max_slice, pos;
+	unsigned int id;
+	int index, count;
+
+	if (len <= MAX_SEND_BUFFER)
+		return sink (arg, message, len);
+
+	max_slice = MAX_SEND_BUFFER - strlen (prefix) - FRAGMENT_NUMBERS_MAX_LEN;
+
+	/* the count goes in every fragment, so work it out first */
+	for (pos = 0, count = 0; pos < len; count++)
+		pos = slice_end (message, pos, len, max_slice, delim);
+
+	id = atomic_fetch_add (&s_next_id, 1);
+	for (pos = 0, index = 0; pos < len; index++)
+	{
+		size_t end = slice_end (message, pos, len, max_slice, delim);
+		int header_len = sprintf (datagram, "%s%u %d %d\n", prefix, id,
+					  index, count);
+
+		memcpy (datagram + header_len, message + pos, end - pos);
+		if (sink (arg, datagram, header_len + end - pos) < 0)
+			return (-1);
+		pos = end;
+	}
+	return 0;
+}
+
+int fragment_binary (wire_type_t type, const char *message, size_t len,
+		     fragment_sink_t sink, void *arg)
+{
+	unsigned char datagram[MAX_SEND_BUFFER];
+	size_t max_slice = MAX_SEND_BUFFER - FRAGMENT_BINARY_HEADER_LEN, pos;
+	unsigned int id;
+	int index, count;
+
+	if (len <= MAX_SEND_BUFFER)
+		return sink (arg, message, len);
+
+	count = (len + max_slice - 1) / max_slice;
+	id = atomic_fetch_add (&s_next_id, 1);
+	for (pos = 0, index = 0; pos < len; index++)
+	{
+		size_t slice = len - pos < max_slice ? len - pos : max_slice;
+		size_t header_len = 0;
+
+		datagram[header_len++] = WIRE_MAGIC;
+		datagram[header_len++] = type;
+		header_len += wire_encode_varint (datagram + header_len, id);
+		header_len += wire_encode_varint (datagram + header_len, index);
+		header_len += wire_encode_varint (datagram + header_len, count);
+
+		memcpy (datagram + header_len, message + pos, slice);
+		if (sink (arg, (char *)datagram, header_len + slice) < 0)
+			return (-1);
+		pos += slice;
+	}
+	return 0;
+}
+
+static size_t slice_end (const char *message, size_t pos, size_t len,
+			 size_t max_slice, char delim)
+{
+	/* the end of the longest run of whole records starting at pos that
+	   fits in max_slice, or as much as fits if not even one does */
+	size_t end;
+
+	if (len - pos <= max_slice)
+		return len;
+
+	for (end = pos + max_slice; end > pos; end--)
+	{
+		if (message[end - 1] == delim)
+			return end;
+	}
+	return pos + max_slice;
+}
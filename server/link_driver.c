@@ -0,0 +1,355 @@
+/* link_driver.c
+ * -------------
+ *
+ * Brings links up and down through the driver each device was given (see
+ * link_driver.h), or through link_exec.c's commands if it wasn't.
+ * A driver is called in-process, so a transition costs a function call
+ * rather than a fork, a shell and an exec; it doesn't wait in link_exec's
+ * queue either, having no process to take up room.
+ *
+ * Drivers are looked up once, after the config has been read: first
+ * among the ones built in here, then with dlopen().  A device whose
+ * driver can't be found is reported and falls back to its commands.
+ *
+ * The one built-in driver, netlink, sets IFF_UP on an interface (the
+ * device's driver_arg, or failing that its name) with an RTM_NEWLINK, and
+ * reports the link as up once the interface is both up and running.
+ * It runs on the event loop, so it gives the kernel no more than
+ * NETLINK_TIMEOUT_MS to answer, and a reply that doesn't fit or doesn't
+ * make sense is an error rather than a reason to wait for another.
+ */
+
+#include <errno.h>
+#include <string.h>
+#include <dlfcn.h>
+#include <sys/time.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#include <link_driver.h>
+#include "server.h"
+
+#define NETLINK_TIMEOUT_MS 500 /* for the kernel to answer a request */
+
+/* a driver loaded with dlopen() */
+typedef struct _loaded_driver_t
+{
+	struct _loaded_driver_t *next;
+	const char              *file; /* as given to dlopen() */
+	void                    *handle;
+	const link_driver_t     *driver;
+} loaded_driver_t;
+
+/* File-level variables */
+static loaded_driver_t *s_loaded        = NULL;
+static int              s_netlink_fd    = -1;
+static unsigned int     s_netlink_seq   = 0;
+
+/* Local prototypes */
+static const link_driver_t *driver_load (const char *file);
+static const char *driver_arg    (device_t *device);
+static int  netlink_link         (int type, const char *ifname,
+				  unsigned int flags, unsigned int *current);
+static int  netlink_up           (const char *device, const char *arg);
+static int  netlink_down         (const char *device, const char *arg);
+static int  netlink_poll         (const char *device, const char *arg);
+
+static const link_driver_t s_netlink_driver =
+{
+	LINK_DRIVER_VERSION,
+	"netlink",
+	netlink_up,
+	netlink_down,
+	netlink_down, /* there's nothing more forceful than down */
+	netlink_poll
+};
+
+static const char *s_command_names[] = { "up", "down", "force_down" };
+
+static const link_driver_t *s_builtin_drivers[] =
+{
+	&s_netlink_driver
+};
+
+#define N_BUILTIN_DRIVERS \
+	(sizeof (s_builtin_drivers) / sizeof (s_builtin_drivers[0]))
+
+static const link_driver_t *driver_load (const char *file)
+{
+	/* the driver in the shared object file, loading it if that hasn't
+	   been done already, or NULL */
+	loaded_driver_t *loaded;
+	const link_driver_t *driver;
+	void *handle;
+
+	for (loaded = s_loaded; loaded; loaded = loaded->next)
+	{
+		if (strcmp (loaded->file, file) == 0)
+			return loaded->driver;
+	}
+
+	if ((handle = dlopen (file, RTLD_NOW | RTLD_LOCAL)) == NULL)
+	{
+		fprintf (stderr, "dlopen(): %s\n", dlerror ());
+		return NULL;
+	}
+	driver = (const link_driver_t *)dlsym (handle, LINK_DRIVER_SYMBOL);
+	if (driver == NULL || driver->version != LINK_DRIVER_VERSION ||
+	    driver->up == NULL || driver->down == NULL ||
+	    driver->force_down == NULL)
+	{
+		fprintf (stderr, "%s: no usable %s (version %d)\n", file,
+			 LINK_DRIVER_SYMBOL, LINK_DRIVER_VERSION);
+		dlclose (handle);
+		return NULL;
+	}
+
+	if ((loaded = (loaded_driver_t *)malloc (sizeof (loaded_driver_t)))
+	    == NULL)
+	{
+		dlclose (handle);
+		return NULL;
+	}
+	loaded->file   = file;
+	loaded->handle = handle;
+	loaded->driver = driver;
+	loaded->next   = s_loaded;
+	s_loaded = loaded;
+	return driver;
+}
+
+int link_drivers_init (void)
+{
+	/* find every device's driver.  Returns the number that couldn't be
+	   found (and will use their commands instead) */
+	device_list_t *list_pos;
+	int missing = 0;
+
+	for (list_pos = g_devices; list_pos; list_pos = list_pos->next)
+	{
+		device_t *device = list_pos->data;
+		unsigned int i;
+
+		device->link_driver = NULL;
+		if (device->driver.len == 0)
+			continue;
+
+		for (i = 0; i < N_BUILTIN_DRIVERS; i++)
+		{
+			if (strcmp (s_builtin_drivers[i]->name,
+				    device->driver.str) == 0)
+				device->link_driver = s_builtin_drivers[i];
+		}
+		if (device->link_driver == NULL &&
+		    (device->link_driver = driver_load (device->driver.str))
+		    == NULL)
+		{
+			fprintf (stderr, "Device %s: no driver %s, using its "
+				 "commands\n", device->device_name.str,
+				 device->driver.str);
+			missing++;
+		}
+	}
+	return missing;
+}
+
+static const char *driver_arg (device_t *device)
+{
+	return device->driver_arg.str ? device->driver_arg.str : "";
+}
+
+int link_driver_start (device_t *device, link_command_t command)
+{
+	/* set the command going, one way or the other */
+	const link_driver_t *driver = device->link_driver;
+	int retval;
+
+	if (driver == NULL)
+		return link_exec_start (device, command);
+
+	switch (command)
+	{
+	case LINK_CMD_UP:
+		retval = driver->up (device->device_name.str,
+				     driver_arg (device));
+		break;
+	case LINK_CMD_DOWN:
+		retval = driver->down (device->device_name.str,
+				       driver_arg (device));
+		break;
+	default:
+		retval = driver->force_down (device->device_name.str,
+					     driver_arg (device));
+		break;
+	}
+	if (retval < 0)
+	{
+		int real_errno = errno;
+
+		fprintf (stderr, "%s driver: %s for %s: %s\n", driver->name,
+			 s_command_names[command], device->device_name.str,
+			 strerror (errno));
+		errno = real_errno;
+		return (-1);
+	}
+
+	/* as if a command had exited with 0 */
+	link_command_done (device, command, 0);
+	return 0;
+}
+
+void link_drivers_poll (void)
+{
+	/* ask the drivers how the links on the move are getting on, and
+	   move the devices on as the peer would */
+	int index;
+
+	for (index = 0; index < g_n_devices; index++)
+	{
+		device_status_t status = g_device_state.status[index];
+		device_t *device;
+		int link;
+
+		if (status != LINK_CONNECTING && status != LINK_DISCONNECTING)
+			continue;
+		device = device_by_index (index);
+		if (device->link_driver == NULL ||
+		    device->link_driver->poll == NULL)
+			continue;
+
+		link = device->link_driver->poll (device->device_name.str,
+						  driver_arg (device));
+		if (status == LINK_CONNECTING && link == LINK_DRIVER_LINK_UP)
+			alter_device_status (device, LINK_UP);
+		else if (status == LINK_DISCONNECTING &&
+			 link == LINK_DRIVER_LINK_DOWN)
+			alter_device_status (device, LINK_DOWN);
+	}
+}
+
+static int netlink_link (int type, const char *ifname, unsigned int flags,
+			 unsigned int *current)
+{
+	/* RTM_NEWLINK: set the interface's IFF_UP as in flags.  RTM_GETLINK:
+	   put its flags in *current.  Either way, wait for the kernel's
+	   answer, which comes straight back. */
+	struct
+	{
+		struct nlmsghdr  header;
+		struct ifinfomsg info;
+	} request;
+	union
+	{
+		struct nlmsghdr header; /* for the alignment */
+		char            buf[8192];
+	} reply;
+	struct sockaddr_nl kernel;
+	int index;
+
+	if ((index = if_nametoindex (ifname)) == 0)
+		return (-1);
+	if (s_netlink_fd < 0)
+	{
+		struct timeval timeout;
+
+		if ((s_netlink_fd = socket (AF_NETLINK,
+					    SOCK_RAW | SOCK_CLOEXEC,
+					    NETLINK_ROUTE)) < 0)
+			return (-1);
+		timeout.tv_sec  = NETLINK_TIMEOUT_MS / 1000;
+		timeout.tv_usec = (NETLINK_TIMEOUT_MS % 1000) * 1000;
+		if (setsockopt (s_netlink_fd, SOL_SOCKET, SO_RCVTIMEO,
+				&timeout, sizeof (timeout)) < 0)
+		{
+			close (s_netlink_fd);
+			s_netlink_fd = -1;
+			return (-1);
+		}
+	}
+
+	memset (&request, 0, sizeof (request));
+	request.header.nlmsg_len   = sizeof (request);
+	request.header.nlmsg_type  = type;
+	request.header.nlmsg_flags = NLM_F_REQUEST;
+	if (type == RTM_NEWLINK)
+		request.header.nlmsg_flags |= NLM_F_ACK;
+	request.header.nlmsg_seq   = ++s_netlink_seq;
+	request.info.ifi_family    = AF_UNSPEC;
+	request.info.ifi_index     = index;
+	request.info.ifi_flags     = flags;
+	request.info.ifi_change    = (type == RTM_NEWLINK) ? IFF_UP : 0;
+
+	memset (&kernel, 0, sizeof (kernel));
+	kernel.nl_family = AF_NETLINK;
+	if (sendto (s_netlink_fd, &request, sizeof (request), 0,
+		    (struct sockaddr *) &kernel, sizeof (kernel)) < 0)
+		return (-1);
+
+	for (;;)
+	{
+		struct nlmsghdr *header;
+		int len = recv (s_netlink_fd, &reply, sizeof (reply),
+				MSG_TRUNC);
+
+		if (len < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			return (-1); /* EAGAIN if the kernel kept quiet */
+		}
+		if (len > (int)sizeof (reply))
+		{
+			errno = EMSGSIZE;
+			return (-1);
+		}
+		for (header = &reply.header; NLMSG_OK (header, len);
+		     header = NLMSG_NEXT (header, len))
+		{
+			if (header->nlmsg_seq != s_netlink_seq)
+				continue; /* left over from an earlier one */
+			if (header->nlmsg_type == NLMSG_ERROR)
+			{
+				struct nlmsgerr *err = (struct nlmsgerr *)
+					NLMSG_DATA (header);
+				if (err->error == 0)
+					return 0;
+				errno = -err->error;
+				return (-1);
+			}
+			if (header->nlmsg_type == RTM_NEWLINK && current)
+			{
+				struct ifinfomsg *info = (struct ifinfomsg *)
+					NLMSG_DATA (header);
+				*current = info->ifi_flags;
+				return 0;
+			}
+		}
+		if (len > 0)
+		{
+			/* a message cut short */
+			errno = EPROTO;
+			return (-1);
+		}
+	}
+}
+
+static int netlink_up (const char *device, const char *arg)
+{
+	return netlink_link (RTM_NEWLINK, *arg ? arg : device, IFF_UP, NULL);
+}
+
+static int netlink_down (const char *device, const char *arg)
+{
+	return netlink_link (RTM_NEWLINK, *arg ? arg : device, 0, NULL);
+}
+
+static int netlink_poll (const char *device, const char *arg)
+{
+	unsigned int flags;
+
+	if (netlink_link (RTM_GETLINK, *arg ? arg : device, 0, &flags) < 0)
+		return (-1);
+	return ((flags & IFF_UP) && (flags & IFF_RUNNING)) ?
+		LINK_DRIVER_LINK_UP : LINK_DRIVER_LINK_DOWN;
+}
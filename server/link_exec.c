@@ -0,0 +1,576 @@
+/* link_exec.c
+ * -----------
+ *
+ * Runs the link_up/link_down/link_force_down commands without blocking
+ * the server.  Each command is started with posix_spawnp() and its exit is
+ * picked up by the event loop, through a pidfd where the kernel supports
+ * them and through SIGCHLD on a signalfd where it doesn't.  Once the child
+ * has exited, link_command_done() finishes off the transition.
+ *
+ * The commands were split into words when the config was read (see
+ * read_config.c), so they are run directly, with no shell in between
+ * unless the device asked for one with shell = 1.
+ *
+ * posix_spawn() starts the child in the server's own address space, the
+ * way vfork() does, and it execs before the server carries on.  Nothing is
+ * copied, so a command costs the same however big the client and device
+ * tables have grown, and there's no call for a helper process forked
+ * while the server was still small.  Older glibc falls back to a real
+ * fork() when any spawn flags are set, unless POSIX_SPAWN_USEVFORK is set
+ * as well, so it is.
+ *
+ * A command's stdout and stderr both go down one pipe, read without
+ * blocking from the event loop into the device's log (see device_log.c),
+ * each line headed with the command it came from.  A command that fails
+ * has how it ended added after its output.  With command_log = 0 the
+ * commands write wherever the server does, as they always did.
+ *
+ * No more than link_commands of them run at once.  The rest queue up,
+ * force_down first, then down, then up, so that links being dropped let
+ * go of whatever they hold before new ones want it.  A device has at most
+ * one up or down waiting, and one force_down: a repeat of either is
+ * dropped, and an up or down is superseded by a newer, different command
+ * for the same device (a waiting force_down still runs, ahead of whatever
+ * follows it).  How many commands queued and how long they waited is
+ * reported on SIGUSR1.
+ */
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <signal.h>
+#include <spawn.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/syscall.h>
+
+#include "server.h"
+
+#define FOLLOWUP_DELAY_MS 2000 /* give a kill command a chance to work */
+#define N_PRIORITIES      3    /* force_down, down, up */
+#define OUTPUT_CHUNK      1024 /* read from a command's pipe at a time */
+
+/* never a fork() - see above */
+#ifdef POSIX_SPAWN_USEVFORK
+#define SPAWN_FLAGS (POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_USEVFORK)
+#else
+#define SPAWN_FLAGS POSIX_SPAWN_SETSIGMASK
+#endif
+
+extern char **environ;
+
+/* a command which is waiting to run, or running */
+struct _link_job_t
+{
+	struct _link_job_t *next;
+	pid_t               pid;     /* 0 while it waits */
+	int                 pidfd;   /* -1 if reaped through SIGCHLD */
+	device_t           *device;
+	link_command_t      command;
+	char              **argv;
+	long                queued_at; /* event_now_ms() */
+	int                 output_fd; /* its stdout and stderr, or -1 */
+	int                 line_start; /* the next output starts a line */
+};
+
+/* what each kind of command has been up to */
+typedef struct _link_stats_t
+{
+	unsigned long run;
+	unsigned long queued;
+	unsigned long superseded;
+	unsigned long waited;     /* queued, and since started */
+	long          wait_total; /* ms, over those */
+	long          wait_max;
+} link_stats_t;
+
+/* File-level variables */
+static link_job_t  *s_jobs      = NULL; /* running */
+static int          s_n_running = 0;
+static link_job_t  *s_queue[N_PRIORITIES];      /* waiting, oldest first */
+static link_job_t  *s_queue_tail[N_PRIORITIES];
+static link_stats_t s_stats[LINK_CMD_FORCE_DOWN + 1];
+static int          s_sigchld_fd = -1;
+
+/* Local prototypes */
+static int  handle_pidfd    (int fd, void *arg);
+static int  handle_sigchld  (int signum, void *arg);
+static int  handle_followup (int fd, void *arg);
+static int  handle_output   (int fd, void *arg);
+static int  job_read_output (link_job_t *job);
+static void job_log         (link_job_t *job, const char *data, size_t len);
+static void job_log_status  (link_job_t *job, int status);
+static void job_finished    (link_job_t *job, int status);
+static int  job_spawn       (link_job_t *job);
+static int  job_priority    (link_command_t command);
+static void job_enqueue     (link_job_t *job);
+static void job_dequeue     (link_job_t *job);
+static void link_exec_drain (void);
+
+static const char *command_name (link_command_t command)
+{
+	switch (command)
+	{
+	case LINK_CMD_UP:
+		return "link_up";
+	case LINK_CMD_DOWN:
+		return "link_down";
+	default:
+		return "link_force_down";
+	}
+}
+
+static int job_priority (link_command_t command)
+{
+	/* which queue the command waits in - the lower, the sooner */
+	switch (command)
+	{
+	case LINK_CMD_FORCE_DOWN:
+		return 0;
+	case LINK_CMD_DOWN:
+		return 1;
+	default:
+		return 2;
+	}
+}
+
+static void job_enqueue (link_job_t *job)
+{
+	int priority = job_priority (job->command);
+
+	job->next = NULL;
+	if (s_queue[priority] == NULL)
+		s_queue[priority] = job;
+	else
+		s_queue_tail[priority]->next = job;
+	s_queue_tail[priority] = job;
+	if (job->command == LINK_CMD_FORCE_DOWN)
+		job->device->force_down_queued = TRUE;
+	else
+		job->device->queued_job = job;
+}
+
+static void job_dequeue (link_job_t *job)
+{
+	int priority = job_priority (job->command);
+	link_job_t **pp_job = &s_queue[priority], *prev = NULL;
+
+	while (*pp_job && *pp_job != job)
+	{
+		prev = *pp_job;
+		pp_job = &(*pp_job)->next;
+	}
+	if (*pp_job == NULL)
+		return;
+	*pp_job = job->next;
+	if (s_queue_tail[priority] == job)
+		s_queue_tail[priority] = prev;
+	if (job->command == LINK_CMD_FORCE_DOWN)
+		job->device->force_down_queued = FALSE;
+	else if (job->device->queued_job == job)
+		job->device->queued_job = NULL;
+}
+
+int link_exec_start (device_t *device, link_command_t command)
+{
+	/* run the device's command, now if there's room for it, or once its
+	   turn comes */
+	link_job_t *job, *queued = device->queued_job;
+	char **argv = device->link_argv[command];
+
+	if (argv == NULL)
+	{
+		/* nothing configured - treat it as an instant success, the
+		   way system(NULL) used to */
+		link_command_done (device, command, 0);
+		return 0;
+	}
+
+	if (queued != NULL)
+	{
+		if (queued->command == command)
+			return 0; /* it's already waiting */
+		if (g_debug)
+			fprintf (stderr, "%s(): %s superseded by %s\n",
+				 command_name (queued->command),
+				 device->device_name.str,
+				 command_name (command));
+		job_dequeue (queued);
+		s_stats[queued->command].superseded++;
+		free (queued);
+	}
+	if (command == LINK_CMD_FORCE_DOWN && device->force_down_queued)
+		return 0; /* one is already on its way */
+
+	if ((job = (link_job_t *)malloc (sizeof (link_job_t))) == NULL)
+		return (-1);
+	job->pid          = 0;
+	job->pidfd        = -1;
+	job->device       = device;
+	job->command      = command;
+	job->argv         = argv;
+	job->queued_at    = event_now_ms ();
+	job->output_fd    = -1;
+	job->line_start   = TRUE;
+
+	/* nothing waits while there's room, so there's no queue to jump */
+	if (g_link_commands > 0 && s_n_running >= g_link_commands)
+	{
+		if (g_debug)
+			fprintf (stderr, "%s(): %s queued\n",
+				 command_name (command),
+				 device->device_name.str);
+		job_enqueue (job);
+		s_stats[command].queued++;
+		return 0;
+	}
+	return job_spawn (job);
+}
+
+int link_exec_init (void)
+{
+	/* children the kernel can't give us a pidfd for are reaped on
+	   SIGCHLD instead.  It has to be blocked before any worker thread
+	   starts: a thread that left it unblocked could take the signal,
+	   and with it the only word that a child had exited. */
+	int sigchld[] = { SIGCHLD };
+
+	if ((s_sigchld_fd = event_signal_new (sigchld, 1, handle_sigchld,
+					      NULL)) < 0)
+		return (-1);
+	return 0;
+}
+
+static int job_spawn (link_job_t *job)
+{
+	/* start the job's command.  If it can't be, the job is freed */
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_t actions, *p_actions = NULL;
+	sigset_t no_signals;
+	pid_t pid;
+	int output[2] = { -1, -1 };
+	int err;
+
+	/* the server blocks the signals it reads through signalfd, and the
+	   child would inherit that */
+	sigemptyset (&no_signals);
+	posix_spawnattr_init (&attr);
+	posix_spawnattr_setsigmask (&attr, &no_signals);
+	posix_spawnattr_setflags (&attr, SPAWN_FLAGS);
+
+	/* only the server's end of the pipe is non-blocking - a command
+	   could well be upset by EAGAIN on its stdout */
+	if (g_command_log > 0 && pipe2 (output, O_CLOEXEC) == 0)
+	{
+		fcntl (output[0], F_SETFL, O_NONBLOCK);
+		posix_spawn_file_actions_init (&actions);
+		posix_spawn_file_actions_adddup2 (&actions, output[1],
+						  STDOUT_FILENO);
+		posix_spawn_file_actions_adddup2 (&actions, output[1],
+						  STDERR_FILENO);
+		p_actions = &actions;
+	}
+
+	err = posix_spawnp (&pid, job->argv[0], p_actions, &attr, job->argv,
+			    environ);
+	posix_spawnattr_destroy (&attr);
+	if (p_actions != NULL)
+	{
+		posix_spawn_file_actions_destroy (p_actions);
+		close (output[1]);
+	}
+	if (err != 0)
+	{
+		char message[128];
+
+		fprintf (stderr, "%s(): failed to spawn %s for %s: %s\n",
+			 command_name (job->command), job->argv[0],
+			 job->device->device_name.str, strerror (err));
+		snprintf (message, sizeof (message), "can't run %s: %s\n",
+			  job->argv[0], strerror (err));
+		job_log (job, message, strlen (message));
+		if (output[0] >= 0)
+			close (output[0]);
+		free (job);
+		errno = err;
+		return (-1);
+	}
+
+	if (output[0] >= 0)
+	{
+		if (event_add (output[0], handle_output, job) < 0)
+			close (output[0]);
+		else
+			job->output_fd = output[0];
+	}
+
+	job->pid   = pid;
+	job->pidfd = syscall (SYS_pidfd_open, pid, 0);
+	if (job->pidfd >= 0)
+	{
+		if (event_add (job->pidfd, handle_pidfd, job) < 0)
+		{
+			close (job->pidfd);
+			job->pidfd = -1;
+		}
+	}
+	if (g_debug)
+		fprintf (stderr, "%s(): started pid %d for %s\n",
+			 command_name (job->command), (int)pid,
+			 job->device->device_name.str);
+
+	job->next = s_jobs;
+	s_jobs = job;
+	s_n_running++;
+	s_stats[job->command].run++;
+	return 0;
+}
+
+static void link_exec_drain (void)
+{
+	/* start whatever is waiting, most urgent first, for as long as
+	   there's room */
+	int priority;
+
+	for (priority = 0; priority < N_PRIORITIES; priority++)
+	{
+		while (s_queue[priority] != NULL &&
+		       (g_link_commands <= 0 || s_n_running < g_link_commands))
+		{
+			link_job_t *job = s_queue[priority];
+			device_t *device = job->device;
+			link_command_t command = job->command;
+			long waited = event_now_ms () - job->queued_at;
+
+			job_dequeue (job);
+			s_stats[command].waited++;
+			s_stats[command].wait_total += waited;
+			if (waited > s_stats[command].wait_max)
+				s_stats[command].wait_max = waited;
+			if (g_debug)
+				fprintf (stderr, "%s(): %s waited %ld ms\n",
+					 command_name (command),
+					 device->device_name.str, waited);
+
+			/* there's no transition waiting on the result any
+			   more, so a failure is just another failed
+			   command */
+			if (job_spawn (job) < 0)
+				link_command_done (device, command, -1);
+		}
+	}
+}
+
+void link_exec_report (FILE *out)
+{
+	link_command_t command;
+
+	fprintf (out, "link commands: %d running (limit %d)\n",
+		 s_n_running, g_link_commands);
+	for (command = LINK_CMD_UP; command <= LINK_CMD_FORCE_DOWN; command++)
+	{
+		link_stats_t *stats = &s_stats[command];
+
+		fprintf (out, "%s: %lu run, %lu queued, %lu superseded, "
+			 "wait %ld ms average, %ld ms max\n",
+			 command_name (command), stats->run, stats->queued,
+			 stats->superseded,
+			 stats->waited ?
+			 stats->wait_total / (long)stats->waited : 0L,
+			 stats->wait_max);
+	}
+}
+
+int link_exec_after (device_t *device, link_command_t command)
+{
+	/* run command against the device after FOLLOWUP_DELAY_MS, instead
+	   of sleeping in the middle of a transition */
+	if (device->followup_timer == -1)
+	{
+		device->followup_timer = event_timer_new (handle_followup,
+							  device);
+		if (device->followup_timer < 0)
+		{
+			device->followup_timer = -1;
+			return (-1);
+		}
+	}
+
+	device->followup_command = command;
+	return event_timer_set (device->followup_timer, FOLLOWUP_DELAY_MS, 0);
+}
+
+static void job_finished (link_job_t *job, int status)
+{
+	link_job_t **pp_job = &s_jobs;
+
+	/* unlink the job before calling back - the callback may well start
+	   another command */
+	while (*pp_job && *pp_job != job)
+		pp_job = &(*pp_job)->next;
+	if (*pp_job)
+		*pp_job = job->next;
+	s_n_running--;
+
+	if (job->pidfd >= 0)
+	{
+		event_remove (job->pidfd);
+		close (job->pidfd);
+	}
+
+	/* the command has gone, so everything it wrote is in the pipe by
+	   now - unless it left something running that still has the other
+	   end, which misses out */
+	if (job->output_fd >= 0)
+	{
+		while (job_read_output (job) > 0)
+			;
+		event_remove (job->output_fd);
+		close (job->output_fd);
+		job->output_fd = -1;
+	}
+	job_log_status (job, status);
+
+	if (WIFEXITED (status) && WEXITSTATUS (status) == 127)
+	{
+		fprintf (stderr, "%s(): failed to execve command for %s\n",
+			 command_name (job->command),
+			 job->device->device_name.str);
+	}
+	else if (g_debug)
+	{
+		fprintf (stderr, "%s(): pid %d for %s finished (%d)\n",
+			 command_name (job->command), (int)job->pid,
+			 job->device->device_name.str, status);
+	}
+
+	/* whatever was waiting for the room goes ahead of anything the
+	   callback starts */
+	link_exec_drain ();
+	link_command_done (job->device, job->command, status);
+	free (job);
+}
+
+static int handle_pidfd (int fd, void *arg)
+{
+	link_job_t *job = (link_job_t *)arg;
+	int status;
+	pid_t pid;
+
+	pid = waitpid (job->pid, &status, WNOHANG);
+	if (pid == 0)
+		return 0; /* not really finished yet */
+	if (pid < 0)
+	{
+		perror ("waitpid()");
+		status = -1;
+	}
+	job_finished (job, status);
+	return 0;
+}
+
+static int handle_sigchld (int signum, void *arg)
+{
+	/* several children may have exited for one signal, so reap every
+	   job that has finished */
+	link_job_t *job = s_jobs;
+
+	while (job)
+	{
+		link_job_t *next = job->next;
+		int status;
+
+		if (job->pidfd < 0 &&
+		    waitpid (job->pid, &status, WNOHANG) == job->pid)
+			job_finished (job, status);
+		job = next;
+	}
+	return 0;
+}
+
+static int handle_output (int fd, void *arg)
+{
+	link_job_t *job = (link_job_t *)arg;
+
+	if (job_read_output (job) == 0)
+	{
+		/* it's closed its end (or broken ours) - job_finished()
+		   won't be needing it */
+		event_remove (job->output_fd);
+		close (job->output_fd);
+		job->output_fd = -1;
+	}
+	return 0;
+}
+
+static int job_read_output (link_job_t *job)
+{
+	/* put whatever the command has written since last time in the log.
+	   Returns 0 at the end of it, -1 if there's nothing more just now,
+	   and more than that if there may be */
+	char buf[OUTPUT_CHUNK];
+	ssize_t len;
+
+	while ((len = read (job->output_fd, buf, sizeof (buf))) < 0 &&
+	       errno == EINTR)
+		;
+	if (len > 0)
+		job_log (job, buf, len);
+	else if (len < 0 && errno != EAGAIN)
+		len = 0; /* as good as the end */
+	return len;
+}
+
+static void job_log (link_job_t *job, const char *data, size_t len)
+{
+	/* add some of the job's output to its device's log, with every line
+	   headed by the command */
+	const char *name = command_name (job->command);
+
+	while (len > 0)
+	{
+		const char *newline = memchr (data, '\n', len);
+		size_t line_len = newline ? (size_t)(newline - data) + 1 : len;
+
+		if (job->line_start)
+		{
+			device_log_write (job->device, name, strlen (name));
+			device_log_write (job->device, ": ", 2);
+		}
+		device_log_write (job->device, data, line_len);
+		job->line_start = (newline != NULL);
+		data += line_len;
+		len  -= line_len;
+	}
+}
+
+static void job_log_status (link_job_t *job, int status)
+{
+	/* finish off the job's log with how it ended, if it didn't go
+	   well */
+	char message[64];
+
+	if (!job->line_start)
+		job_log (job, "\n", 1);
+
+	if (status == -1)
+		snprintf (message, sizeof (message), "lost track of it\n");
+	else if (WIFSIGNALED (status))
+		snprintf (message, sizeof (message), "killed by signal %d\n",
+			  WTERMSIG (status));
+	else if (WIFEXITED (status) && WEXITSTATUS (status) != 0)
+		snprintf (message, sizeof (message), "exited with status %d\n",
+			  WEXITSTATUS (status));
+	else
+		return;
+	job_log (job, message, strlen (message));
+}
+
+static int handle_followup (int fd, void *arg)
+{
+	device_t *device = (device_t *)arg;
+
+	if (link_command_followup (device, device->followup_command) < 0)
+		perror ("link_command_followup()");
+	return 0;
+}
@@ -8,158 +8,377 @@
 
 #include <errno.h>
 #include <string.h>
+#include <sys/wait.h>
 
 #include "server.h"
 
-/* managing g_devices  and device_lists that clients are connected to */
+/* managing g_devices */
 device_list_t *g_devices = NULL;
+int            g_n_devices = 0;
+device_state_t g_device_state;
 
-int add_device (device_list_t **pp_devices, device_t *new_device)
+/* g_devices is also hashed on device_name, so that commands can find their
+ * device without a walk down the list.  Devices are only registered while
+ * the config is read; after that the index never changes, and the workers
+ * can use it without any locking.
+ */
+static device_t     **s_device_table      = NULL;
+static unsigned int   s_device_table_size = 0;    /* a power of two */
+static device_list_t *s_devices_tail      = NULL; /* the end of g_devices */
+static device_t     **s_devices_by_index  = NULL; /* g_devices as an array */
+
+/* Which clients are connected to which devices is held on both sides.  A
+ * client has a bitset of the devices it's connected to, by device_index,
+ * and a device has a vector of the clients connected to it.  The client
+ * also keeps its position in each of its devices' vectors, so either side
+ * can let go of the other in O(1), a client can find its devices without
+ * looking at anyone else's, and the user count of a device is just the
+ * length of its vector.
+ */
+#define BITS_PER_WORD (8 * sizeof (unsigned long))
+#define DEVICE_WORDS  ((g_n_devices + BITS_PER_WORD - 1) / BITS_PER_WORD)
+
+/* The entries in g_devices and the clients' membership blocks (bitset and
+ * positions in one) each come from a pool of their own, see pool.c.  (The
+ * devices themselves live in the configuration arena.)  A membership
+ * block is sized for g_n_devices, so that pool is only set up once the
+ * config has been read and the first client connects to something.
+ */
+static pool_t s_device_node_pool;
+static pool_t s_membership_pool;
+
+/* Local prototypes */
+static int  device_table_grow      (void);
+static int  device_state_grow      (void);
+static int  client_membership_init (client_t *client);
+static int  membership_add         (client_t *client, device_t *device);
+static void membership_remove      (client_t *client, device_t *device);
+
+int trim_pools (void)
 {
-	device_list_t *new_dev_list_entry, *list_pos;
+	/* hand back whatever the pools no longer need.  Only clients come
+	   and go, so only their membership blocks are ever freed. */
+	return pool_trim (&s_membership_pool);
+}
+
+void report_pools (FILE *out)
+{
+	pool_report (&s_device_node_pool, out);
+	pool_report (&s_membership_pool, out);
+}
 
-	if (get_device (pp_devices, new_device->device_name) != NULL)
+unsigned int device_name_hash (const char *dev_name, size_t len)
+{
+	/* FNV-1a */
+	unsigned int hash = 2166136261u;
+
+	while (len--)
 	{
-		errno = EALREADY;
+		hash ^= (unsigned char)*dev_name++;
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+static int device_table_grow (void)
+{
+	/* double the table (or start one), and rehash everything into it */
+	unsigned int new_size = s_device_table_size ? s_device_table_size * 2
+		: 16;
+	device_t **new_table = (device_t **)calloc (new_size,
+						    sizeof (device_t *));
+	device_list_t *list_pos;
+
+	if (new_table == NULL)
 		return (-1);
+	for (list_pos = g_devices; list_pos; list_pos = list_pos->next)
+	{
+		device_t *device = list_pos->data;
+		unsigned int slot = device->name_hash & (new_size - 1);
+
+		device->hash_next = new_table[slot];
+		new_table[slot] = device;
 	}
+	free (s_device_table);
+	s_device_table      = new_table;
+	s_device_table_size = new_size;
+	return 0;
+}
 
-	new_dev_list_entry = (device_list_t *)malloc (sizeof (device_list_t));
-	if (new_dev_list_entry == NULL) /* malloc failed */
+static int device_state_grow (void)
+{
+	/* double the room in g_device_state (or make some).  A new device
+	   starts off down, with nobody connected, which is all zeros */
+	int new_size = g_device_state.size ? g_device_state.size * 2 : 16;
+	int added = new_size - g_device_state.size;
+	device_status_t *status;
+	time_t *connect_time;
+	int *retries, *n_users;
+
+	status = (device_status_t *)realloc (g_device_state.status,
+					     new_size * sizeof (*status));
+	if (status == NULL)
+		return (-1);
+	g_device_state.status = status;
+	connect_time = (time_t *)realloc (g_device_state.connect_time,
+					  new_size * sizeof (*connect_time));
+	if (connect_time == NULL)
+		return (-1);
+	g_device_state.connect_time = connect_time;
+	retries = (int *)realloc (g_device_state.retries,
+				  new_size * sizeof (*retries));
+	if (retries == NULL)
+		return (-1);
+	g_device_state.retries = retries;
+	n_users = (int *)realloc (g_device_state.n_users,
+				  new_size * sizeof (*n_users));
+	if (n_users == NULL)
+		return (-1);
+	g_device_state.n_users = n_users;
+
+	memset (status + g_device_state.size, 0, added * sizeof (*status));
+	memset (connect_time + g_device_state.size, 0,
+		added * sizeof (*connect_time));
+	memset (retries + g_device_state.size, 0, added * sizeof (*retries));
+	memset (n_users + g_device_state.size, 0, added * sizeof (*n_users));
+	g_device_state.size = new_size;
+	return 0;
+}
+
+int register_device (device_t *new_device)
+{
+	/* add a device from the config to the end of g_devices, and to the
+	   index.  Its place in the list becomes its device_index. */
+	device_list_t *new_dev_list_entry;
+	device_t **new_by_index;
+	unsigned int slot;
+
+	if (find_device (new_device->device_name.str,
+			 new_device->device_name.len) != NULL)
 	{
+		errno = EALREADY;
 		return (-1);
 	}
+
+	/* keep the chains short */
+	if ((g_n_devices + 1) * 4 > s_device_table_size * 3 &&
+	    device_table_grow () < 0)
+		return (-1);
+	if (g_n_devices == g_device_state.size && device_state_grow () < 0)
+		return (-1);
+
+	new_by_index = (device_t **)realloc (s_devices_by_index,
+					     (g_n_devices + 1)
+					     * sizeof (device_t *));
+	if (new_by_index == NULL)
+		return (-1);
+	s_devices_by_index = new_by_index;
+
+	if (s_device_node_pool.object_size == 0)
+		pool_init (&s_device_node_pool, "device_list_t",
+			   sizeof (device_list_t));
+	new_dev_list_entry = (device_list_t *)pool_alloc (&s_device_node_pool);
+	if (new_dev_list_entry == NULL) /* out of memory */
+		return (-1);
 	new_dev_list_entry->next = NULL;
 	new_dev_list_entry->data = new_device;
+	if (s_devices_tail == NULL)
+		g_devices = new_dev_list_entry;
+	else
+		s_devices_tail->next = new_dev_list_entry;
+	s_devices_tail = new_dev_list_entry;
+
+	new_device->name_hash = device_name_hash (new_device->device_name.str,
+						  new_device->device_name.len);
+	slot = new_device->name_hash & (s_device_table_size - 1);
+	new_device->hash_next = s_device_table[slot];
+	s_device_table[slot] = new_device;
 
-	// check for an empty list
-	if (*pp_devices == NULL)
+	s_devices_by_index[g_n_devices] = new_device;
+	new_device->device_index = g_n_devices++;
+	return 0;
+}
+
+device_t *find_device (const char *dev_name, size_t len)
+{
+	/* the device called the len bytes at dev_name, or NULL with
+	   errno = ENODEV */
+	unsigned int hash;
+	device_t *device;
+
+	if (s_device_table_size == 0)
 	{
-		*pp_devices = new_dev_list_entry;
+		errno = ENODEV;
+		return NULL;
 	}
-	else
+
+	hash = device_name_hash (dev_name, len);
+	for (device = s_device_table[hash & (s_device_table_size - 1)];
+	     device; device = device->hash_next)
 	{
-		list_pos = *pp_devices;
-		while (list_pos->next != NULL) /* find the last entry */
-		{
-			// sanity check - is the device already there?
-			if (list_pos->data == new_device)
-			{
-				free (new_dev_list_entry);
-				errno = EALREADY; /* already there */
-				return (-1);
-			}
-			list_pos = list_pos->next;
-		}
-		list_pos->next = new_dev_list_entry;
+		if (device->name_hash == hash && device->device_name.len == len &&
+		    memcmp (device->device_name.str, dev_name, len) == 0)
+			return device;
 	}
-	return 0;
+	// not found
+	errno = ENODEV;
+	return NULL;
 }
 
-int rm_device (device_list_t **pp_devices, device_t *dev)
+device_t *device_by_index (int index)
 {
-	device_list_t *list_pos, *prev_pos;
+	return s_devices_by_index[index];
+}
 
-	// sanity check
-	if (*pp_devices == NULL)
-	{
-		errno = ENODEV; /* device not found */
+int client_connected (client_t *client, device_t *device)
+{
+	int index = device->device_index;
+
+	return (client->device_bits != NULL &&
+		(client->device_bits[index / BITS_PER_WORD]
+		 >> (index % BITS_PER_WORD)) & 1);
+}
+
+int next_client_device (client_t *client, int from)
+{
+	/* the index of the first device from this one on that the client is
+	   connected to, or -1 if there are no more.  So, to go through them
+	   all:
+
+	   for (i = next_client_device (c, 0); i >= 0;
+	        i = next_client_device (c, i + 1))
+	*/
+	size_t word = from / BITS_PER_WORD;
+	unsigned long bits;
+
+	if (client->device_bits == NULL || from >= g_n_devices)
 		return (-1);
-	}
 
-	// check if it's the root node
-	if ((*pp_devices)->data == dev)
+	bits = client->device_bits[word] & (~0UL << (from % BITS_PER_WORD));
+	while (bits == 0)
 	{
-		list_pos = (*pp_devices)->next;
-		free (*pp_devices);
-		*pp_devices = list_pos;
-		return 0;
+		if (++word >= DEVICE_WORDS)
+			return (-1);
+		bits = client->device_bits[word];
 	}
-	
-	prev_pos = *pp_devices;
-	list_pos = (*pp_devices)->next;
-	while (list_pos)
+	return word * BITS_PER_WORD + __builtin_ctzl (bits);
+}
+
+static int client_membership_init (client_t *client)
+{
+	/* a client gets its bitset when it first connects to something -
+	   most of them only ever PING */
+	size_t bits_len = (DEVICE_WORDS + 1) * sizeof (unsigned long);
+
+	if (s_membership_pool.object_size == 0)
+		pool_init (&s_membership_pool, "membership",
+			   bits_len + (g_n_devices + 1) * sizeof (int));
+	if ((client->device_bits = pool_alloc (&s_membership_pool)) == NULL)
+		return (-1);
+	memset (client->device_bits, 0, bits_len);
+	client->device_pos = (int *)((char *)client->device_bits + bits_len);
+	return 0;
+}
+
+void client_membership_free (client_t *client)
+{
+	pool_free (&s_membership_pool, client->device_bits);
+	client->device_bits = NULL;
+	client->device_pos  = NULL;
+	client->n_devices   = 0;
+}
+
+static int membership_add (client_t *client, device_t *device)
+{
+	int index = device->device_index;
+
+	if (client->device_bits == NULL &&
+	    client_membership_init (client) < 0)
+		return (-1);
+
+	if (DEVICE_USERS (device) == device->members_size)
 	{
-		if (list_pos->data == dev)
-		{
-			// delete it
-			prev_pos->next = list_pos->next;
-			free (list_pos);
-			return 0;
-		}
+		int new_size = device->members_size ? device->members_size * 2
+			: 4;
+		client_t **new_members = (client_t **)realloc (
+			device->members, new_size * sizeof (client_t *));
 
-		prev_pos = list_pos;
-		list_pos = list_pos->next;
+		if (new_members == NULL)
+			return (-1);
+		device->members      = new_members;
+		device->members_size = new_size;
 	}
-	// didn't find it
-	errno = ENODEV; /* device not found */
-	return (-1);
+
+	client->device_pos[index] = DEVICE_USERS (device);
+	device->members[DEVICE_USERS (device)++] = client;
+	client->device_bits[index / BITS_PER_WORD] |=
+		1UL << (index % BITS_PER_WORD);
+	client->n_devices++;
+	return 0;
 }
 
-device_t *get_device (device_list_t **pp_devices, char *dev_name)
+static void membership_remove (client_t *client, device_t *device)
 {
-	device_list_t *list_pos = *pp_devices;
+	/* the last member of the device fills the hole */
+	int index = device->device_index;
+	int pos = client->device_pos[index];
+	client_t *last = device->members[--DEVICE_USERS (device)];
+
+	device->members[pos] = last;
+	last->device_pos[index] = pos;
+	client->device_bits[index / BITS_PER_WORD] &=
+		~(1UL << (index % BITS_PER_WORD));
+	client->n_devices--;
+}
 
-	while (list_pos)
+int schedule_device_timeout (device_t *device)
+{
+	/* A device that is connecting or disconnecting has until
+	 * connect_time + timeout to get there.  Called whenever the status
+	 * or connect_time of a device changes, so the timer on the wheel
+	 * always matches the current deadline.
+	 */
+	switch (DEVICE_STATUS (device))
 	{
-		if (strcmp (list_pos->data->device_name, dev_name) == 0)
-		{
-			// we have a match
-			return list_pos->data;
-		}
-		list_pos = list_pos->next;
+	case LINK_CONNECTING:
+		wheel_schedule (&device->timeout, DEVICE_CONNECT_TIME (device)
+				+ g_connect_timeout);
+		break;
+	case LINK_DISCONNECTING:
+		wheel_schedule (&device->timeout, DEVICE_CONNECT_TIME (device)
+				+ g_disconnect_timeout);
+		break;
+	default:
+		/* nothing to wait for */
+		wheel_cancel (&device->timeout);
+		break;
 	}
-	// not found
-	errno = ENODEV;
-	return NULL;
+	return 0;
 }
 
-int timeout_old_devices ()
+void device_timed_out (wheel_timer_t *timer, void *arg)
 {
-	/* Here we are searching for the following occurences:
+	/* The device missed its deadline:
 	 *
-	 * (status == LINK_CONNECTING) && ((connect_time + timeout) < time()):
-	 * The link has failed to connect properly.  if retries > 0, 
-	 * decrement it and retry.  Else, force the link down.
+	 * LINK_CONNECTING: The link has failed to connect properly.  if
+	 * retries > 0, decrement it and retry.  Else, force the link down.
 	 *
-	 * (status == LINK_DISCONNECTING) && ((connect_time+timeout) < time()):
-	 * The link has failed to disconnect within its alloted time. Force
-	 * the link down.
+	 * LINK_DISCONNECTING: The link has failed to disconnect within its
+	 * alloted time. Force the link down.
 	 */
+	device_t *device = (device_t *)arg;
 
-	device_list_t *list_pos = g_devices;
-	
-	while (list_pos)
+	switch (DEVICE_STATUS (device))
 	{
-		switch (list_pos->data->status)
-		{
-		case LINK_CONNECTING:
-			if ((list_pos->data->connect_time + g_connect_timeout)
-			    < time (NULL))
-			{
-				if (alter_device_status (list_pos->data,
-							 LINK_CONNECTING) < 0)
-					return (-1);
-			}
-			break;
-		case LINK_DISCONNECTING:
-			if ((list_pos->data->connect_time
-			     + g_disconnect_timeout) < time (NULL))
-			{
-				if (alter_device_status (list_pos->data,
-							 LINK_DISCONNECTING)
-				    < 0)
-					return (-1);
-			}
-			break;
-		default:
-			/* not interested in any other case */
-			break;
-		}
-		list_pos = list_pos->next;
+	case LINK_CONNECTING:
+	case LINK_DISCONNECTING:
+		if (alter_device_status (device, DEVICE_STATUS (device)) < 0)
+			perror ("device_timed_out()");
+		break;
+	default:
+		/* not interested in any other case */
+		break;
 	}
-
-	return 0;
 }
 
 #ifdef DEBUG
@@ -169,36 +388,29 @@ void dump_device_list (device_list_t *devices)
 	printf ("Displaying device status:\n");
 	while (devices)
 	{
-		client_list_t *c_list_pos;
-		switch (devices->data->status)
+		device_t *device = devices->data;
+		int member;
+		switch (DEVICE_STATUS (device))
 		{
 		case LINK_UP:
 			printf ("Device %d:\t%s\t\t%s (%d)\t",
 				i++,
-				devices->data->device_name,
-				g_link_status_message[devices->data->status],
-				(int)devices->data->connect_time);
+				device->device_name.str,
+				g_link_status_message[DEVICE_STATUS (device)],
+				(int)DEVICE_CONNECT_TIME (device));
 			break;
 		default:
 			printf ("Device %d:\t%s\t\t%s\t",
 				i++,
-				devices->data->device_name,
-				g_link_status_message[devices->data->status]);
+				device->device_name.str,
+				g_link_status_message[DEVICE_STATUS (device)]);
 			break;
 		}
 
-		c_list_pos = devices->data->clients_connected;
-		if (c_list_pos != NULL)
-		{
-			printf ("%s",
-				inet_ntoa(c_list_pos->data->sa.sin_addr));
-			while (c_list_pos->next)
-			{
-				c_list_pos = c_list_pos->next;
-				printf(", %s",
-				     inet_ntoa(c_list_pos->data->sa.sin_addr));
-			}
-		}
+		for (member = 0; member < DEVICE_USERS (device); member++)
+			printf ("%s%s", member ? ", " : "",
+				inet_ntoa(device->members[member]->
+					  sa.sin_addr));
 		putchar('\n');
 		
 		devices = devices->next;
@@ -206,373 +418,226 @@ void dump_device_list (device_list_t *devices)
 }
 #endif // DEBUG
 
-/* managing g_clients list */
-client_list_t *g_clients = NULL;
-
-int add_client (client_list_t **pp_clients, client_t *new_client)
-{
-	client_list_t *new_client_list_entry;
-	
-	// first check to see if it's already in the list
-	if (get_client (pp_clients, new_client->sa.sin_addr) != NULL)
-	{
-		errno = EALREADY;
-		return (-1);
-	}
-
-	new_client_list_entry = (client_list_t *)malloc (
-		sizeof (client_list_t));
-	if (new_client_list_entry == NULL) // malloc failed
-	{
-		return (-1);
-	}
-	new_client_list_entry->next = NULL;
-	new_client_list_entry->data = new_client;
-
-	if (*pp_clients == NULL) // no clients
-	{
-		*pp_clients = new_client_list_entry;
-	}
-	else
-	{
-		client_list_t *list_pos = *pp_clients;
-		while (list_pos->next)
-		{
-			// sanity check - the client is in the list
-			if (list_pos->data == new_client)
-			{
-				free (new_client_list_entry);
-				errno = EALREADY; /* already there */
-				return (-1);
-			}
-			list_pos = list_pos->next;
-		}
-		list_pos->next = new_client_list_entry;
-	}
-	return 0;
-}
-
-int rm_client (client_list_t **pp_clients, client_t *client)
-{
-	client_list_t *prev_pos, *list_pos;
-
-	// sanity check
-	if (*pp_clients == NULL)
-	{
-		errno = ENODEV; /* no such client (?) */
-		return (-1);
-	}
-
-        // is it the root node ?
-	if ((*pp_clients)->data == client)
-	{
-		list_pos = (*pp_clients)->next;
-		free (*pp_clients);
-		*pp_clients = list_pos;
-		return 0;
-	}
-
-	prev_pos = *pp_clients;
-	list_pos = (*pp_clients)->next;
-	while (list_pos)
-	{
-		if (list_pos->data == client)
-		{
-			prev_pos->next = list_pos->next;
-			free (list_pos);
-			return 0;
-		}
-		prev_pos = list_pos;
-		list_pos = list_pos->next;
-	}
-	// not found
-	errno = ENODEV;
-	return (-1);
-}
-
-client_t *get_client (client_list_t **p_clients, struct in_addr inet_addr)
-{
-	client_list_t *list_pos = *p_clients;
-
-	while (list_pos)
-	{
-		if (list_pos->data->sa.sin_addr.s_addr == inet_addr.s_addr)
-		{
-			return list_pos->data;
-		}
-		list_pos = list_pos->next;
-	}
-	errno = ENODEV;
-	return NULL; // didn't find it
-}
-
 int update_client (client_t *client, struct sockaddr_in *cli)
 {
 	client->last_heard_from = time (NULL);
 	memcpy (&client->sa, cli, sizeof(struct sockaddr_in));
 
+	/* push the client's expiry back */
+	wheel_schedule (&client->timeout,
+			client->last_heard_from + g_client_timeout);
 	return 0;
 }
 
-int timeout_old_clients ()
+void client_timed_out (wheel_timer_t *timer, void *arg)
 {
 	/* any client who's last_heard_from time is more than g_client_timeout
 	   seconds old is removed from existance.  This is a failsafe in case
 	   somebody closes down their computer without closing the link
 	   properly.  The only issue is that a live client must poll the server
 	   more often than this timeout. */
+	client_t *client = (client_t *)arg;
 
-	client_list_t *list_pos = g_clients, *next_pos;
-	client_t *client;
+	if (remove_client_from_all_devices (client) < 0 ||
+	    unregister_client (client) < 0)
+		perror ("client_timed_out()");
+}
 
-	while (list_pos)
-	{
-		next_pos = list_pos->next;
-		client   = list_pos->data;
-		if (time (NULL) > (client->last_heard_from + g_client_timeout))
-		{
-			if (remove_client_from_all_devices (client) < 0)
-				return (-1);
-			if (rm_client (&g_clients, client) < 0)
-				return (-1);
-			free (client);
-		}
-		list_pos = next_pos;
-	}
-	return 0;
+void client_moved (client_t *client)
+{
+	/* the client has been moved within g_clients - the devices it's
+	   connected to still have it at its old address */
+	int index;
+
+	for (index = next_client_device (client, 0); index >= 0;
+	     index = next_client_device (client, index + 1))
+		s_devices_by_index[index]->members[client->device_pos[index]] =
+			client;
 }
 
 #ifdef DEBUG
-void dump_client_list (client_list_t *clients)
+void dump_client_list (client_table_t *clients)
 {
 	int i = 0;
-	client_list_t *list_pos = clients;
+	unsigned int slot;
 
 	printf ("Dumping client list:\n");
-	while (list_pos)
+	for (slot = 0; slot < clients->size; slot++)
 	{
-		device_list_t *d_list_pos;
+		client_t *client = &clients->slots[slot];
+		int index, first = TRUE;
 
+		if (!client->in_use)
+			continue;
 		printf ("\tClient %d:\t%s\t%d\t",
 			i++,
-			inet_ntoa(list_pos->data->sa.sin_addr),
-			(int)list_pos->data->last_heard_from);
-		d_list_pos = list_pos->data->devices_connected;
-		if (d_list_pos != NULL)
+			inet_ntoa(client->sa.sin_addr),
+			(int)client->last_heard_from);
+		for (index = next_client_device (client, 0); index >= 0;
+		     index = next_client_device (client, index + 1))
 		{
-			printf ("%s", d_list_pos->data->device_name);
-			while (d_list_pos->next)
-			{
-				d_list_pos = d_list_pos->next;
-				printf(", %s", d_list_pos->data->device_name);
-			}
+			printf ("%s%s", first ? "" : ", ",
+				s_devices_by_index[index]->device_name.str);
+			first = FALSE;
 		}
 		putchar('\n');
-		
-		list_pos = list_pos->next;
 	}
 }
 #endif // DEBUG
 
-int remove_device_from_all_clients (device_t *device)
-{
-	client_list_t *list_pos;
-
-	/* search through the global client list and remove all instances
-	   of this device from the client */
-
-	for (list_pos = g_clients; list_pos; list_pos = list_pos->next)
-	{
-		int ret = rm_device (&list_pos->data->devices_connected,
-				     device);
-		if (ret < 0) // rm_device failed
-		{
-			if (errno != ENODEV) // ignore ENODEV
-			{
-				return (-1);
-			}
-		}
-	}
-	return 0;
-}
-
 int remove_client_from_all_devices (client_t *client)
 {
-	device_list_t *list_pos;
-
-	/* search through the global device list and remove all instances
-	   of this client from each device */
+	/* disconnect the client from each of its devices in turn */
+	int index;
 
-	for (list_pos = g_devices; list_pos; list_pos = list_pos->next)
+	for (index = next_client_device (client, 0); index >= 0;
+	     index = next_client_device (client, index + 1))
 	{
-		int ret = disconnect_client_from_device (client,
-							 list_pos->data);
-		if (ret < 0) // disconnect failed
-		{
-			if (errno != ENODEV) // ignore ENODEV
-			{
-				return (-1);
-			}
-		}
+		if (disconnect_client_from_device (
+			    client, s_devices_by_index[index]) < 0)
+			return (-1);
 	}
 	return 0;
 }
 
 int remove_all_clients_from_device (device_t *device)
 {
-	client_list_t *list_pos = device->clients_connected;
-	device->clients_connected = NULL;
-	while(list_pos)
-	{
-		client_list_t *next_pos = list_pos->next;
-
-		if (rm_client (&list_pos, list_pos->data) < 0)
-			return (-1);
-		list_pos = next_pos;
-	}
+	/* everybody off.  Unlike disconnecting them one at a time, this
+	   leaves the link alone */
+	while (DEVICE_USERS (device) > 0)
+		membership_remove (device->members[DEVICE_USERS (device) - 1],
+				   device);
+	status_slot_update (device);
+	snapshot_invalidate ();
 	return 0;
 }
 		
-int remove_all_devices_from_client (client_t *client)
-{
-	device_list_t *list_pos = client->devices_connected;
-	client->devices_connected = NULL;
-	while(list_pos)
-	{
-		device_list_t *next_pos = list_pos->next;
-
-		if (rm_device (&list_pos, list_pos->data) < 0)
-			return (-1);
-		list_pos = next_pos;
-	}
-	return 0;
-}
 		
 int connect_client_to_device (client_t *client, device_t *device)
 {
 	/* connect the client to the specified device.  If the client
-	   is already connected, ignore the request.  If clients_connected
-	   was empty before, call link_up. */
+	   is already connected, ignore the request.  If the device had no
+	   clients before, call link_up. */
 
-	if (device->clients_connected == NULL)
-	{
-		device->retries = g_retries;
-		if (alter_device_status (device, LINK_CONNECTING) < 0)
-			return (-1);
-	}
+	if (client_connected (client, device))
+		return 0;
 
-	if (add_client (&device->clients_connected, client) < 0)
+	if (DEVICE_USERS (device) == 0)
 	{
-		if (errno != EALREADY) /* ignore this one */
+		DEVICE_RETRIES (device) = g_retries;
+		if (alter_device_status (device, LINK_CONNECTING) < 0)
 			return (-1);
 	}
 
-	if (add_device (&client->devices_connected, device) < 0)
-	{
-		if (errno != EALREADY) /* ignore this one */
-			return (-1);
-	}
+	if (membership_add (client, device) < 0)
+		return (-1);
 
+	status_slot_update (device);
+	snapshot_invalidate ();
 	return 0;
 }
 
 int disconnect_client_from_device (client_t *client, device_t *device)
 {
 	/* disconnect a client from the device.  If the client is not
-	   connected, ignore the request.  If doing this causes
-	   clients_connected to become empty, bring down the link. */
+	   connected, fail with ENODEV.  If doing this leaves the device
+	   with no clients, bring down the link. */
 
-	if (rm_client (&device->clients_connected, client) < 0)
-	{
-		if (errno != ENODEV)
-			return (-1);
-	}
-	else
+	if (!client_connected (client, device))
 	{
-		if (device->clients_connected == NULL)
-		{
-			if (alter_device_status (device,
-						 LINK_DISCONNECTING) < 0)
-				return (-1);
-		}
+		errno = ENODEV;
+		return (-1);
 	}
+	membership_remove (client, device);
 
-	if (rm_device (&client->devices_connected, device) < 0)
+	if (DEVICE_USERS (device) == 0)
 	{
-		if (errno != ENODEV)
+		if (alter_device_status (device, LINK_DISCONNECTING) < 0)
 			return (-1);
 	}
 
+	status_slot_update (device);
+	snapshot_invalidate ();
 	return 0;
 }
 
 int link_up (device_t *device)
 {
-	int retval;
-
 	if (device == NULL)
 		return -1; // sanity check
-	
-	retval = system (device->link_up_command);
-	if (retval == 127)
-	{
-		fprintf (stderr, "link_up(): failed to execve %s\n",
-			 device->link_up_command);
-		retval = -1;
-	}
 
-	if (retval == 0)
-	{
-		device->connect_time = time (NULL);
-	}
-	return retval;
+	/* the rest happens in link_command_done() once the command exits */
+	return link_driver_start (device, LINK_CMD_UP);
 }
 
 int link_down (device_t *device)
 {
-	int retval;
-
 	if (device == NULL)
 		return -1; // sanity check
-	
-	retval = system (device->link_down_command);
-	if (retval == 127)
-	{
-		fprintf (stderr, "link_down(): failed to execve %s\n",
-			 device->link_down_command);
-		retval = -1;
-	}
 
-	if (retval == 0)
-	{
-		device->connect_time = time (NULL);
-	}
-	return retval;
+	return link_driver_start (device, LINK_CMD_DOWN);
 }
 
 int link_force_down (device_t *device)
 {
-	int retval;
-
 	if (device == NULL)
 		return -1; // sanity check
-	
-	retval = system (device->link_force_down_command);
-	if (retval == 127)
-	{
-		fprintf (stderr, "link_down(): failed to execve %s\n",
-			 device->link_force_down_command);
-		retval = -1;
+
+	if (link_driver_start (device, LINK_CMD_FORCE_DOWN) < 0)
+		return (-1);
+
+	/* nobody is connected to a device that has been forced down.  This
+	   is done as soon as the command is on its way, so that a client
+	   connecting straight afterwards isn't thrown off again when it
+	   finishes. */
+	if (remove_all_clients_from_device (device) < 0)
+		return (-1);
+	return 0;
+}
+
+void link_command_done (device_t *device, link_command_t command, int status)
+{
+	/* a link command has exited.  status is as returned by waitpid().
+	   Only a command the device is still waiting on counts: by the time
+	   an up finishes, say, the last client may have gone and the device
+	   be on its way down again. */
+	if (!WIFEXITED (status) || WEXITSTATUS (status) != 0)
+		return;
+
+	switch (command)
+	{
+	case LINK_CMD_UP:
+		if (DEVICE_STATUS (device) != LINK_CONNECTING)
+			return;
+		break;
+	case LINK_CMD_DOWN:
+		if (DEVICE_STATUS (device) != LINK_DISCONNECTING)
+			return;
+		break;
+	default:
+		return;
 	}
 
-	if (retval == 0)
+	DEVICE_CONNECT_TIME (device) = time (NULL);
+	schedule_device_timeout (device);
+	status_slot_update (device);
+	snapshot_invalidate ();
+}
+
+int link_command_followup (device_t *device, link_command_t command)
+{
+	/* a command deferred by link_exec_after() is due.  Only carry on if
+	   nothing has moved the device on in the meantime. */
+	switch (command)
 	{
-		if (remove_all_clients_from_device (device) < 0)
-			return (-1);
-		if (remove_device_from_all_clients (device) < 0)
-			return (-1);
+	case LINK_CMD_UP:
+		if (DEVICE_STATUS (device) != LINK_CONNECTING)
+			return 0;
+		return link_up (device);
+	default:
+		errno = EINVAL;
+		return (-1);
 	}
-	return retval;
 }
 
 int alter_device_status (device_t *device, device_status_t new_status)
@@ -583,26 +648,32 @@ int alter_device_status (device_t *device, device_status_t new_status)
 	*/
 	if (g_debug)
 		fprintf (stderr, "Transition from %s to %s:  ",
-			 g_link_status_message[device->status],
+			 g_link_status_message[DEVICE_STATUS (device)],
 			 g_link_status_message[new_status]);
 
 	switch (new_status)
 	{
 	case LINK_CONNECTING:
-		switch (device->status)
+		switch (DEVICE_STATUS (device))
 		{
 		case LINK_DISCONNECTING:
 			if (link_force_down (device) < 0)
 				return (-1);
-			sleep (2); // give the kill command a chance to work
+			/* give the kill command a chance to work before
+			   bringing the link back up */
+			DEVICE_RETRIES (device) = g_retries - 1;
+			if (link_exec_after (device, LINK_CMD_UP) < 0)
+				return (-1);
+			DEVICE_CONNECT_TIME (device) = time (NULL);
+			break;
 		case LINK_DOWN:
-			device->retries = g_retries;
+			DEVICE_RETRIES (device) = g_retries;
 		case LINK_CONNECTING:
-			if (device->retries-- < 0)
+			if (DEVICE_RETRIES (device)-- < 0)
 				return alter_device_status (device, LINK_DOWN);
 			if (link_up (device) < 0)
 				return (-1);
-			device->connect_time = time (NULL);
+			DEVICE_CONNECT_TIME (device) = time (NULL);
 			break;
 		case LINK_UP:
 			fprintf (stderr, "Invalid\n");
@@ -610,13 +681,13 @@ int alter_device_status (device_t *device, device_status_t new_status)
 			return (-1);
 		default:
 			fprintf (stderr, "Unknown existing state (%d)\n",
-				 device->status);
+				 DEVICE_STATUS (device));
 			errno = EINVAL;
 			return (-1);
 		}
 		break;
 	case LINK_DISCONNECTING:
-		switch (device->status)
+		switch (DEVICE_STATUS (device))
 		{
 		case LINK_CONNECTING:
 			if (link_force_down (device) < 0)
@@ -641,13 +712,13 @@ int alter_device_status (device_t *device, device_status_t new_status)
 			if (g_debug)
 				fprintf (stderr,
 					 "Unknown existing state (%d)\n",
-					 device->status);
+					 DEVICE_STATUS (device));
 			errno = EINVAL;
 			return (-1);
 		}
 		break;
 	case LINK_UP:
-		switch (device->status)
+		switch (DEVICE_STATUS (device))
 		{
 		case LINK_UP:
 		case LINK_DISCONNECTING:
@@ -657,19 +728,19 @@ int alter_device_status (device_t *device, device_status_t new_status)
 			errno = EINVAL;
 			return (-1);
 		case LINK_CONNECTING:
-			device->connect_time = time (NULL);
+			DEVICE_CONNECT_TIME (device) = time (NULL);
 			break;
 		default:
 			if (g_debug)
 				fprintf (stderr,
 					 "Unknown existing state (%d)\n",
-					 device->status);
+					 DEVICE_STATUS (device));
 			errno = EINVAL;
 			return (-1);
 		}
 		break;
 	case LINK_DOWN:
-		switch (device->status)
+		switch (DEVICE_STATUS (device))
 		{
 		case LINK_DISCONNECTING:
 			break;
@@ -683,7 +754,7 @@ int alter_device_status (device_t *device, device_status_t new_status)
 			if (g_debug)
 				fprintf (stderr,
 					 "Unknown existing state (%d)\n",
-					 device->status);
+					 DEVICE_STATUS (device));
 			errno = EINVAL;
 			return (-1);
 		}
@@ -692,7 +763,7 @@ int alter_device_status (device_t *device, device_status_t new_status)
 		if (g_debug)
 			fprintf (stderr,
 				 "Unknown existing state (%d)\n",
-				 device->status);
+				 DEVICE_STATUS (device));
 		errno = EINVAL;
 		return (-1);
 	}
@@ -701,6 +772,9 @@ int alter_device_status (device_t *device, device_status_t new_status)
 	if (g_debug)
 		fprintf (stderr, "OK\n");
 
-	device->status = new_status;
+	DEVICE_STATUS (device) = new_status;
+	schedule_device_timeout (device);
+	status_slot_update (device);
+	snapshot_invalidate ();
 	return 0;
 }
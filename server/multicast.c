@@ -0,0 +1,184 @@
+/* multicast.c
+ * -----------
+ *
+ * Where the status broadcasts go out.  The group address is worked out
+ * once, at startup, along with a message header for each interface named
+ * in multicast_ifs, so a broadcast is just a matter of pointing the
+ * headers at it and handing the lot to one sendmmsg(): one send per LAN
+ * segment, in a single call.  With no interfaces named there is a single
+ * header, and the routing table picks the way out as it always did.
+ *
+ * The broadcasts leave from the request socket, not from sockets of their
+ * own.  Clients send their requests back to wherever a broadcast came
+ * from, so it has to carry the server's port, and any other socket bound
+ * to that port would either join the workers' SO_REUSEPORT group (where a
+ * connected member turns off the load balancing) or need SO_REUSEADDR
+ * (which lets anybody bind it).  Instead, with more than one interface
+ * each header carries an IP_PKTINFO naming its interface; with just the
+ * one, the socket's own multicast interface is set instead.
+ */
+
+#define _GNU_SOURCE /* for sendmmsg() and struct in_pktinfo */
+#include <errno.h>
+#include <string.h>
+#include <net/if.h>
+
+#include <mcast.h>
+#include "server.h"
+
+#define IF_SEPARATORS " \t,"
+
+typedef union
+{
+	struct cmsghdr header; /* for the alignment */
+	char           space[CMSG_SPACE (sizeof (struct in_pktinfo))];
+} pktinfo_control_t;
+
+/* File-level variables */
+static struct sockaddr_in  s_group;
+static struct iovec        s_iov;             /* shared by every header */
+static struct mmsghdr     *s_msgs      = NULL; /* one per interface */
+static pktinfo_control_t  *s_controls  = NULL;
+static int                 s_n_msgs    = 0;
+
+/* Local prototypes */
+static int multicast_ifs_count (const char *ifs);
+static int multicast_if_index  (const char *name, size_t len,
+				char ifname[IF_NAMESIZE]);
+
+static int multicast_ifs_count (const char *ifs)
+{
+	/* the number of interface names in ifs */
+	int count = 0;
+
+	while (ifs != NULL && *(ifs += strspn (ifs, IF_SEPARATORS)))
+	{
+		ifs += strcspn (ifs, IF_SEPARATORS);
+		count++;
+	}
+	return count;
+}
+
+static int multicast_if_index (const char *name, size_t len,
+			       char ifname[IF_NAMESIZE])
+{
+	/* the index of the interface called the len bytes at name, which
+	   are copied to ifname, or 0 with errno set */
+	if (len >= IF_NAMESIZE)
+	{
+		errno = ENODEV;
+		return 0;
+	}
+	memcpy (ifname, name, len);
+	ifname[len] = '\0';
+	return if_nametoindex (ifname);
+}
+
+int multicast_init (void)
+{
+	/* set up the group address, the request socket's multicast options
+	   and a header for each interface.  Called once the request socket
+	   is open; any interface that can't be found is reported and fails
+	   the lot. */
+	const char *ifs = g_multicast_ifs;
+	char ifname[IF_NAMESIZE];
+	int n_ifs = multicast_ifs_count (ifs);
+	int i;
+
+	memset (&s_group, 0, sizeof (s_group));
+	s_group.sin_family = AF_INET;
+	s_group.sin_port   = htons (g_multicast_port);
+	if (inet_aton (g_multicast_group, &s_group.sin_addr) == 0)
+	{
+		fprintf (stderr, "Invalid multicast group %s\n",
+			 g_multicast_group);
+		errno = EINVAL;
+		return (-1);
+	}
+
+	if (mcast_set_ttl (g_socket_fd, g_multicast_ttl) < 0 ||
+	    mcast_set_loop (g_socket_fd, g_multicast_loop) < 0)
+		return (-1);
+
+	s_n_msgs = n_ifs ? n_ifs : 1;
+	s_msgs = (struct mmsghdr *)calloc (s_n_msgs, sizeof (struct mmsghdr));
+	s_controls = (pktinfo_control_t *)calloc (s_n_msgs,
+						  sizeof (pktinfo_control_t));
+	if (s_msgs == NULL || s_controls == NULL)
+		return (-1);
+
+	for (i = 0; i < s_n_msgs; i++)
+	{
+		struct msghdr *msg = &s_msgs[i].msg_hdr;
+
+		msg->msg_name    = &s_group;
+		msg->msg_namelen = sizeof (s_group);
+		msg->msg_iov     = &s_iov;
+		msg->msg_iovlen  = 1;
+	}
+	if (n_ifs == 0)
+		return 0;
+
+	for (i = 0; i < n_ifs; i++)
+	{
+		struct msghdr *msg = &s_msgs[i].msg_hdr;
+		struct cmsghdr *cmsg;
+		struct in_pktinfo *pktinfo;
+		size_t len;
+		int index;
+
+		ifs += strspn (ifs, IF_SEPARATORS);
+		len = strcspn (ifs, IF_SEPARATORS);
+		if ((index = multicast_if_index (ifs, len, ifname)) == 0)
+		{
+			fprintf (stderr, "Multicast interface %.*s: %s\n",
+				 (int)len, ifs, strerror (errno));
+			return (-1);
+		}
+		ifs += len;
+
+		if (n_ifs == 1)
+			return mcast_set_if (g_socket_fd, ifname, 0);
+
+		msg->msg_control    = s_controls[i].space;
+		msg->msg_controllen = sizeof (s_controls[i].space);
+		cmsg = CMSG_FIRSTHDR (msg);
+		cmsg->cmsg_level = IPPROTO_IP;
+		cmsg->cmsg_type  = IP_PKTINFO;
+		cmsg->cmsg_len   = CMSG_LEN (sizeof (struct in_pktinfo));
+		pktinfo = (struct in_pktinfo *)CMSG_DATA (cmsg);
+		pktinfo->ipi_ifindex = index;
+	}
+	return 0;
+}
+
+int multicast_send (const char *data, size_t len)
+{
+	/* send a datagram to the group, once on every interface.  One
+	   interface failing doesn't stop the others getting it. */
+	int sent = 0, retval = 0;
+
+	if (s_msgs == NULL)
+	{
+		errno = EINVAL; /* multicast_init() hasn't been run */
+		return (-1);
+	}
+
+	s_iov.iov_base = (void *)data;
+	s_iov.iov_len  = len;
+	while (sent < s_n_msgs)
+	{
+		int n_sent = sendmmsg (g_socket_fd, s_msgs + sent,
+				       s_n_msgs - sent, 0);
+		if (n_sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			/* this interface misses out */
+			retval = -1;
+			n_sent = 1;
+		}
+		sent += n_sent;
+	}
+	return retval;
+}
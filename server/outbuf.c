@@ -0,0 +1,102 @@
+/* outbuf.c
+ * --------
+ *
+ * Builds text messages in memory that somebody else owns - normally the
+ * next free slot of a reply queue, so a reply is written where sendmmsg()
+ * will find it.  Nothing here allocates.  An outbuf may be given a second,
+ * bigger buffer to spill into: the first time something doesn't fit, what
+ * has been written so far moves over there and the message carries on.
+ * Past that, anything that doesn't fit is dropped and overflow is set, so
+ * a message can be built without checking every step, and checked once
+ * at the end.
+ */
+
+#include <string.h>
+
+#include "server.h"
+
+/* Local prototypes */
+static int outbuf_room (outbuf_t *out, size_t len);
+
+void outbuf_init (outbuf_t *out, char *data, size_t cap)
+{
+	out->data      = data;
+	out->len       = 0;
+	out->cap       = cap;
+	out->spill     = NULL;
+	out->spill_cap = 0;
+	out->spilled   = FALSE;
+	out->overflow  = FALSE;
+}
+
+void outbuf_set_spill (outbuf_t *out, char *spill, size_t spill_cap)
+{
+	out->spill     = spill;
+	out->spill_cap = spill_cap;
+}
+
+static int outbuf_room (outbuf_t *out, size_t len)
+{
+	/* make sure there's room for len more bytes */
+	if (out->overflow)
+		return FALSE;
+	if (len <= out->cap - out->len)
+		return TRUE;
+
+	if (!out->spilled && out->spill != NULL &&
+	    out->len + len <= out->spill_cap)
+	{
+		memcpy (out->spill, out->data, out->len);
+		out->data    = out->spill;
+		out->cap     = out->spill_cap;
+		out->spilled = TRUE;
+		return TRUE;
+	}
+	out->overflow = TRUE;
+	return FALSE;
+}
+
+void outbuf_put_bytes (outbuf_t *out, const char *data, size_t len)
+{
+	if (!outbuf_room (out, len))
+		return;
+	memcpy (out->data + out->len, data, len);
+	out->len += len;
+}
+
+void outbuf_put_str (outbuf_t *out, const char *str)
+{
+	outbuf_put_bytes (out, str, strlen (str));
+}
+
+void outbuf_put_char (outbuf_t *out, char c)
+{
+	if (!outbuf_room (out, 1))
+		return;
+	out->data[out->len++] = c;
+}
+
+void outbuf_put_uint (outbuf_t *out, unsigned long value)
+{
+	/* in decimal, as printf ("%lu") would */
+	char digits[3 * sizeof (unsigned long)];
+	size_t n = sizeof (digits);
+
+	do
+	{
+		digits[--n] = '0' + value % 10;
+		value /= 10;
+	} while (value);
+	outbuf_put_bytes (out, digits + n, sizeof (digits) - n);
+}
+
+void outbuf_put_int (outbuf_t *out, long value)
+{
+	if (value < 0)
+	{
+		outbuf_put_char (out, '-');
+		outbuf_put_uint (out, -(unsigned long)value);
+	}
+	else
+		outbuf_put_uint (out, value);
+}
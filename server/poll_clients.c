@@ -15,22 +15,239 @@
 #include <sys/utsname.h>
 
 #include <protocol.h>
+#include <wire.h>
 #include "server.h"
 
 /* Multicasting versions of the polling code.  We have the necesary information
  * for polling in the form of g_multicast_group and g_multicast_port. 
  */
 
+/* One pre-rendered slot per device, in device_index order.  A slot holds
+ * the device's line of the status broadcast, split around the uptime:
+ *
+ *   head: <device>\t<status>      (ends in "UP " for a link that is up)
+ *   tail: " <no_users>\n"          (only for a link that is up)
+ *
+ * Slots are rewritten by status_slot_update() whenever a device changes
+ * status or gains/loses a client, so sending the broadcast only has to
+ * patch in the uptimes.  A rewritten slot is also marked dirty, and the
+ * next BROADCAST DELTA carries just the dirty slots.
+ *
+ * The uptimes themselves come from g_device_state: a full broadcast works
+ * them all out in one pass over the connect times before it starts, so
+ * it never has to look at a device_t.
+ *
+ * With binary_broadcast set, the same broadcasts go out in the binary
+ * encoding instead (see wire.h), built from the slots' devices.
+ */
+typedef struct
+{
+	device_t *device;
+	char     *text;     /* head immediately followed by tail */
+	size_t    cap;      /* room for the longest line */
+	size_t    head_len;
+	size_t    tail_len;
+	int       no_users; /* as in the tail */
+	int       dirty;    /* changed since the last delta */
+} status_slot_t;
+
+#define UPTIME_MAX_LEN  11 /* "%d" of an int, sign included */
+#define N_USERS_MAX_LEN 13 /* " %d\n" of an int */
+#define SEQ_MAX_LEN     22 /* " %lu\n" of an unsigned long */
+
+/* When the broadcasts go out.  A change goes out as soon as the batch of
+ * events that made it is done, and opens a window of broadcast_delay ms:
+ * anything else that changes before it closes is gathered up and sent in
+ * one go when it does, so a burst of changes costs two broadcasts rather
+ * than one per batch.  Snapshots that clients ask for go the same way,
+ * but no more than one every SNAPSHOT_MIN_MS.
+ *
+ * Between changes there is a heartbeat (a snapshot, or STATUS for
+ * old-style clients), starting every snapshot_time (poll_time) seconds.
+ * Each time round that nothing has changed, the interval doubles, up to
+ * heartbeat_max seconds; the first change brings it straight back.  The
+ * clients forget a server they haven't heard from in their
+ * server_timeout, so heartbeat_max has to stay well below that - no more
+ * than a quarter of it, so that a lost broadcast or two doesn't lose
+ * them the server and all its devices.  Old-style clients give up after
+ * about 20 seconds whatever it says, so with legacy_status the heartbeat
+ * stays at poll_time and never backs off.
+ */
+#define SNAPSHOT_MIN_MS 1000
+
+/* File-level variables */
+static status_slot_t *s_slots      = NULL;
+static int            s_n_slots    = 0;
+static int           *s_dirty      = NULL; /* indices of the dirty slots */
+static int           *s_uptimes    = NULL; /* by slot, see slot_uptimes() */
+static int            s_n_dirty    = 0;
+static char          *s_send_buf   = NULL; /* the assembled broadcast */
+static size_t         s_send_cap   = 0;
+static unsigned long  s_seq        = 0;    /* number of the last delta */
+static long           s_last_snapshot  = -SNAPSHOT_MIN_MS; /* ms */
+static int            s_snapshot_asked = FALSE;
+static wire_buf_t     s_wire_buf;             /* binary broadcasts */
+static int            s_window_timer    = -1;
+static int            s_window_open     = FALSE;
+static int            s_heartbeat_timer = -1;
+static int            s_heartbeat_ms    = 0;
+static int            s_changed         = FALSE; /* since the last heartbeat */
+
 /* local prototypes */
-int broadcast_message (char *message);
+int   broadcast_message (const char *message);
+int   broadcast_buffer (const char *send_buffer, size_t len);
+int   broadcast_split (const char *send_buffer, size_t len);
+static int broadcast_sink (void *arg, const char *datagram, size_t len);
+static void slot_uptimes (time_t now);
+void  render_slot (outbuf_t *out, int index, int uptime);
+void  begin_broadcast (outbuf_t *out, const char *header, int with_seq);
+static int broadcast_binary (wire_type_t type, int with_seq,
+			     const int *indices, int n_indices);
+static int  broadcast_flush        (void);
+static int  handle_window_timer    (int fd, void *arg);
+static int  heartbeat_base         (void);
+static void heartbeat_reset        (void);
+static int  handle_heartbeat_timer (int fd, void *arg);
 
-int broadcast_status_message (void)
+int broadcast_status_init (void)
+{
+	/* carve out a slot big enough for each device's longest line, and
+	   render the lot */
+	device_list_t *list_pos;
+	size_t status_len = 0, text_len = 0, offset = 0, header_len;
+	char *text;
+	int i;
+
+	for (i = 0; i <= LINK_DISCONNECTING; i++)
+	{
+		if (strlen (g_link_status_message[i]) > status_len)
+			status_len = strlen (g_link_status_message[i]);
+	}
+	for (list_pos = g_devices; list_pos; list_pos = list_pos->next)
+		text_len += list_pos->data->device_name.len + status_len
+			+ N_USERS_MAX_LEN;
+
+	/* room for the longest of the headers */
+	header_len = strlen (BROADCAST_STATUS);
+	if (strlen (BROADCAST_SNAPSHOT) + SEQ_MAX_LEN > header_len)
+		header_len = strlen (BROADCAST_SNAPSHOT) + SEQ_MAX_LEN;
+	if (strlen (BROADCAST_DELTA) + SEQ_MAX_LEN > header_len)
+		header_len = strlen (BROADCAST_DELTA) + SEQ_MAX_LEN;
+
+	s_slots = (status_slot_t *)calloc (g_n_devices + 1,
+					   sizeof (status_slot_t));
+	s_dirty = (int *)calloc (g_n_devices + 1, sizeof (int));
+	s_uptimes = (int *)calloc (g_n_devices + 1, sizeof (int));
+	text = (char *)malloc (text_len + 1);
+	s_send_cap = header_len + text_len + g_n_devices * UPTIME_MAX_LEN;
+	s_send_buf = (char *)malloc (s_send_cap);
+	if (s_slots == NULL || s_dirty == NULL || s_uptimes == NULL ||
+	    text == NULL || s_send_buf == NULL)
+		return (-1);
+	s_n_slots = g_n_devices;
+	wire_buf_init (&s_wire_buf);
+
+	for (list_pos = g_devices; list_pos; list_pos = list_pos->next)
+	{
+		device_t *device = list_pos->data;
+		status_slot_t *slot = &s_slots[device->device_index];
+
+		slot->device = device;
+		slot->text   = text + offset;
+		slot->cap    = device->device_name.len + status_len
+			+ N_USERS_MAX_LEN;
+		offset += slot->cap;
+		status_slot_update (device);
+	}
+
+	/* the first snapshot covers all of that */
+	s_n_dirty = 0;
+	for (i = 0; i < s_n_slots; i++)
+		s_slots[i].dirty = FALSE;
+	return 0;
+}
+
+void status_slot_update (device_t *device)
+{
+	status_slot_t *slot;
+	outbuf_t out;
+
+	if (device->device_index >= s_n_slots)
+		return; /* not set up yet - broadcast_status_init() will do it */
+	slot = &s_slots[device->device_index];
+
+	outbuf_init (&out, slot->text, slot->cap);
+	outbuf_put_bytes (&out, device->device_name.str,
+			  device->device_name.len);
+	outbuf_put_str (&out, g_link_status_message[DEVICE_STATUS (device)]);
+	slot->head_len = out.len;
+
+	if (DEVICE_STATUS (device) == LINK_UP)
+	{
+		/* the uptime goes in between, at send time */
+		slot->no_users = DEVICE_USERS (device);
+		outbuf_put_char (&out, ' ');
+		outbuf_put_int (&out, slot->no_users);
+		outbuf_put_char (&out, '\n');
+	}
+	else
+	{
+		outbuf_put_char (&out, '\n');
+		slot->head_len = out.len;
+		slot->no_users = 0;
+	}
+	slot->tail_len = out.len - slot->head_len;
+
+	if (!slot->dirty)
+	{
+		slot->dirty = TRUE;
+		s_dirty[s_n_dirty++] = device->device_index;
+	}
+}
+
+static void slot_uptimes (time_t now)
 {
-	int retval;
-	char *message;
-	device_list_t *list_pos = g_devices;
+	/* how long every device has been in its current state, into
+	   s_uptimes.  Only the slots of links that are up use theirs, but a
+	   straight run over the array is cheaper than picking them out. */
+	const time_t *connect_time = g_device_state.connect_time;
+	int *uptimes = s_uptimes;
+	int i;
 
-	/* create the status message of the format:
+	for (i = 0; i < s_n_slots; i++)
+		uptimes[i] = (int)(now - connect_time[i]);
+}
+
+void render_slot (outbuf_t *out, int index, int uptime)
+{
+	/* copy the slot to out, patching in the uptime */
+	status_slot_t *slot = &s_slots[index];
+
+	outbuf_put_bytes (out, slot->text, slot->head_len);
+	if (slot->tail_len)
+	{
+		outbuf_put_int (out, uptime);
+		outbuf_put_bytes (out, slot->text + slot->head_len,
+				  slot->tail_len);
+	}
+}
+
+void begin_broadcast (outbuf_t *out, const char *header, int with_seq)
+{
+	/* start a broadcast in s_send_buf, which broadcast_status_init()
+	   made big enough for every slot at its longest */
+	outbuf_init (out, s_send_buf, s_send_cap);
+	outbuf_put_str (out, header);
+	if (with_seq)
+	{
+		outbuf_put_uint (out, s_seq);
+		outbuf_put_char (out, '\n');
+	}
+}
+
+int broadcast_status_message (void)
+{
+	/* send the status message of the format:
 	 *
 	 * BROADCAST STATUS <device>\t<status>\n<device>\t<status>\n...
 	 *
@@ -40,68 +257,339 @@ int broadcast_status_message (void)
 	 * DOWN
 	 * CONNECTING
 	 * DISCONNECTING
+	 *
+	 * Everything but the uptimes is already rendered in the slots.
 	 */
+	outbuf_t out;
+	time_t now = time (NULL);
+	int i;
 
-	message = malloc (strlen (BROADCAST_STATUS) + 1);
-	if (message == NULL)
+	if (s_send_buf == NULL)
+	{
+		errno = EINVAL; /* broadcast_status_init() hasn't been run */
 		return (-1);
+	}
+	if (g_binary_broadcast)
+		return broadcast_binary (WIRE_BROADCAST_STATUS, FALSE, NULL,
+					 s_n_slots);
+
+	begin_broadcast (&out, BROADCAST_STATUS, FALSE);
+	slot_uptimes (now);
+	for (i = 0; i < s_n_slots; i++)
+		render_slot (&out, i, s_uptimes[i]);
+
+	return broadcast_split (out.data, out.len);
+}
 
-	strcpy (message, BROADCAST_STATUS);
-	while (list_pos)
+int broadcast_snapshot_message (void)
+{
+	/* send every device, tagged with the number of the last delta:
+	 *
+	 * BROADCAST SNAPSHOT <seq>\n<device>\t<status>\n...
+	 *
+	 * A client that has lost track of the deltas starts again from
+	 * here.
+	 */
+	outbuf_t out;
+	time_t now = time (NULL);
+	int i;
+
+	if (s_send_buf == NULL)
 	{
-		char *dev_stat = print_device_status (list_pos->data);
-		if (dev_stat == NULL)
-			return (-1);
-		message = realloc (message,
-				   strlen (message) + strlen (dev_stat) + 2);
-		if (message == NULL)
-			return (-1);
-		strcat (message, dev_stat);
-		strcat (message, "\n");
-		free (dev_stat);
-		list_pos = list_pos->next;
-	}
-		
-	retval = broadcast_message(message);
-	free (message);
-	return retval;
+		errno = EINVAL;
+		return (-1);
+	}
+
+	s_last_snapshot  = event_now_ms ();
+	s_snapshot_asked = FALSE;
+	if (g_binary_broadcast)
+		return broadcast_binary (WIRE_BROADCAST_SNAPSHOT, TRUE, NULL,
+					 s_n_slots);
+
+	begin_broadcast (&out, BROADCAST_SNAPSHOT, TRUE);
+	slot_uptimes (now);
+	for (i = 0; i < s_n_slots; i++)
+		render_slot (&out, i, s_uptimes[i]);
+
+	return broadcast_split (out.data, out.len);
 }
 
-int broadcast_init_message (void)
+int broadcast_delta_message (void)
 {
-	char *message = strdup (BROADCAST_INIT);
-	int retval = broadcast_message(message);
-	free (message);
-	return retval;
+	/* send just the devices that have changed since the last delta:
+	 *
+	 * BROADCAST DELTA <seq>\n<device>\t<status>\n...
+	 *
+	 * where <seq> goes up by one for each delta sent.  Nothing is sent
+	 * if nothing has changed.
+	 */
+	outbuf_t out;
+	time_t now = time (NULL);
+	int i;
+
+	if (s_n_dirty == 0)
+		return 0;
+
+	if (g_binary_broadcast)
+	{
+		int retval;
+
+		++s_seq;
+		retval = broadcast_binary (WIRE_BROADCAST_DELTA, TRUE, s_dirty,
+					   s_n_dirty);
+		while (s_n_dirty > 0)
+			s_slots[s_dirty[--s_n_dirty]].dirty = FALSE;
+		return retval;
+	}
+
+	++s_seq;
+	begin_broadcast (&out, BROADCAST_DELTA, TRUE);
+	for (i = 0; i < s_n_dirty; i++)
+	{
+		int index = s_dirty[i];
+
+		render_slot (&out, index,
+			     (int)(now - g_device_state.connect_time[index]));
+		s_slots[index].dirty = FALSE;
+	}
+	s_n_dirty = 0;
+
+	return broadcast_split (out.data, out.len);
 }
 
-int broadcast_quit_message (void)
+void broadcast_request_snapshot (void)
 {
-	char *message = strdup (BROADCAST_QUIT);
-	int retval = broadcast_message(message);
-	free (message);
+	/* a client has missed a delta.  However many ask, they all get
+	   the same snapshot at the end of the batch.  (There are no deltas
+	   to miss with legacy_status, just STATUS.) */
+	if (!g_legacy_status)
+		s_snapshot_asked = TRUE;
+}
+
+int broadcast_changes (void)
+{
+	/* called once the server has finished with a batch of events.  If
+	   anything has changed, or a client wants a snapshot, it goes out
+	   now - unless a window is open, in which case it waits for that
+	   to close */
+	if (s_n_dirty == 0 && !s_snapshot_asked)
+		return 0;
+	if (s_n_dirty > 0)
+		heartbeat_reset ();
+	if (s_window_open)
+		return 0;
+	return broadcast_flush ();
+}
+
+static int broadcast_flush (void)
+{
+	/* send whatever is waiting - a delta (a full STATUS for old-style
+	   clients) of the changes, and any snapshot asked for - and open a
+	   window to gather up whatever comes next.  Requested snapshots are
+	   limited to one every SNAPSHOT_MIN_MS; any more keep the window
+	   open until they're due. */
+	long now = event_now_ms ();
+	int sent = FALSE, retval = 0, delay;
+
+	if (s_n_dirty > 0)
+	{
+		if (g_legacy_status)
+		{
+			if (broadcast_status_message () < 0)
+				retval = -1;
+			while (s_n_dirty > 0)
+				s_slots[s_dirty[--s_n_dirty]].dirty = FALSE;
+		}
+		else if (broadcast_delta_message () < 0)
+			retval = -1;
+		sent = TRUE;
+	}
+
+	delay = g_broadcast_delay;
+	if (s_snapshot_asked)
+	{
+		if (now - s_last_snapshot >= SNAPSHOT_MIN_MS)
+		{
+			if (broadcast_snapshot_message () < 0)
+				retval = -1;
+			sent = TRUE;
+		}
+		else if (SNAPSHOT_MIN_MS - (now - s_last_snapshot) > delay)
+			delay = SNAPSHOT_MIN_MS - (now - s_last_snapshot);
+	}
+
+	if ((sent || s_snapshot_asked) && delay > 0)
+	{
+		if (event_timer_set (s_window_timer, delay, 0) < 0)
+			retval = -1;
+		else
+			s_window_open = TRUE;
+	}
 	return retval;
 }
 
-int broadcast_message (char *send_buffer)
+static int handle_window_timer (int fd, void *arg)
+{
+	/* the window is up: send anything that came in during it */
+	s_window_open = FALSE;
+	if ((s_n_dirty > 0 || s_snapshot_asked) && broadcast_flush () < 0)
+		perror ("broadcast_flush()");
+	return 0;
+}
+
+static int heartbeat_base (void)
+{
+	/* the heartbeat interval while things are changing, in ms */
+	int seconds = g_legacy_status ? g_poll_time : g_snapshot_time;
+
+	return (seconds > 0 ? seconds : 1) * 1000;
+}
+
+static void heartbeat_reset (void)
+{
+	/* something has changed.  If the heartbeat had backed off, bring
+	   it back to its base rate from now. */
+	s_changed = TRUE;
+	if (s_heartbeat_ms > heartbeat_base ())
+	{
+		s_heartbeat_ms = heartbeat_base ();
+		if (event_timer_set (s_heartbeat_timer, s_heartbeat_ms, 0) < 0)
+			perror ("event_timer_set()");
+	}
+}
+
+static int handle_heartbeat_timer (int fd, void *arg)
 {
-	struct sockaddr_in group;
+	/* the regular broadcast.  Old-style clients get the full status;
+	   otherwise it's a snapshot (the deltas having gone out as things
+	   changed).  Every time round that nothing has changed, the next
+	   one waits twice as long, up to heartbeat_max - except for
+	   old-style clients, which get it every poll_time regardless. */
+	int max_ms = g_heartbeat_max * 1000;
+
+	if (g_legacy_status)
+	{
+		if (broadcast_status_message () < 0)
+			perror ("broadcast_status_message()");
+	}
+	else if (broadcast_snapshot_message () < 0)
+		perror ("broadcast_snapshot_message()");
+
+	if (s_changed || g_legacy_status)
+		s_heartbeat_ms = heartbeat_base ();
+	else if (s_heartbeat_ms < max_ms)
+		s_heartbeat_ms = s_heartbeat_ms * 2 < max_ms ?
+			s_heartbeat_ms * 2 : max_ms;
+	s_changed = FALSE;
 
-	/* setup the socket address */
-	memset (&group, 0, sizeof (group));
-	group.sin_family = AF_INET;
-	if (inet_aton (g_multicast_group, &group.sin_addr) == 0)
+	if (event_timer_set (s_heartbeat_timer, s_heartbeat_ms, 0) < 0)
+		perror ("event_timer_set()");
+	return 0;
+}
+
+int broadcast_schedule_init (void)
+{
+	/* set up the timers the broadcasts go out on, and start the
+	   heartbeat */
+	if ((s_window_timer = event_timer_new (handle_window_timer, NULL)) < 0
+	    || (s_heartbeat_timer = event_timer_new (handle_heartbeat_timer,
+						     NULL)) < 0)
 		return (-1);
-	group.sin_port = htons (g_multicast_port);
 
-	/* send it */
-	if (sendto (g_socket_fd, send_buffer, strlen (send_buffer), 0,
-		    (struct sockaddr *) &group,
-		    sizeof (group)) != strlen (send_buffer))
+	s_heartbeat_ms = heartbeat_base ();
+	return event_timer_set (s_heartbeat_timer, s_heartbeat_ms, 0);
+}
+
+static int broadcast_binary (wire_type_t type, int with_seq,
+			     const int *indices, int n_indices)
+{
+	/* the binary form of the broadcasts above:
+	 *
+	 * <magic> <type> [<seq>] <count> <status record>*
+	 *
+	 * covering the slots in indices, or all of them if that's NULL
+	 */
+	time_t now = time (NULL);
+	int i;
+
+	wire_begin (&s_wire_buf, type);
+	if (with_seq)
+		wire_put_varint (&s_wire_buf, s_seq);
+	wire_put_varint (&s_wire_buf, n_indices);
+	for (i = 0; i < n_indices; i++)
 	{
+		int index = indices ? indices[i] : i;
+		status_slot_t *slot = &s_slots[index];
+
+		wire_put_status (&s_wire_buf, slot->device->device_name.str,
+				 g_device_state.status[index],
+				 now - g_device_state.connect_time[index],
+				 slot->no_users);
+	}
+	if (s_wire_buf.error)
+	{
+		errno = ENOMEM;
 		return (-1);
 	}
+	return fragment_binary (WIRE_BROADCAST_FRAGMENT,
+				(char *)s_wire_buf.data, s_wire_buf.len,
+				broadcast_sink, NULL);
+}
 
-	return 0;
+int broadcast_init_message (void)
+{
+	if (g_binary_broadcast)
+	{
+		wire_begin (&s_wire_buf, WIRE_BROADCAST_INIT);
+		if (s_wire_buf.error)
+		{
+			errno = ENOMEM;
+			return (-1);
+		}
+		return broadcast_buffer ((char *)s_wire_buf.data,
+					 s_wire_buf.len);
+	}
+
+	return broadcast_message (BROADCAST_INIT);
+}
+
+int broadcast_quit_message (void)
+{
+	if (g_binary_broadcast)
+	{
+		wire_begin (&s_wire_buf, WIRE_BROADCAST_QUIT);
+		if (s_wire_buf.error)
+		{
+			errno = ENOMEM;
+			return (-1);
+		}
+		return broadcast_buffer ((char *)s_wire_buf.data,
+					 s_wire_buf.len);
+	}
+
+	return broadcast_message (BROADCAST_QUIT);
+}
+
+int broadcast_message (const char *send_buffer)
+{
+	return broadcast_buffer (send_buffer, strlen (send_buffer));
+}
+
+int broadcast_split (const char *send_buffer, size_t len)
+{
+	/* status broadcasts grow with the number of devices - past one
+	   datagram's worth they go out as BROADCAST FRAGMENTs */
+	return fragment_message (BROADCAST_FRAGMENT, send_buffer, len, '\n',
+				 broadcast_sink, NULL);
 }
 
+static int broadcast_sink (void *arg, const char *datagram, size_t len)
+{
+	return broadcast_buffer (datagram, len);
+}
+
+int broadcast_buffer (const char *send_buffer, size_t len)
+{
+	/* to the group, on every interface we serve (see multicast.c) */
+	return multicast_send (send_buffer, len);
+}
@@ -0,0 +1,194 @@
+/* pool.c
+ * ------
+ *
+ * Fixed-size object pools, for the things the server allocates and frees
+ * over and over while it runs.  Objects are carved out of slabs, each of
+ * which keeps a freelist of its own, so that:
+ *
+ *  - allocating and freeing are O(1) and never go near malloc() once the
+ *    pool has grown to its working size;
+ *  - objects of one type stay together instead of being scattered through
+ *    the heap between everything else;
+ *  - a slab whose objects have all been freed can be handed back in one
+ *    go (see pool_trim()), so a burst of clients doesn't leave the daemon
+ *    bigger for the rest of its life.
+ *
+ * Slabs are aligned to their size, so the slab an object belongs to is
+ * found by masking its address.
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "server.h"
+
+#define POOL_SLAB_SIZE   16384 /* a power of two */
+#define POOL_MIN_OBJECTS 8     /* per slab, or the slab gets bigger */
+
+/* the start of each slab */
+struct _pool_slab_t
+{
+	struct _pool_slab_t *next;   /* in pool->available */
+	struct _pool_slab_t *prev;
+	pool_t              *pool;
+	void                *free;   /* this slab's freelist */
+	int                  n_free;
+};
+
+/* Local prototypes */
+static int  pool_grow         (pool_t *pool);
+static void pool_link         (pool_t *pool, pool_slab_t *slab);
+static void pool_unlink       (pool_t *pool, pool_slab_t *slab);
+static size_t pool_header_len (void);
+
+static size_t pool_header_len (void)
+{
+	/* objects start after the header, suitably aligned */
+	size_t align = sizeof (long double);
+
+	return (sizeof (pool_slab_t) + align - 1) & ~(align - 1);
+}
+
+int pool_init (pool_t *pool, const char *name, size_t object_size)
+{
+	size_t align = sizeof (void *);
+
+	memset (pool, 0, sizeof (pool_t));
+	pool->name = name;
+
+	/* every object has to be able to hold the freelist pointer */
+	if (object_size < sizeof (void *))
+		object_size = sizeof (void *);
+	pool->object_size = (object_size + align - 1) & ~(align - 1);
+
+	pool->slab_size = POOL_SLAB_SIZE;
+	while (pool->slab_size - pool_header_len ()
+	       < POOL_MIN_OBJECTS * pool->object_size)
+		pool->slab_size *= 2;
+	pool->per_slab = (pool->slab_size - pool_header_len ())
+		/ pool->object_size;
+	return 0;
+}
+
+static void pool_link (pool_t *pool, pool_slab_t *slab)
+{
+	slab->prev = NULL;
+	slab->next = pool->available;
+	if (slab->next)
+		slab->next->prev = slab;
+	pool->available = slab;
+}
+
+static void pool_unlink (pool_t *pool, pool_slab_t *slab)
+{
+	if (slab->prev)
+		slab->prev->next = slab->next;
+	else
+		pool->available = slab->next;
+	if (slab->next)
+		slab->next->prev = slab->prev;
+	slab->next = slab->prev = NULL;
+}
+
+static int pool_grow (pool_t *pool)
+{
+	/* add a slab, with all of its objects on its freelist */
+	pool_slab_t *slab;
+	char *object;
+	int i, err;
+
+	if ((err = posix_memalign ((void **)&slab, pool->slab_size,
+				   pool->slab_size)) != 0)
+	{
+		errno = err;
+		return (-1);
+	}
+	slab->pool   = pool;
+	slab->free   = NULL;
+	slab->n_free = pool->per_slab;
+
+	object = (char *)slab + pool_header_len ()
+		+ (pool->per_slab - 1) * pool->object_size;
+	for (i = 0; i < pool->per_slab; i++, object -= pool->object_size)
+	{
+		*(void **)object = slab->free;
+		slab->free = object;
+	}
+
+	pool_link (pool, slab);
+	pool->n_slabs++;
+	return 0;
+}
+
+void *pool_alloc (pool_t *pool)
+{
+	/* an object, uninitialised, or NULL if we're out of memory */
+	pool_slab_t *slab;
+	void *object;
+
+	if (pool->available == NULL && pool_grow (pool) < 0)
+		return NULL;
+
+	slab = pool->available;
+	object = slab->free;
+	slab->free = *(void **)object;
+	if (--slab->n_free == 0)
+		pool_unlink (pool, slab); /* full */
+
+	pool->allocs++;
+	if (++pool->in_use > pool->peak_in_use)
+		pool->peak_in_use = pool->in_use;
+	return object;
+}
+
+void pool_free (pool_t *pool, void *object)
+{
+	pool_slab_t *slab;
+
+	if (object == NULL)
+		return;
+	slab = (pool_slab_t *)((uintptr_t)object & ~(pool->slab_size - 1));
+
+	*(void **)object = slab->free;
+	slab->free = object;
+	if (slab->n_free++ == 0)
+		pool_link (pool, slab); /* it was full */
+	pool->in_use--;
+}
+
+int pool_trim (pool_t *pool)
+{
+	/* give back every slab with nothing allocated from it, except one
+	   to save going straight back to malloc.  Returns how many went. */
+	pool_slab_t *slab = pool->available, *next;
+	int kept = FALSE, released = 0;
+
+	for (; slab; slab = next)
+	{
+		next = slab->next;
+		if (slab->n_free < pool->per_slab)
+			continue;
+		if (!kept)
+		{
+			kept = TRUE;
+			continue;
+		}
+		pool_unlink (pool, slab);
+		free (slab);
+		pool->n_slabs--;
+		released++;
+	}
+	pool->released += released;
+	return released;
+}
+
+void pool_report (pool_t *pool, FILE *out)
+{
+	fprintf (out, "pool %s: %d in use (peak %d) of %d, %d slabs of %lu "
+		 "bytes, %lu allocations, %lu slabs released\n",
+		 pool->name, pool->in_use, pool->peak_in_use,
+		 pool->n_slabs * pool->per_slab, pool->n_slabs,
+		 (unsigned long)pool->slab_size, pool->allocs,
+		 pool->released);
+}
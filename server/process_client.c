@@ -10,113 +10,88 @@
 #include <cliserv.h>
 #include <protocol.h>
 #include "server.h"
-#include <string.h>
 
-int process_client (struct sockaddr_in cli, char *message)
+client_t *touch_client (struct sockaddr_in *cli)
 {
 	/* see whether the client is in our list of known clients */
-	client_t *client = get_client (&g_clients,cli.sin_addr);
+	client_t *client = find_client (cli->sin_addr);
 
 	if (client == NULL)
 	{
-		if (errno == ENODEV) /* must be a new client */
-		{
-			client = (client_t *)malloc (sizeof (client_t));
-			if (client == NULL)
-				return (-1);
-			memcpy (&client->sa, &cli,
-				sizeof (struct sockaddr_in));
-			client->last_heard_from = 0;
-			client->devices_connected = NULL;
-			if (add_client (&g_clients, client) < 0)
-				return (-1);
-		}
+		if (errno != ENODEV)
+			return NULL;
+
+		/* must be a new client */
+		if ((client = register_client (cli)) == NULL)
+			return NULL;
+		client->last_heard_from = 0;
+		client->binary = FALSE;
+		wheel_timer_init (&client->timeout, client_timed_out, client);
 	}
 	/* update the last heard time  and sockaddr_in struct */
-	update_client (client, &cli);
+	update_client (client, cli);
+	return client;
+}
+
+int process_client (struct sockaddr_in cli, request_t *request)
+{
+	client_t *client = touch_client (&cli);
+	device_t *device = NULL;
 
-	/* first figure out what the message is */
-	if (strncmp (message, CLIENT_PING, strlen (CLIENT_PING)) == 0)
+	if (client == NULL)
+		return (-1);
+	client->binary = request->binary;
+
+	/* the requests that name a device need it to exist */
+	if (request->device.str != NULL &&
+	    (device = find_device (request->device.str,
+				   request->device.len)) == NULL)
+		return (-1);
+
+	switch (request->type)
 	{
+	case WIRE_CLIENT_PING:
 		/* Simply update the last heard from time */
 		return 0;
-	}
-	else if(strncmp (message, CLIENT_DEVICES, strlen (CLIENT_DEVICES)) == 0)
-	{
+
+	case WIRE_CLIENT_DEVICES:
 		/* return a list of devices to the client */
 		return send_device_list (client);
-	}
-	else if (strncmp (message, CLIENT_UP, strlen (CLIENT_UP)) == 0)
-	{
-		char *dev_str = message + strlen (CLIENT_UP);
-		device_t *device = get_device (&g_devices, dev_str);
-		if (device == NULL)
-		{
-			return (-1);
-		}
-		if (connect_client_to_device (client, device) < 0)
-		{
-			return (-1);
-		}
-		return 0;
-	}
-	else if (strncmp (message, CLIENT_DOWN, strlen (CLIENT_DOWN)) == 0)
-	{
-		char *dev_str = message + strlen (CLIENT_DOWN);
-		device_t *device = get_device (&client->devices_connected,
-					       dev_str);
-		if (device == NULL)
-		{
-			return (-1);
-		}
-		if (disconnect_client_from_device (client, device) < 0)
-		{
-			return (-1);
-		}
-		return 0;
-	}
-	else if (strncmp (message, CLIENT_FORCE_DOWN,
-			  strlen (CLIENT_FORCE_DOWN)) == 0)
-	{
+
+	case WIRE_CLIENT_UP:
+		return connect_client_to_device (client, device);
+
+	case WIRE_CLIENT_DOWN:
+		/* fails with ENODEV if the client wasn't connected */
+		return disconnect_client_from_device (client, device);
+
+	case WIRE_CLIENT_FORCE_DOWN:
 		/* the current device is to be forced down regardless of who
 		   is connected */
-		char *dev_str = message + strlen (CLIENT_FORCE_DOWN);
-		device_t *device = get_device (&g_devices, dev_str);
-		if (device == NULL)
-		{
-			errno = ENODEV;
-			return (-1);
-		}
-		
 		if (alter_device_status (device, LINK_DOWN) < 0)
 			return (-1);
 		if (remove_all_clients_from_device (device) < 0)
 			return (-1);
-
 		return 0;
-	}
-	else if (strncmp (message, CLIENT_STATUS, strlen (CLIENT_STATUS)) == 0)
-	{
-		char *dev_str = message + strlen (CLIENT_STATUS);
-		device_t *device = get_device (&g_devices, dev_str);
-		if (device == NULL)
-		{	
-			return (-1);
-		}
 
+	case WIRE_CLIENT_STATUS:
 		return send_device_status (client, device);
-	}
-	else if (strncmp (message, CLIENT_CLIENT_STATUS,
-			  strlen (CLIENT_CLIENT_STATUS)) == 0)
-	{
+
+	case WIRE_CLIENT_CLIENT_STATUS:
 		return send_client_status (client);
-	}
-	else
-	{
+
+	case WIRE_CLIENT_SNAPSHOT:
+		/* the client missed a delta - everybody gets a snapshot
+		   shortly */
+		broadcast_request_snapshot ();
+		return 0;
+
+	case WIRE_CLIENT_LOG:
+		return send_device_log (client, device, request->lines);
+
+	default:
 		/* unknown message */
 		errno = ENOTSUP;
 		return (-1);
 	}
-	
 }
-
@@ -12,33 +12,25 @@
 #include <protocol.h>
 #include "server.h"
 
-int process_peer (char *message)
+int process_peer (request_t *request)
 {
-	if (strncmp (message, NOTIFY_ISUP, strlen (NOTIFY_ISUP)) == 0)
+	device_t *device = find_device (request->device.str,
+					request->device.len);
+	if (device == NULL)
 	{
-		char *dev_str = message + strlen (NOTIFY_ISUP);
-		device_t *device = get_device (&g_devices, dev_str);
-		if (device == NULL)
-		{
-			return (-1);
-		}
-		
-		alter_device_status (device, LINK_UP);
-		return 0;
+		return (-1);
 	}
-	else if (strncmp (message, NOTIFY_ISDOWN, strlen (NOTIFY_ISDOWN)) == 0)
+
+	switch (request->type)
 	{
-		char *dev_str = message + strlen (NOTIFY_ISDOWN);
-		device_t *device = get_device (&g_devices, dev_str);
-		if (device == NULL)
-		{
-			return (-1);
-		}
-		
+	case WIRE_NOTIFY_ISUP:
+		alter_device_status (device, LINK_UP);
+		return 0;
+
+	case WIRE_NOTIFY_ISDOWN:
 		return alter_device_status (device, LINK_DOWN);
-	}
-	else
-	{
+
+	default:
 		errno = ENOTSUP;
 		return (-1);
 	}
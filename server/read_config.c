@@ -23,15 +23,28 @@
  * -------------------+-----------+--------------
  * fork               | number    | 1 (true)
  * debug              | number    | 0 (false)
- * poll_time          | number    | 5 (seconds)
+ * poll_time          | number    | 5 (seconds between STATUS while busy)
  * srv_addr           | string    | "0.0.0.0" (listen on all interfaces)
  * srv_port           | number    | 9876
  * multicast_group    | string    | "239.255.42.42" (site-local admin group)
  * multicast_port     | number    | 6789
+ * multicast_ifs      | string    | "" (eg "eth0 eth1"; "" = routing table)
+ * multicast_ttl      | number    | 1
+ * multicast_loop     | number    | 1 (true)
  * client_timeout     | number    | 7200 (seconds - 2 hours)
  * retries            | number    | 3
  * connect_timeout    | number    | 60
  * disconnect_timeout | number    | 60
+ * recv_batch         | number    | 32 (datagrams read per wakeup)
+ * workers            | number    | 1 (threads serving requests)
+ * legacy_status      | number    | 0 (1 = BROADCAST STATUS, not deltas)
+ * snapshot_time      | number    | 10 (seconds between SNAPSHOTs while busy)
+ * binary_broadcast   | number    | 0 (1 = broadcasts in the binary encoding)
+ * broadcast_delay    | number    | 100 (ms to gather changes into one)
+ * heartbeat_max      | number    | 30 (seconds between broadcasts when idle)
+ * link_commands      | number    | 8 (at once, others queue; 0 = no limit)
+ * command_log        | number    | 4096 (bytes of command output kept per
+ *                    |           |       device; 0 = don't capture it)
  *
  * The remainder of the configuration file specifies devices.  It takes the
  * form:
@@ -49,17 +62,44 @@
  * link_up         | string    | "" (command to activate the link)
  * link_down       | string    | "" (command to deactivate the link)
  * link_force_down | string    | "" (command to force the link to die)
+ * shell           | number    | 0 (1 = run the commands with sh -c)
+ * driver          | string    | "" (in place of the commands, see
+ *                 |           |     link_driver.h; eg "netlink")
+ * driver_arg      | string    | "" (for the driver; the interface for
+ *                 |           |     netlink, if it isn't the name)
  *
  * Currently, escaped characters are not supported, but support may be
  * added later...  Tabs and newlines are not accepted in strings.  IP
  * addresses may (currently) only be done numerically.
  *
- * WARNING: parse_server_section() and parse_device_section are broken in that
- *          they will not accept the last line if there is not a carriage
- *          return at the end of the file.  I don't see this as a worry, since
- *          certain programs which parse fstab have exactly the same issue...
+ * The link commands aren't given to a shell unless the device has
+ * shell = 1.  Instead they are split into words at spaces and tabs, as sh
+ * would split a simple command: '...' keeps a word together and a
+ * backslash passes the next character on as it is.  The first word is
+ * the program, looked for in $PATH.  Either way, %device% is replaced by
+ * the device's name, eg
+ *
+ *   link_up = "/sbin/ifup %device%"
+ */
+
+/* Storage
+ * -------
+ *
+ * Everything the configuration produces lives in one arena (see arena.c):
+ * the devices, one after another, followed by a copy of the file.  Lines
+ * are split up in place, with a NUL written where each string value ends,
+ * so the devices' strings are views straight into that copy rather than
+ * allocations of their own, and the whole lot can be dropped with one
+ * free.  The arena can't grow, so read_config() sizes it from the file
+ * before parsing anything.
+ *
+ * The link commands, once split up, go in a second arena of their own:
+ * how much they need isn't known until the devices have been read, so
+ * tokenize_commands() goes over them twice, once to size it and once to
+ * fill it.
  */
 
+#define _GNU_SOURCE /* for memmem() */
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/mman.h>
@@ -71,34 +111,79 @@
 
 #include "server.h"
 
+#define DEVICE_TOKEN     "%device%"
+#define DEVICE_TOKEN_LEN (sizeof (DEVICE_TOKEN) - 1)
+#define SHELL_PATH       "/bin/sh"
+#define SHELL_CHARS      "|&;<>()$`*?"
+
 /* Server variables */
 int            g_fork               = TRUE;
 int            g_debug              = FALSE;
 int            g_poll_time          = DEFAULT_POLL_TIME;
 char          *g_config_file        = DEFAULT_CONFIG_FILE;
-char          *g_srv_inaddr         = NULL;
+const char    *g_srv_inaddr         = NULL;
 unsigned short g_srv_port           = DEFAULT_SRV_PORT;
-char          *g_multicast_group    = DEFAULT_MULTICAST_GROUP;
+const char    *g_multicast_group    = DEFAULT_MULTICAST_GROUP;
 unsigned short g_multicast_port     = DEFAULT_MULTICAST_PORT;
+const char    *g_multicast_ifs      = NULL;
+int            g_multicast_ttl      = DEFAULT_MULTICAST_TTL;
+int            g_multicast_loop     = DEFAULT_MULTICAST_LOOP;
 int            g_client_timeout     = DEFAULT_CLIENT_TIMEOUT;
 int            g_retries            = DEFAULT_RETRIES;
 int            g_connect_timeout    = DEFAULT_CONNECT_TIMEOUT;
 int            g_disconnect_timeout = DEFAULT_DISCONNECT_TIMEOUT;
+int            g_recv_batch         = DEFAULT_RECV_BATCH;
+int            g_workers            = DEFAULT_WORKERS;
+int            g_legacy_status      = DEFAULT_LEGACY_STATUS;
+int            g_snapshot_time      = DEFAULT_SNAPSHOT_TIME;
+int            g_binary_broadcast   = DEFAULT_BINARY_BROADCAST;
+int            g_broadcast_delay    = DEFAULT_BROADCAST_DELAY;
+int            g_heartbeat_max      = DEFAULT_HEARTBEAT_MAX;
+int            g_link_commands      = DEFAULT_LINK_COMMANDS;
+int            g_command_log        = DEFAULT_COMMAND_LOG;
 
 /* File-level variables */
-static int   s_config_fd       = -1;
-static char *s_config_data     = NULL;
-static int   s_config_data_len = 0;
+static int       s_config_fd       = -1;
+static char     *s_config_data     = NULL;
+static int       s_config_data_len = 0;
+static arena_t   s_config_arena    = { NULL, 0, 0 };
+static arena_t   s_argv_arena      = { NULL, 0, 0 };
+static device_t *s_devices         = NULL; /* in s_config_arena */
+static int       s_n_devices       = 0;
+static int       s_max_devices     = 0;
+
+/* the value of any device string that isn't in the file */
+static const str_view_t s_empty_string = { "", 0 };
+
+typedef enum _config_section_t
+{
+	SECTION_NONE,    /* before the first section */
+	SECTION_SERVER,
+	SECTION_DEVICE,
+	SECTION_UNKNOWN
+} config_section_t;
 
 /* Local prototypes */
-char *open_config_file        (void);
-int   close_config_file       (void);
-char *get_server_section      (char *config_data);
-char *get_next_device_section (char *config_data);
-int   parse_server_section    (char *server_data);
-int   parse_device_section    (char *device_data);
-int   parse_line              (char *line, char **name, char **value);
-int   modify_server_conf      (char *name, char *value);
+char     *open_config_file      (void);
+int       close_config_file     (void);
+int       count_sections        (const char *config_data, size_t len,
+				 const char *section_name);
+int       parse_config          (char *config_text);
+device_t *new_device            (void);
+void      parse_server_option   (str_view_t *name, str_view_t *value);
+void      parse_device_option   (device_t *device, str_view_t *name,
+				 str_view_t *value);
+int       tokenize_commands     (void);
+int       device_argv           (device_t *device, link_command_t command,
+				 arena_t *arena, size_t *space);
+int       command_words         (const char *command_line,
+				 const char *device_name, int split,
+				 char **argv, char *text, size_t *text_len);
+void      register_devices      (void);
+int       parse_line            (char *line, str_view_t *name,
+				 str_view_t *value);
+int       option_is             (str_view_t *name, const char *option);
+int       modify_server_conf    (char *name, char *value);
 
 int parse_command_line (int argc, char *argv[])
 {
@@ -156,7 +241,10 @@ int parse_command_line (int argc, char *argv[])
 
 int read_config ()
 {
-	char *config, *server_section, *device_section;
+	char *config, *config_text;
+	size_t arena_size;
+	int real_errno;
+
 	if ((config = open_config_file()) == NULL)
 	{
 		if (errno == ENOENT) // config file doesn't exist, use defaults
@@ -165,41 +253,44 @@ int read_config ()
 			return (-1);
 	}
 
-	if ((server_section = get_server_section (config)) == NULL)
+	/* there can't be more devices than [Device] lines */
+	s_max_devices = count_sections (config, s_config_data_len, "[Device]");
+	arena_size = arena_space (s_max_devices * sizeof (device_t))
+		+ arena_space (s_config_data_len + 1);
+	if (arena_init (&s_config_arena, arena_size) < 0 ||
+	    (s_devices = (device_t *)arena_alloc (&s_config_arena,
+						  s_max_devices
+						  * sizeof (device_t))) == NULL ||
+	    (config_text = (char *)arena_alloc (&s_config_arena,
+						s_config_data_len + 1)) == NULL)
 	{
-		if (errno != ENOMSG) // no server section - use defaults
-		{
-			int real_errno = errno;
-			close_config_file ();
-			errno = real_errno;
-			return (-1);
-		}
-	}
-	else
-	{
-		if (parse_server_section (server_section) < 0)
-		{
-			int real_errno = errno;
-			close_config_file ();
-			errno = real_errno;
-			return (-1);
-		}
+		real_errno = errno;
+		close_config_file ();
+		arena_free (&s_config_arena);
+		errno = real_errno;
+		return (-1);
 	}
-	
-	while ((device_section = get_next_device_section (config))
-	       != NULL)
+	memcpy (config_text, config, s_config_data_len);
+	config_text[s_config_data_len] = '\0';
+
+	if (close_config_file () < 0 || parse_config (config_text) < 0 ||
+	    tokenize_commands () < 0)
 	{
-		if (parse_device_section (device_section) < 0)
-		{
-			int real_errno = errno;
-			close_config_file ();
-			errno = real_errno;
-			return (-1);
-		}
+		/* nothing has been registered yet, so the whole reading can
+		   go - including anything the server options point at */
+		real_errno = errno;
+		arena_free (&s_config_arena);
+		arena_free (&s_argv_arena);
+		s_devices = NULL;
+		s_n_devices = 0;
+		g_srv_inaddr = NULL;
+		g_multicast_group = DEFAULT_MULTICAST_GROUP;
+		g_multicast_ifs = NULL;
+		errno = real_errno;
+		return (-1);
 	}
 
-	if (close_config_file () < 0)
-		return (-1);
+	register_devices ();
 	return 0;
 }
 
@@ -235,246 +326,396 @@ char *open_config_file ()
 
 int close_config_file ()
 {
+	int fd = s_config_fd;
+
 	if (s_config_fd == -1)
 	{
 		errno = EBADFD;
 		return (-1);
 	}
+	s_config_fd = -1;
 
 	if (munmap (s_config_data, s_config_data_len) < 0)
 		return (-1);
 
-	if (close (s_config_fd) < 0)
+	if (close (fd) < 0)
 		return (-1);
 
 	return 0;
 }
 
-char *get_server_section (char *config_data)
+int count_sections (const char *config_data, size_t len,
+		    const char *section_name)
 {
-	/* search the config_data for a section beginning "[Server]"
-	   (case sensitive).  Return a string with the block of data
-	   inside the server section. */
+	/* how many times section_name appears in the (unterminated)
+	   config_data */
+	size_t name_len = strlen (section_name);
+	const char *pos = config_data, *end = config_data + len;
+	int count = 0;
 
-	/* first, find the start position. */
-	char *start, *end, *ret_val = NULL;
-
-	start = strstr (config_data, "[Server]");
-	if (start == NULL)
+	while ((pos = memmem (pos, end - pos, section_name, name_len))
+	       != NULL)
 	{
-		errno = ENOMSG;
-		return NULL;
+		count++;
+		pos += name_len;
 	}
+	return count;
+}
 
-	end = strchr (start + 1, '[');
-	if (end == NULL) // The server section is at the end of the file
+int parse_config (char *config_text)
+{
+	/* go through the file a line at a time.  A line starting with '['
+	   begins a new section; every other non-empty line is an option for
+	   the section it's in. */
+	config_section_t section = SECTION_NONE;
+	device_t *device = NULL;
+	char *line, *next;
+
+	for (line = config_text; *line != '\0'; line = next)
 	{
-		ret_val = (char *)malloc (strlen (start) + 1);
-		strcpy (ret_val, start);
+		str_view_t name, value;
+		char *end = strchr (line, '\n');
+
+		if (end != NULL)
+		{
+			*end = '\0';
+			next = end + 1;
+		}
+		else // the last line, with no newline after it
+			next = end = line + strlen (line);
+
+		/* ignore leading and trailing whitespace */
+		while (*line == ' ' || *line == '\t')
+			line++;
+		while (end > line && strchr (" \t\r", end[-1]) != NULL)
+			*--end = '\0';
+
+		if (*line == '\0')
+		{
+			/* empty line */
+		}
+		else if (*line == '[')
+		{
+			if (strncmp (line, "[Server]", 8) == 0)
+				section = SECTION_SERVER;
+			else if (strncmp (line, "[Device]", 8) == 0)
+			{
+				section = SECTION_DEVICE;
+				if ((device = new_device ()) == NULL)
+					return (-1);
+			}
+			else
+			{
+				fprintf (stderr, "Unrecognised section %s in "
+					 "config file.\n", line);
+				section = SECTION_UNKNOWN;
+			}
+		}
+		else if (parse_line (line, &name, &value) < 0)
+		{
+			fprintf(stderr,
+				"Warning: invalid line in config file:  %s\n",
+				line);
+		}
+		else if (section == SECTION_SERVER)
+			parse_server_option (&name, &value);
+		else if (section == SECTION_DEVICE)
+			parse_device_option (device, &name, &value);
 	}
-	else
+	return 0;
+}
+
+device_t *new_device (void)
+{
+	/* the next device in the arena, with everything at its default */
+	device_t *device;
+
+	if (s_n_devices == s_max_devices) // can't happen
 	{
-		ret_val = (char *)malloc (strlen (start) - strlen (end) + 1);
-		strncpy (ret_val, start, strlen (start) - strlen (end));
+		errno = ENOMEM;
+		return NULL;
 	}
-	return ret_val;
+	device = &s_devices[s_n_devices++];
+
+	memset (device, 0, sizeof (device_t)); // make sure its empty
+	device->device_description = s_empty_string;
+	device->followup_timer = -1;
+	wheel_timer_init (&device->timeout, device_timed_out, device);
+	return device;
 }
-char *get_next_device_section (char *config_data)
+
+void parse_server_option (str_view_t *name, str_view_t *value)
 {
-	/* search the config_data for a section beginning "[Device]"
-	   (case sensitive).  Return a string with the block of data
-	   inside the device section. */
+	char * end_ptr;
+	int numeric_value = strtoul(value->str, &end_ptr, 0);
+	int number_valid = ((value->len != 0)
+			      && (*end_ptr =='\0')) ? 1 : 0;
+
+	if (option_is (name, "fork") && number_valid)
+		g_fork = numeric_value;
+	else if (option_is (name, "debug") && number_valid)
+		g_debug = numeric_value;
+	else if (option_is (name, "poll_time") && number_valid)
+		 g_poll_time = numeric_value;
+	else if (option_is (name, "srv_port") && number_valid)
+		g_srv_port = numeric_value;
+	else if (option_is (name, "srv_inaddr") && number_valid)
+		g_srv_inaddr = value->str;
+	else if (option_is (name, "client_timeout") && number_valid)
+		g_client_timeout = numeric_value;
+	else if (option_is (name, "multicast_group"))
+		g_multicast_group = value->str;
+	else if (option_is (name, "multicast_ifs"))
+		g_multicast_ifs = value->str;
+	else if (option_is (name, "multicast_ttl") && number_valid)
+		g_multicast_ttl = numeric_value;
+	else if (option_is (name, "multicast_loop") && number_valid)
+		g_multicast_loop = numeric_value;
+	else if (option_is (name, "retries") && number_valid)
+		g_retries = numeric_value;
+	else if (option_is (name, "connect_timeout") && number_valid)
+		g_connect_timeout = numeric_value;
+	else if (option_is (name, "disconnect_timeout") && number_valid)
+		g_disconnect_timeout = numeric_value;
+	else if (option_is (name, "recv_batch") && number_valid)
+		g_recv_batch = numeric_value;
+	else if (option_is (name, "workers") && number_valid)
+		g_workers = numeric_value;
+	else if (option_is (name, "legacy_status") && number_valid)
+		g_legacy_status = numeric_value;
+	else if (option_is (name, "snapshot_time") && number_valid)
+		g_snapshot_time = numeric_value;
+	else if (option_is (name, "binary_broadcast") && number_valid)
+		g_binary_broadcast = numeric_value;
+	else if (option_is (name, "broadcast_delay") && number_valid)
+		g_broadcast_delay = numeric_value;
+	else if (option_is (name, "heartbeat_max") && number_valid)
+		g_heartbeat_max = numeric_value;
+	else if (option_is (name, "link_commands") && number_valid)
+		g_link_commands = numeric_value;
+	else if (option_is (name, "command_log") && number_valid)
+		g_command_log = numeric_value;
+	else
+		fprintf(stderr, "Invalid server option %.*s\n",
+			(int)name->len, name->str);
+}
 
-	/* keep track of our current position */
-	static int cur_pos = 0;
+void parse_device_option (device_t *device, str_view_t *name,
+			  str_view_t *value)
+{
+	if (option_is (name, "name"))
+		device->device_name = *value;
+	else if (option_is (name, "description"))
+		device->device_description = *value;
+	else if (option_is (name, "link_up"))
+		device->link_up_command = *value;
+	else if (option_is (name, "link_down"))
+		device->link_down_command = *value;
+	else if (option_is (name, "link_force_down"))
+		device->link_force_down_command = *value;
+	else if (option_is (name, "shell"))
+		device->shell = strtol (value->str, NULL, 0);
+	else if (option_is (name, "driver"))
+		device->driver = *value;
+	else if (option_is (name, "driver_arg"))
+		device->driver_arg = *value;
+	else
+		fprintf(stderr, "Unrecognised option %.*s in "
+			"[Device] section.\n", (int)name->len, name->str);
+}
 
-	/* first, find the start position. */
-	char *start, *end, *ret_val = NULL;
+int tokenize_commands (void)
+{
+	/* split up every named device's commands, into an arena sized to
+	   fit them all */
+	link_command_t command;
+	size_t space = 0;
+	int i;
 
-	if (cur_pos == -1) // finished
+	for (i = 0; i < s_n_devices; i++)
 	{
-		cur_pos = 0; // ready to start again
-		errno = ENOMSG;
-		return NULL;
+		if (s_devices[i].device_name.str == NULL)
+			continue;
+		for (command = LINK_CMD_UP; command <= LINK_CMD_FORCE_DOWN;
+		     command++)
+			device_argv (&s_devices[i], command, NULL, &space);
 	}
 
-	start = strstr (config_data + cur_pos, "[Device]");
-	if (start == NULL)
+	if (arena_init (&s_argv_arena, space) < 0)
+		return (-1);
+	for (i = 0; i < s_n_devices; i++)
 	{
-		cur_pos = 0; // ready to start again
-		errno = ENOMSG;
-		return NULL;
+		if (s_devices[i].device_name.str == NULL)
+			continue;
+		for (command = LINK_CMD_UP; command <= LINK_CMD_FORCE_DOWN;
+		     command++)
+		{
+			if (device_argv (&s_devices[i], command,
+					 &s_argv_arena, &space) < 0)
+				return (-1);
+		}
 	}
+	return 0;
+}
 
-	end = strchr (start + 1, '[');
-	if (end == NULL) // This device section is at the end of the file
+int device_argv (device_t *device, link_command_t command, arena_t *arena,
+		 size_t *space)
+{
+	/* with no arena, add the room the device's command needs to *space.
+	   With one, split the command up in it and point
+	   device->link_argv[command] at the result - NULL if there's
+	   nothing to run */
+	const char *command_line, *option;
+	int n_shell = device->shell ? 2 : 0; /* sh -c */
+	int n_words;
+	size_t vector_len, text_len;
+	char **argv;
+
+	switch (command)
 	{
-		ret_val = (char *)malloc (strlen (start) + 1);
-		strcpy (ret_val, start);
-		cur_pos = -1; // we've reached the end
+	case LINK_CMD_UP:
+		command_line = device->link_up_command.str;
+		option = "link_up";
+		break;
+	case LINK_CMD_DOWN:
+		command_line = device->link_down_command.str;
+		option = "link_down";
+		break;
+	default:
+		command_line = device->link_force_down_command.str;
+		option = "link_force_down";
+		break;
 	}
-	else
+
+	device->link_argv[command] = NULL;
+	if (command_line == NULL ||
+	    (n_words = command_words (command_line, device->device_name.str,
+				      !device->shell, NULL, NULL,
+				      &text_len)) == 0)
+		return 0;
+	vector_len = (n_shell + n_words + 1) * sizeof (char *);
+
+	if (arena == NULL)
+	{
+		if (!device->shell && strpbrk (command_line, SHELL_CHARS))
+			fprintf (stderr, "Device %s: %s is run without a "
+				 "shell (see shell = 1)\n",
+				 device->device_name.str, option);
+		*space += arena_space (vector_len + text_len);
+		return 0;
+	}
+
+	if ((argv = (char **)arena_alloc (arena, vector_len + text_len))
+	    == NULL)
+		return (-1);
+	if (device->shell)
 	{
-		cur_pos = (end - start) + 1;
-		ret_val = (char *)malloc (strlen (start) - strlen (end) + 1);
-		strncpy (ret_val, start, strlen (start) - strlen (end));
+		argv[0] = SHELL_PATH;
+		argv[1] = "-c";
 	}
-	return ret_val;
+	command_words (command_line, device->device_name.str, !device->shell,
+		       argv + n_shell, (char *)argv + vector_len, &text_len);
+	argv[n_shell + n_words] = NULL;
+	device->link_argv[command] = argv;
+	return 0;
 }
 
-int parse_server_section (char *server_data)
+int command_words (const char *command_line, const char *device_name,
+		   int split, char **argv, char *text, size_t *text_len)
 {
-	char *name, *value, *section_name, *pos, *prev_pos, *line;
-	/* find the section name */
-	pos = strpbrk (server_data, "\n\0");
-	prev_pos = pos + 1;
-	section_name = (char *)malloc (pos - server_data + 1);
-	strncpy (section_name, server_data, pos - server_data);
-	section_name[pos - server_data] = '\0';
-
-	while ((pos = strpbrk (prev_pos + 1, "\n\0")) != NULL)
+	/* the words in command_line, with each %device% replaced by
+	   device_name.  If split is FALSE the whole line is one word.  Each
+	   word is put in text, NUL terminated, and pointed to from argv;
+	   either may be NULL to just count.  Returns the number of words,
+	   and the room they take in *text_len. */
+	size_t name_len = strlen (device_name), len = 0;
+	int n_words = 0, in_word = FALSE, quoted = FALSE;
+	const char *pos;
+
+	for (pos = command_line; *pos != '\0'; pos++)
 	{
-		line = (char *)malloc (pos - prev_pos + 1);
-		strncpy (line, prev_pos, pos - prev_pos);
-		line[pos-prev_pos] = '\0';
-		if (strlen (line) == 0)
+		if (split && !quoted && (*pos == ' ' || *pos == '\t'))
 		{
-			/* empty line */
+			if (in_word)
+			{
+				if (text)
+					text[len] = '\0';
+				len++;
+				in_word = FALSE;
+			}
+			continue;
 		}
-		else if (parse_line (line, &name, &value) < 0)
+
+		if (!in_word)
 		{
-			fprintf(stderr,
-				"Warning: invalid line in config file:  %s\n",
-				line);
+			if (argv)
+				argv[n_words] = text + len;
+			n_words++;
+			in_word = TRUE;
+		}
+
+		if (split && *pos == '\'')
+			quoted = !quoted;
+		else if (strncmp (pos, DEVICE_TOKEN, DEVICE_TOKEN_LEN) == 0)
+		{
+			if (text)
+				memcpy (text + len, device_name, name_len);
+			len += name_len;
+			pos += DEVICE_TOKEN_LEN - 1;
 		}
 		else
 		{
-			char * end_ptr;
-			int numeric_value = strtoul(value, &end_ptr, 0);
-			int number_valid = ((*value != '\0') 
-					      && (*end_ptr =='\0')) ? 1 : 0;
-			
-			if ((strcasecmp (name, "fork") == 0) && number_valid)
-				g_fork = numeric_value;
-			else if ((strcasecmp (name, "debug") == 0) &&
-				 number_valid)
-				g_debug = numeric_value;
-			else if ((strcasecmp (name, "poll_time") == 0) &&
-				  number_valid)
-				 g_poll_time = numeric_value;
-			else if ((strcasecmp (name, "srv_port") == 0) &&
-				 number_valid)
-				g_srv_port = numeric_value;
-			else if ((strcasecmp (name, "srv_inaddr") == 0) &&
-				 number_valid)
-				g_srv_inaddr = strdup(value);
-			else if ((strcasecmp (name, "client_timeout") == 0) &&
-				 number_valid)
-				g_client_timeout = numeric_value;
-			else if (strcasecmp (name, "multicast_group") == 0)
-				g_multicast_group = strdup(value);
-			else if ((strcasecmp (name, "retries") == 0) &&
-				 number_valid)
-				g_retries = numeric_value;
-			else if ((strcasecmp (name, "connect_timeout") == 0) &&
-				 number_valid)
-				g_connect_timeout = numeric_value;
-			else if ((strcasecmp (name, "disconnect_timeout") == 0)
-				 && number_valid)
-				g_disconnect_timeout = numeric_value;
-			else
-				fprintf(stderr,
-					"Invalid server option %s\n", name);
+			if (split && !quoted && *pos == '\\' && pos[1] != '\0')
+				pos++;
+			if (text)
+				text[len] = *pos;
+			len++;
 		}
-
-		prev_pos = pos + 1;
-		free (line);
 	}
 
-	return 0;
+	if (in_word)
+	{
+		if (text)
+			text[len] = '\0';
+		len++;
+	}
+	*text_len = len;
+	return n_words;
 }
 
-int parse_device_section (char *device_data)
+void register_devices (void)
 {
-	char *name, *value, *section_name, *pos, *prev_pos, *line;
-	device_t *new_device = (device_t *)malloc (sizeof (device_t));
-	memset (new_device, 0, sizeof (device_t)); // make sure its empty
-
-	if (new_device == NULL)
-		return (-1);
-
-	/* find the section name */
-	pos = strpbrk (device_data, "\n\0");
-	prev_pos = pos + 1;
-	section_name = (char *)malloc (pos - device_data + 1);
-	strncpy (section_name, device_data, pos - device_data);
-	section_name[pos - device_data] = '\0';
+	/* thanks to new_device(), anything that wasn't filled in has a valid
+	   default.  So, unless we have an empty name, add it to the device
+	   list */
+	int i;
 
-	while ((pos = strpbrk (prev_pos + 1, "\n\0")) != NULL)
+	for (i = 0; i < s_n_devices; i++)
 	{
-		line = (char *)malloc (pos - prev_pos + 1);
-		strncpy (line, prev_pos, pos - prev_pos);
-		line[pos-prev_pos] = '\0';
-		if (strlen (line) == 0)
-		{
-			/* empty line */
-		}
-		else if (parse_line (line, &name, &value) < 0)
-		{
-			fprintf(stderr,
-				"Warning: invalid line in config file:  %s\n",
-				line);
-		}
-		else
-		{
-			if (strcasecmp (name, "name") == 0)
-				new_device->device_name = strdup (value);
-			else if (strcasecmp (name, "description") == 0)
-				new_device->device_description = strdup(value);
-			else if (strcasecmp (name, "link_up") == 0)
-				new_device->link_up_command = strdup (value);
-			else if (strcasecmp (name, "link_down") == 0)
-				new_device->link_down_command = strdup (value);
-			else if (strcasecmp (name, "link_force_down") == 0)
-				new_device->link_force_down_command = 
-					strdup (value);
-			else
-				fprintf(stderr, "Unrecognised option %s in "
-					"[Device] section.\n", name);
-		}
+		device_t *device = &s_devices[i];
 
-		prev_pos = pos + 1;
-		free (line);
-		free (name);
-		free (value);
+		if (device->device_name.str == NULL)
+			fprintf(stderr, "Device section has no name.\n");
+		else if (register_device (device) < 0)
+			fprintf(stderr, "Device %s: %s\n",
+				device->device_name.str, strerror (errno));
 	}
-
-	/* thanks to the memset at the start, anything that wasn't filled in
-	   has a valid default.  So, unless we have an empty name, add it
-	   to the device list */
-	if (new_device->device_name != NULL)
-		add_device (&g_devices, new_device);
-	else
-		fprintf(stderr, "Device section has no name.\n");
-
-	return 0;
 }
 
-int parse_line (char *line, char **name, char **value)
+int parse_line (char *line, str_view_t *name, str_view_t *value)
 {
+	/* split a line of the form name = value, in place.  A string value
+	   has a NUL written over its closing quote; a number runs to the end
+	   of the line.  The name isn't terminated - see option_is().  Nothing
+	   is changed unless the line is valid. */
 	char *pos, *end_pos;
 
 	/* retrieve the name */
 	pos = strpbrk (line, " \t=");
-	if (pos == NULL) // can't figure out this line - assume its empty?
-		return 0;
-
-	*name = (char *)malloc (pos - line + 1);
-	if (*name == NULL)
+	if (pos == NULL || pos == line)
 		return (-1);
-
-	strncpy (*name, line, pos - line);
-	(*name)[pos - line] = '\0';
+	name->str = line;
+	name->len = pos - line;
 
 	/* Now search for the value */
 	pos = strpbrk (pos, "\"0123456789");
@@ -485,23 +726,24 @@ int parse_line (char *line, char **name, char **value)
 	}
 	else if (*pos == '\"') // a string
 	{
-		end_pos = strpbrk (++pos, "\"");
-		*value = (char *)malloc (end_pos - pos + 1);
-		if (*value == NULL)
-			return (-1);
-
-		strncpy (*value, pos, end_pos - pos);
-		(*value)[end_pos - pos] = '\0';
-	}
-	else if (strchr ("0123456789", *pos) != NULL) // a number
-	{
-		*value = strdup (pos);
-		if (*value == NULL)
-			return (-1);
+		if ((end_pos = strchr (++pos, '\"')) == NULL)
+			return (-1); // not terminated
+		*end_pos = '\0';
 	}
+	else // a number
+		end_pos = pos + strlen (pos);
+
+	value->str = pos;
+	value->len = end_pos - pos;
 	return 0;
 }
 
+int option_is (str_view_t *name, const char *option)
+{
+	return (strlen (option) == name->len &&
+		strncasecmp (name->str, option, name->len) == 0);
+}
+
 int modify_server_conf (char *name, char *value)
 {
 	printf ("%s:\t%s\n", name, value);
@@ -0,0 +1,207 @@
+/* reply_queue.c
+ * -------------
+ *
+ * Unicast replies produced while handling a batch of requests are gathered
+ * here and sent together with a single sendmmsg() once the batch is done.
+ * Every slot has a datagram's worth of buffer from the start, and text
+ * replies are written straight into the next free one (see
+ * reply_queue_begin()), so nothing is allocated once the queue is set up.
+ * A reply that outgrows its slot moves to the queue's message buffer,
+ * which is big enough for the longest reply there can be, and is split
+ * into SERVER FRAGMENTs from there.
+ */
+
+#define _GNU_SOURCE /* for sendmmsg() */
+#include <errno.h>
+#include <string.h>
+
+#include <protocol.h>
+#include <wire.h>
+#include "server.h"
+
+/* where reply_queue_commit() or reply_queue_add_binary() is sending its
+   fragments */
+typedef struct _reply_dest_t
+{
+	reply_queue_t            *queue;
+	const struct sockaddr_in *sa;
+} reply_dest_t;
+
+/* Global variables */
+reply_queue_t g_reply_queue;
+
+/* Local prototypes */
+static void reply_queue_claim (reply_queue_t *queue,
+			       const struct sockaddr_in *sa, size_t len);
+static int  reply_sink        (void *arg, const char *datagram, size_t len);
+
+int reply_queue_init (reply_queue_t *queue, int fd, int size,
+		      size_t message_cap)
+{
+	int i;
+
+	memset (queue, 0, sizeof (reply_queue_t));
+	if (size < 1)
+		size = 1;
+
+	queue->fd   = fd;
+	queue->size = size;
+	queue->msgs  = calloc (size, sizeof (struct mmsghdr));
+	queue->iovs  = calloc (size, sizeof (struct iovec));
+	queue->addrs = calloc (size, sizeof (struct sockaddr_in));
+	queue->bufs  = calloc (size, sizeof (char *));
+	queue->message = malloc (message_cap);
+	queue->message_cap = message_cap;
+	if (queue->msgs == NULL || queue->iovs == NULL ||
+	    queue->addrs == NULL || queue->bufs == NULL ||
+	    queue->message == NULL)
+		return (-1);
+
+	for (i = 0; i < size; i++)
+	{
+		if ((queue->bufs[i] = malloc (MAX_SEND_BUFFER)) == NULL)
+			return (-1);
+	}
+	return 0;
+}
+
+static void reply_queue_claim (reply_queue_t *queue,
+			       const struct sockaddr_in *sa, size_t len)
+{
+	/* the next slot has been filled in - send it with the rest */
+	int slot = queue->count++;
+
+	memcpy (&queue->addrs[slot], sa, sizeof (struct sockaddr_in));
+	queue->iovs[slot].iov_base = queue->bufs[slot];
+	queue->iovs[slot].iov_len  = len;
+}
+
+int reply_queue_add (reply_queue_t *queue, const struct sockaddr_in *sa,
+		     const char *message, size_t len)
+{
+	if (len > MAX_SEND_BUFFER)
+	{
+		errno = EMSGSIZE;
+		return (-1);
+	}
+
+	/* out of room - get rid of what we've got so far */
+	if (queue->count == queue->size)
+	{
+		if (reply_queue_flush (queue) < 0)
+			return (-1);
+	}
+
+	memcpy (queue->bufs[queue->count], message, len);
+	reply_queue_claim (queue, sa, len);
+	return 0;
+}
+
+void reply_queue_begin (reply_queue_t *queue, outbuf_t *out)
+{
+	/* start a text reply in the next free slot.  Nothing else may be
+	   queued until it's been handed to reply_queue_commit(). */
+	if (queue->count == queue->size)
+		reply_queue_flush (queue); /* a failure has been reported */
+
+	outbuf_init (out, queue->bufs[queue->count], MAX_SEND_BUFFER);
+	outbuf_set_spill (out, queue->message, queue->message_cap);
+}
+
+int reply_queue_commit (reply_queue_t *queue, const struct sockaddr_in *sa,
+			outbuf_t *out, char delim)
+{
+	/* queue the reply started by reply_queue_begin().  One that ended
+	   up too big for a datagram goes as SERVER FRAGMENTs split after
+	   delim. */
+	reply_dest_t dest;
+
+	if (out->overflow)
+	{
+		errno = EMSGSIZE;
+		return (-1);
+	}
+	if (!out->spilled)
+	{
+		reply_queue_claim (queue, sa, out->len);
+		return 0;
+	}
+
+	dest.queue = queue;
+	dest.sa    = sa;
+	return fragment_message (SERVER_FRAGMENT, out->data, out->len, delim,
+				 reply_sink, &dest);
+}
+
+int reply_queue_add_binary (reply_queue_t *queue, const struct sockaddr_in *sa,
+			    const char *message, size_t len)
+{
+	/* as reply_queue_commit(), for a binary message */
+	reply_dest_t dest;
+
+	dest.queue = queue;
+	dest.sa    = sa;
+	return fragment_binary (WIRE_SERVER_FRAGMENT, message, len,
+				reply_sink, &dest);
+}
+
+static int reply_sink (void *arg, const char *datagram, size_t len)
+{
+	reply_dest_t *dest = (reply_dest_t *)arg;
+
+	return reply_queue_add (dest->queue, dest->sa, datagram, len);
+}
+
+int reply_queue_flush (reply_queue_t *queue)
+{
+	int i, sent = 0, retval = 0;
+
+	if (queue->count == 0)
+		return 0;
+
+	for (i = 0; i < queue->count; i++)
+	{
+		memset (&queue->msgs[i], 0, sizeof (struct mmsghdr));
+		queue->msgs[i].msg_hdr.msg_name    = &queue->addrs[i];
+		queue->msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+		queue->msgs[i].msg_hdr.msg_iov     = &queue->iovs[i];
+		queue->msgs[i].msg_hdr.msg_iovlen  = 1;
+	}
+
+	while (sent < queue->count)
+	{
+		int n_sent = sendmmsg (queue->fd, queue->msgs + sent,
+				       queue->count - sent, 0);
+		if (n_sent < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			/* shouldn't die horribly just 'cos a client didn't
+			   listen to us.  Either way, this reply is lost -
+			   carry on with the rest. */
+			if (errno != ECONNREFUSED)
+			{
+				perror ("reply_queue_flush()");
+				retval = -1;
+			}
+			sent++;
+			continue;
+		}
+
+		for (i = sent; i < sent + n_sent; i++)
+		{
+			if (queue->msgs[i].msg_len != queue->iovs[i].iov_len)
+			{
+				fprintf (stderr, "reply_queue_flush(): short "
+					 "send to %s\n",
+					 inet_ntoa (queue->addrs[i].sin_addr));
+				errno  = EMSGSIZE;
+				retval = -1;
+			}
+		}
+		sent += n_sent;
+	}
+
+	queue->count = 0;
+	return retval;
+}
@@ -0,0 +1,227 @@
+/* request.c
+ * ---------
+ *
+ * Works out what a datagram from a client or the peer is asking for, in
+ * one pass over it, whichever encoding it arrived in.  Text requests are
+ * told apart by the one character that differs between their verbs, and
+ * then checked against the whole verb once; binary ones carry their type
+ * in the header.  Either way the device, if there is one, is left where it
+ * is in the datagram and handed on as a view.  It always comes last, so
+ * the view ends where the datagram does; LOG's line count goes before it.
+ *
+ * Anything that can't be a valid request - too long for the receive
+ * buffer, or with something after (or missing from) a binary request's
+ * fields - is turned away here, so the handlers never have to check.  A
+ * text request ends at its first NUL, if it has one: the text peer pads
+ * its notifications out to MAX_SEND_BUFFER with them.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include <protocol.h>
+#include <wire.h>
+#include "server.h"
+
+#define LITERAL_LEN(str) (sizeof (str) - 1)
+
+/* a request verb, in its text form */
+typedef struct _request_verb_t
+{
+	wire_type_t  type;
+	const char  *text;
+	size_t       len;
+	int          has_device;
+} request_verb_t;
+
+#define VERB(type, text, has_device) \
+	{ type, text, LITERAL_LEN (text), has_device }
+
+static const request_verb_t s_verbs[] =
+{
+	VERB (WIRE_NOTIFY_ISUP,          NOTIFY_ISUP,          TRUE),
+	VERB (WIRE_NOTIFY_ISDOWN,        NOTIFY_ISDOWN,        TRUE),
+	VERB (WIRE_CLIENT_PING,          CLIENT_PING,          FALSE),
+	VERB (WIRE_CLIENT_DEVICES,       CLIENT_DEVICES,       FALSE),
+	VERB (WIRE_CLIENT_UP,            CLIENT_UP,            TRUE),
+	VERB (WIRE_CLIENT_DOWN,          CLIENT_DOWN,          TRUE),
+	VERB (WIRE_CLIENT_FORCE_DOWN,    CLIENT_FORCE_DOWN,    TRUE),
+	VERB (WIRE_CLIENT_STATUS,        CLIENT_STATUS,        TRUE),
+	VERB (WIRE_CLIENT_CLIENT_STATUS, CLIENT_CLIENT_STATUS, FALSE),
+	VERB (WIRE_CLIENT_SNAPSHOT,      CLIENT_SNAPSHOT,      FALSE),
+	VERB (WIRE_CLIENT_LOG,           CLIENT_LOG,           TRUE)
+};
+
+/* positions in s_verbs */
+enum
+{
+	VERB_ISUP, VERB_ISDOWN, VERB_PING, VERB_DEVICES, VERB_UP, VERB_DOWN,
+	VERB_FORCE_DOWN, VERB_STATUS, VERB_CLIENT_STATUS, VERB_SNAPSHOT,
+	VERB_LOG
+};
+
+/* Local prototypes */
+static const request_verb_t *classify_text (const char *data, size_t len);
+static const request_verb_t *verb_by_type  (int type);
+static void parse_log_lines (request_t *request);
+
+static const request_verb_t *classify_text (const char *data, size_t len)
+{
+	/* the verb data could be, going by the character after the prefix
+	   ("NOTIFY IS<U|D>", "CLIENT <P|D|U|F|S|C|L>") - or NULL.  The caller
+	   still has to check the rest of it. */
+	const char *verb;
+
+	if (len >= LITERAL_LEN (CLIENT_PREFIX) + 2 &&
+	    memcmp (data, CLIENT_PREFIX, LITERAL_LEN (CLIENT_PREFIX)) == 0)
+	{
+		verb = data + LITERAL_LEN (CLIENT_PREFIX);
+		switch (verb[0])
+		{
+		case 'P':
+			return &s_verbs[VERB_PING];
+		case 'D': /* DEVICES, DOWN */
+			return &s_verbs[verb[1] == 'E' ? VERB_DEVICES
+					: VERB_DOWN];
+		case 'U':
+			return &s_verbs[VERB_UP];
+		case 'F':
+			return &s_verbs[VERB_FORCE_DOWN];
+		case 'S': /* STATUS, SNAPSHOT */
+			return &s_verbs[verb[1] == 'T' ? VERB_STATUS
+					: VERB_SNAPSHOT];
+		case 'C':
+			return &s_verbs[VERB_CLIENT_STATUS];
+		case 'L':
+			return &s_verbs[VERB_LOG];
+		}
+	}
+	else if (len >= LITERAL_LEN (NOTIFY_PREFIX) + 3 &&
+		 memcmp (data, NOTIFY_PREFIX, LITERAL_LEN (NOTIFY_PREFIX)) == 0)
+	{
+		verb = data + LITERAL_LEN (NOTIFY_PREFIX);
+		switch (verb[2]) /* IS<U|D> */
+		{
+		case 'U':
+			return &s_verbs[VERB_ISUP];
+		case 'D':
+			return &s_verbs[VERB_ISDOWN];
+		}
+	}
+	return NULL;
+}
+
+static const request_verb_t *verb_by_type (int type)
+{
+	switch (type)
+	{
+	case WIRE_NOTIFY_ISUP:          return &s_verbs[VERB_ISUP];
+	case WIRE_NOTIFY_ISDOWN:        return &s_verbs[VERB_ISDOWN];
+	case WIRE_CLIENT_PING:          return &s_verbs[VERB_PING];
+	case WIRE_CLIENT_DEVICES:       return &s_verbs[VERB_DEVICES];
+	case WIRE_CLIENT_UP:            return &s_verbs[VERB_UP];
+	case WIRE_CLIENT_DOWN:          return &s_verbs[VERB_DOWN];
+	case WIRE_CLIENT_FORCE_DOWN:    return &s_verbs[VERB_FORCE_DOWN];
+	case WIRE_CLIENT_STATUS:        return &s_verbs[VERB_STATUS];
+	case WIRE_CLIENT_CLIENT_STATUS: return &s_verbs[VERB_CLIENT_STATUS];
+	case WIRE_CLIENT_SNAPSHOT:      return &s_verbs[VERB_SNAPSHOT];
+	case WIRE_CLIENT_LOG:           return &s_verbs[VERB_LOG];
+	}
+	return NULL;
+}
+
+static void parse_log_lines (request_t *request)
+{
+	/* a text LOG may start with the number of lines wanted and a space,
+	   which come off the front of the device */
+	const char *pos = request->device.str;
+	unsigned long lines = 0;
+
+	while (*pos >= '0' && *pos <= '9')
+		lines = lines * 10 + (*pos++ - '0');
+	if (pos == request->device.str || *pos != ' ')
+		return; /* it's all device */
+
+	request->lines = lines;
+	request->device.len -= pos + 1 - request->device.str;
+	request->device.str = pos + 1;
+}
+
+int parse_request (const char *data, size_t len, request_t *request)
+{
+	/* data is a datagram of len bytes from a recv_ring_t, which puts a
+	   NUL after each one.  Fills in request, or returns -1 with errno
+	   set: EMSGSIZE if it was too big to receive whole, EINVAL if it
+	   isn't a well-formed request, ENOTSUP if it's one we don't know. */
+	const request_verb_t *verb;
+
+	memset (request, 0, sizeof (request_t));
+	if (len > MAX_RECV_BUFFER)
+	{
+		errno = EMSGSIZE;
+		return (-1);
+	}
+
+	if (wire_is_binary (data, len))
+	{
+		wire_reader_t reader;
+
+		if ((verb = verb_by_type (wire_open (&reader, data, len)))
+		    == NULL)
+		{
+			errno = ENOTSUP;
+			return (-1);
+		}
+		if (verb->type == WIRE_CLIENT_LOG)
+			request->lines = wire_get_varint (&reader);
+		if (verb->has_device)
+			request->device.str = wire_get_string (
+				&reader, &request->device.len);
+
+		/* the device (if any) has to run right to the end, which
+		   is what makes it NUL terminated */
+		if (reader.error || reader.pos != reader.end ||
+		    (request->device.len != 0 &&
+		     memchr (request->device.str, '\0',
+			     request->device.len) != NULL))
+		{
+			errno = EINVAL;
+			return (-1);
+		}
+		request->binary = TRUE;
+	}
+	else
+	{
+		len = strnlen (data, len);
+		if ((verb = classify_text (data, len)) == NULL ||
+		    len < verb->len || memcmp (data, verb->text, verb->len) != 0)
+		{
+			errno = ENOTSUP;
+			return (-1);
+		}
+		if (verb->has_device)
+		{
+			request->device.str = data + verb->len;
+			request->device.len = len - verb->len;
+		}
+		if (verb->type == WIRE_CLIENT_LOG)
+			parse_log_lines (request);
+	}
+
+	request->type = verb->type;
+	return 0;
+}
+
+const char *request_name (request_t *request)
+{
+	/* the text form of the request's verb, for messages */
+	const request_verb_t *verb = verb_by_type (request->type);
+
+	return verb ? verb->text : "?";
+}
+
+int request_from_peer (request_t *request)
+{
+	return (request->type == WIRE_NOTIFY_ISUP ||
+		request->type == WIRE_NOTIFY_ISDOWN);
+}
@@ -10,8 +10,59 @@
 
 #include <cliserv.h>
 #include <protocol.h>
+#include <wire.h>
 #include "server.h"
 
+/* File-level variables */
+static wire_buf_t s_wire_buf; /* binary replies, kept between them */
+
+/* Local prototypes */
+static int send_binary        (client_t *client, wire_buf_t *buf);
+
+static int send_binary (client_t *client, wire_buf_t *buf)
+{
+	/* queue up a binary reply built by one of the functions below */
+	if (buf->error)
+	{
+		errno = ENOMEM;
+		return (-1);
+	}
+	return reply_queue_add_binary (&g_reply_queue, &client->sa,
+				       (char *)buf->data, buf->len);
+}
+
+size_t reply_max_len (void)
+{
+	/* the longest text reply any of the functions below can produce,
+	   once the devices are known: the largest of a full device list, a
+	   client connected to everything and a full log, or a single
+	   status */
+	device_list_t *list_pos;
+	size_t devices_len = strlen (SERVER_DEVICES);
+	size_t client_len = strlen (SERVER_CLIENT_STATUS);
+	size_t max_len = MAX_SEND_BUFFER;
+
+	for (list_pos = g_devices; list_pos; list_pos = list_pos->next)
+	{
+		devices_len += list_pos->data->device_name.len +
+			list_pos->data->device_description.len + 2;
+		client_len += list_pos->data->device_name.len + 1;
+		if (list_pos->data->device_name.len + MAX_SEND_BUFFER > max_len)
+			max_len = list_pos->data->device_name.len
+				+ MAX_SEND_BUFFER;
+		if (strlen (SERVER_LOG) + list_pos->data->device_name.len + 1
+		    + g_command_log > max_len)
+			max_len = strlen (SERVER_LOG)
+				+ list_pos->data->device_name.len + 1
+				+ g_command_log;
+	}
+	if (devices_len > max_len)
+		max_len = devices_len;
+	if (client_len > max_len)
+		max_len = client_len;
+	return max_len;
+}
+
 int send_device_list   (client_t *client)
 {
 	/* send a list of devices back to the client, in the form:
@@ -27,114 +78,85 @@ int send_device_list   (client_t *client)
 
 	*/
 
-	/* first construct the string to send */
-	device_list_t *list_pos = g_devices;
-	char *dev_str = (char *)malloc (strlen (SERVER_DEVICES) + 1);
-	if (dev_str == NULL)
-		return (-1);
-	strcpy (dev_str, SERVER_DEVICES);
+	/* write it straight into the reply queue */
+	device_list_t *list_pos;
+	outbuf_t out;
 
-	while(list_pos)
-	{
-		size_t new_len = strlen (list_pos->data->device_name) +
-			strlen (list_pos->data->device_description) +
-			strlen (dev_str) + 4;
-		dev_str = realloc (dev_str, new_len);
-		if (dev_str == NULL)
-			return (-1);
-		strcat (dev_str, list_pos->data->device_name);
-		strcat (dev_str, "\t");
-		strcat (dev_str, list_pos->data->device_description);
-		strcat (dev_str, "\n");
-		list_pos = list_pos->next;
-	}
-	
-	/* now send the data */
-	if (sendto (g_socket_fd, dev_str, strlen (dev_str), 0,
-		    (struct sockaddr *) &client->sa, sizeof (client->sa))
-	    != strlen (dev_str))
+	if (client->binary)
 	{
-		/* shouldn't die horribly just 'cos client didn't
-		   listen to us */
-		if (errno != ECONNREFUSED)
+		int n_devices = 0;
+
+		for (list_pos = g_devices; list_pos; list_pos = list_pos->next)
+			n_devices++;
+		wire_begin (&s_wire_buf, WIRE_SERVER_DEVICES);
+		wire_put_varint (&s_wire_buf, n_devices);
+		for (list_pos = g_devices; list_pos; list_pos = list_pos->next)
 		{
-			perror ("send_device_list()");
-			return (-1);
+			wire_put_string (&s_wire_buf,
+					 list_pos->data->device_name.str);
+			wire_put_string (&s_wire_buf,
+					 list_pos->data->device_description.str);
 		}
+		return send_binary (client, &s_wire_buf);
 	}
-	return 0;
+
+	reply_queue_begin (&g_reply_queue, &out);
+	outbuf_put_str (&out, SERVER_DEVICES);
+	for (list_pos = g_devices; list_pos; list_pos = list_pos->next)
+	{
+		device_t *device = list_pos->data;
+
+		outbuf_put_bytes (&out, device->device_name.str,
+				  device->device_name.len);
+		outbuf_put_char (&out, '\t');
+		outbuf_put_bytes (&out, device->device_description.str,
+				  device->device_description.len);
+		outbuf_put_char (&out, '\n');
+	}
+	
+	/* it goes out with the rest of this batch's replies */
+	return reply_queue_commit (&g_reply_queue, &client->sa, &out, '\n');
 }
 
 int send_device_status (client_t *client, device_t *device)
 {
 	/* create a status message for the current device and
 	   send it directly to the client */
+	outbuf_t out;
 
-	char *dev_stat;
-	int max_str_len = strlen (SERVER_STATUS_PREFIX) +
-		strlen (SERVER_STATUS_DISCONNECTING) +
-		strlen (device->device_name) + 4; /* this should be the longest
-						     possible string length */
-	char *dev_str = (char *)malloc (max_str_len);
-	if (dev_str == NULL)
-		return (-1);
-	
-	dev_stat = print_device_status (device);
-	if (dev_stat == NULL)
-		return (-1);
-	strcpy (dev_str, SERVER_STATUS_PREFIX);
-	strcat (dev_str, dev_stat);
-	free (dev_stat);
-
-	/* now send the data */
-	if (sendto (g_socket_fd, dev_str, strlen (dev_str), 0,
-		    (struct sockaddr *) &client->sa, sizeof (client->sa))
-	    != strlen (dev_str))
+	if (client->binary)
 	{
-		/* shouldn't die horribly just 'cos client didn't
-		   listen to us */
-		if (errno != ECONNREFUSED)
-		{
-			perror ("send_device_list()");
-			return (-1);
-		}
+		wire_begin (&s_wire_buf, WIRE_SERVER_STATUS);
+		wire_put_status (&s_wire_buf, device->device_name.str,
+				 DEVICE_STATUS (device),
+				 time (NULL) - DEVICE_CONNECT_TIME (device),
+				 DEVICE_USERS (device));
+		return send_binary (client, &s_wire_buf);
 	}
-	return 0;
+
+	reply_queue_begin (&g_reply_queue, &out);
+	outbuf_put_str (&out, SERVER_STATUS_PREFIX);
+	put_device_status (&out, device);
+
+	/* it goes out with the rest of this batch's replies */
+	return reply_queue_commit (&g_reply_queue, &client->sa, &out, '\n');
 }
 
-char *print_device_status (device_t *device)
+void put_device_status (outbuf_t *out, device_t *device)
 {
-	int max_str_len = strlen (device->device_name) +
-		strlen (g_link_status_message[device->status]) + 2;
-	char *dev_str = (char *)malloc (max_str_len);
-	if (dev_str == NULL)
-		return NULL;
-	strcpy (dev_str, device->device_name);
-	strcat (dev_str, g_link_status_message[device->status]);
-
-	if (device->status == LINK_UP)
+	/* <device>\t<status>, with the uptime and number of users if the
+	   link is up */
+	outbuf_put_bytes (out, device->device_name.str,
+			  device->device_name.len);
+	outbuf_put_str (out, g_link_status_message[DEVICE_STATUS (device)]);
+
+	if (DEVICE_STATUS (device) == LINK_UP)
 	{
-		/* append the uptime and number of users */
-		client_list_t *list_pos = device->clients_connected;
-		int no_users = 0;
-		char params[20]; /* combination of time and no_users cannot
-				    exceed 18 digits - should be OK */
-		while(list_pos)
-		{
-			no_users++;
-			list_pos = list_pos->next;
-		}
-		sprintf (params, "%d %d",
-			 (int)(time (NULL) - device->connect_time),
-			 no_users);
-		dev_str = realloc (dev_str, strlen (dev_str) +
-				   strlen(params) + 1);
-		if (dev_str == NULL)
-			return NULL;
-		strcat (dev_str, params);
+		outbuf_put_int (out,
+				(int)(time (NULL) - DEVICE_CONNECT_TIME (device)));
+		outbuf_put_char (out, ' ');
+		outbuf_put_int (out, DEVICE_USERS (device));
 	}
-	
-	return dev_str;
 }
 
 int send_client_status (client_t *client)
@@ -146,47 +168,70 @@ int send_client_status (client_t *client)
 
 	*/
 
-	/* first construct the string to send */
-	device_list_t *list_pos = client->devices_connected;
-	char *dev_str = (char *)malloc (strlen (SERVER_CLIENT_STATUS) + 1);
-	if (dev_str == NULL)
-		return (-1);
-	strcpy (dev_str, SERVER_CLIENT_STATUS);
-	if (list_pos)
+	/* write it straight into the reply queue */
+	int index, first = TRUE;
+	outbuf_t out;
+
+	if (client->binary)
 	{
-		dev_str = realloc (dev_str, strlen (dev_str) +
-				   strlen (list_pos->data->device_name) + 1);
-		if (dev_str == NULL)
-			return (-1);
-		strcat (dev_str, list_pos->data->device_name);
-		list_pos = list_pos->next;
+		wire_begin (&s_wire_buf, WIRE_SERVER_CLIENT_STATUS);
+		wire_put_varint (&s_wire_buf, client->n_devices);
+		for (index = next_client_device (client, 0); index >= 0;
+		     index = next_client_device (client, index + 1))
+			wire_put_string (&s_wire_buf,
+					 device_by_index (index)->device_name.str);
+		return send_binary (client, &s_wire_buf);
 	}
 
-	while(list_pos)
+	reply_queue_begin (&g_reply_queue, &out);
+	outbuf_put_str (&out, SERVER_CLIENT_STATUS);
+	for (index = next_client_device (client, 0); index >= 0;
+	     index = next_client_device (client, index + 1))
 	{
-		size_t new_len = strlen (list_pos->data->device_name) +
-			strlen (dev_str) + 3;
-		dev_str = realloc (dev_str, new_len);
-		if (dev_str == NULL)
-			return (-1);
-		strcat (dev_str, "\t");
-		strcat (dev_str, list_pos->data->device_name);
-
-		list_pos = list_pos->next;
+		device_t *device = device_by_index (index);
+
+		if (!first)
+			outbuf_put_char (&out, '\t');
+		first = FALSE;
+		outbuf_put_bytes (&out, device->device_name.str,
+				  device->device_name.len);
 	}
 	
-	/* now send the data */
-	if (sendto (g_socket_fd, dev_str, strlen (dev_str), 0,
-		    (struct sockaddr *) &client->sa, sizeof (client->sa))
-	    != strlen (dev_str))
+	/* it goes out with the rest of this batch's replies */
+	return reply_queue_commit (&g_reply_queue, &client->sa, &out, '\t');
+}
+
+int send_device_log (client_t *client, device_t *device, unsigned long lines)
+{
+	/* the last lines lines of output from the device's link commands, in
+	   the form:
+
+	   <device>\n<output>
+
+	*/
+	const char *part[2];
+	size_t part_len[2], len;
+	outbuf_t out;
+
+	len = device_log_tail (device, lines, part, part_len);
+	if (client->binary)
 	{
-		/* shouldn't die horribly just 'cos client didn't
-		   listen to us */
-		if (errno != ECONNREFUSED)
-		{
-			perror ("send_device_list()");
-			return (-1);
-		}
+		wire_begin (&s_wire_buf, WIRE_SERVER_LOG);
+		wire_put_string (&s_wire_buf, device->device_name.str);
+		wire_put_varint (&s_wire_buf, len);
+		wire_put_bytes (&s_wire_buf, part[0], part_len[0]);
+		wire_put_bytes (&s_wire_buf, part[1], part_len[1]);
+		return send_binary (client, &s_wire_buf);
 	}
-	return 0;
+
+	reply_queue_begin (&g_reply_queue, &out);
+	outbuf_put_str (&out, SERVER_LOG);
+	outbuf_put_bytes (&out, device->device_name.str,
+			  device->device_name.len);
+	outbuf_put_char (&out, '\n');
+	outbuf_put_bytes (&out, part[0], part_len[0]);
+	outbuf_put_bytes (&out, part[1], part_len[1]);
+
+	/* it goes out with the rest of this batch's replies */
+	return reply_queue_commit (&g_reply_queue, &client->sa, &out, '\n');
 }
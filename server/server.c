@@ -11,22 +11,27 @@
  * packets, representing its current status
  */
 
+#define _GNU_SOURCE /* for recvmmsg() */
 #include <cliserv.h>
 #include <protocol.h>
+#include <wire.h>
 #include "server.h"
 
 #include <signal.h>
-#include <sys/time.h>
 #include <errno.h>
 #include <string.h>
 
 /* Function prototypes */
-void termination_handler (int signum); /* clean up before terminating */
-int process_command ( void );
-int poll_clients ( void );
+int  process_command ( void );
+int  handle_request (int fd, void *arg);
+int  handle_wheel_tick (int fd, void *arg);
+int  handle_signal (int signum, void *arg); /* clean up before terminating */
+int  handle_report_signal (int signum, void *arg);
+void publish_state (void);
+void dump_state (void);
 
 /* File-level variables */
-static sig_atomic_t g_keep_going = 1; /* controls when the main loop dies */
+static recv_ring_t s_recv_ring;
 
 /* Global variables */
 int         g_socket_fd;
@@ -41,6 +46,10 @@ const char *g_link_status_message[] =
 int main (int argc, char *argv[])
 {
 	struct sockaddr_in serv;
+	int on = 1;
+	int term_signals[] = { SIGTERM, SIGINT };
+	int report_signals[] = { SIGUSR1 };
+	int wheel_timer;
 
 	/* do initial configuration */
 	if (parse_command_line(argc, argv) < 0)
@@ -54,6 +63,8 @@ int main (int argc, char *argv[])
 		perror ("read_config()");
 		exit (EXIT_FAILURE);
 	}
+	/* any device whose driver is missing still has its commands */
+	link_drivers_init ();
 
 	if (g_fork)
 	{
@@ -80,11 +91,32 @@ int main (int argc, char *argv[])
 		}
 	}
 
-	/* Setup signal handler to cleanup on termination */
-	if (signal (SIGTERM, termination_handler) == SIG_IGN)
-		signal (SIGTERM, SIG_IGN);
-	if (signal (SIGINT, termination_handler) == SIG_IGN)
-		signal (SIGINT, SIG_IGN);
+	if (event_init () < 0)
+	{
+		perror ("event_init()");
+		exit (EXIT_FAILURE);
+	}
+
+	/* SIGTERM and SIGINT arrive through the event loop so that we can
+	   clean up before terminating */
+	if (event_signal_new (term_signals, 2, handle_signal, NULL) < 0)
+	{
+		perror ("event_signal_new()");
+		exit (EXIT_FAILURE);
+	}
+	/* SIGUSR1 asks how much memory the pools are holding, and how the
+	   link commands are getting on */
+	if (event_signal_new (report_signals, 1, handle_report_signal, NULL) < 0)
+	{
+		perror ("event_signal_new()");
+		exit (EXIT_FAILURE);
+	}
+	/* and SIGCHLD, for the link commands, before the workers start */
+	if (link_exec_init () < 0)
+	{
+		perror ("link_exec_init()");
+		exit (EXIT_FAILURE);
+	}
 	signal (SIGHUP, SIG_IGN); /* Somebody thinks we have logs to rotate? */
 
 	/* open a socket for the server and bind it to the server's
@@ -102,82 +134,88 @@ int main (int argc, char *argv[])
 	else
 		serv.sin_addr.s_addr = INADDR_ANY;
 
+	/* with several workers, each one has a socket on the same port */
+	if (g_workers > 1 &&
+	    setsockopt (g_socket_fd, SOL_SOCKET, SO_REUSEPORT,
+			&on, sizeof (on)) < 0)
+	{
+		perror("setsockopt()");
+		exit(EXIT_FAILURE);
+	}
+
 	if (bind (g_socket_fd, (struct sockaddr *) &serv, sizeof (serv)) < 0)
 	{
 		perror("bind()");
 		exit(EXIT_FAILURE);
 	}
 
+	if (recv_ring_init (&s_recv_ring, g_socket_fd, g_recv_batch) < 0)
+	{
+		perror ("recv_ring_init()");
+		exit (EXIT_FAILURE);
+	}
+
+	if (reply_queue_init (&g_reply_queue, g_socket_fd, g_recv_batch,
+			      reply_max_len ()) < 0)
+	{
+		perror ("reply_queue_init()");
+		exit (EXIT_FAILURE);
+	}
+
+	if (multicast_init () < 0)
+	{
+		perror ("multicast_init()");
+		exit (EXIT_FAILURE);
+	}
+
+	if (broadcast_status_init () < 0)
+	{
+		perror ("broadcast_status_init()");
+		exit (EXIT_FAILURE);
+	}
+
 	if (broadcast_init_message () < 0)
 	{
 		perror ("broadcast_init_message()");
 	}
 
-	/* Now for the main program loop */
-	while (g_keep_going)
-	{
-		struct timeval timeout;
-		fd_set read_fds;
-		int select_res;
-
-		FD_ZERO (&read_fds);
-		FD_SET (g_socket_fd, &read_fds);
-		/* wait for the length specified by g_poll_time */
-		timeout.tv_sec  = g_poll_time;
-		timeout.tv_usec = 0;
-		select_res = select (g_socket_fd + 1, &read_fds, NULL,
-				     NULL, &timeout);
-		if (select_res < 0)
-		{
-			if (errno == EINTR) /* ctrl-c at the console? */
-			{
-				g_keep_going = FALSE;
-			}
-			else
-			{
-				perror ("select()");
-				exit (EXIT_FAILURE);
-			}
-		}
-		else if (select_res > 0)
-		{
-			/* the only possible return before timeout
-			   is that there is something on my socket */
-			if ( process_command () < 0)
-			{
-				perror ("process_command ()");
-				// exit (EXIT_FAILURE);
-			}
-		}
-
-		/* regularly notify clients of a status change */
-		if ( broadcast_status_message () < 0)
-		{
-			perror ("broadcast_status_message ()");
-			// exit (EXIT_FAILURE);
-		}
+	/* Requests, the regular status broadcast and the timing wheel are
+	   separate events, so none of them waits on (or triggers) another */
+	if (event_add (g_socket_fd, handle_request, NULL) < 0)
+	{
+		perror ("event_add()");
+		exit (EXIT_FAILURE);
+	}
 
-		if (timeout_old_clients () < 0)
-		{
-			perror ("timeout_old_clients ()");
-			// exit (EXIT_FAILURE);
-		}
+	if (broadcast_schedule_init () < 0)
+	{
+		perror ("broadcast_schedule_init()");
+		exit (EXIT_FAILURE);
+	}
+	wheel_init (time (NULL));
+	if ((wheel_timer = event_timer_new (handle_wheel_tick, NULL)) < 0
+	    || event_timer_set (wheel_timer, 1000, 1000) < 0)
+	{
+		perror ("event_timer_new()");
+		exit (EXIT_FAILURE);
+	}
 
-		if (timeout_old_devices () < 0)
-		{
-			perror ("timeout_old_devices ()");
-			// exit (EXIT_FAILURE);
-		}
+	if (workers_start () < 0)
+	{
+		perror ("workers_start()");
+		exit (EXIT_FAILURE);
+	}
+	/* workers see any change once the batch that made it is done */
+	event_set_batch_hook (publish_state);
 
-		if (g_debug)
-		{
-			printf ("---------------------------------------\n");
-			dump_device_list (g_devices);
-			dump_client_list (g_clients);
-			printf ("---------------------------------------\n\n");
-		}
+	/* Now for the main program loop */
+	if (event_loop () < 0)
+	{
+		perror ("event_loop()");
 	}
 
+	workers_stop ();
+
 	/* finished */
 	if (broadcast_quit_message () < 0)
 	{
@@ -190,53 +228,185 @@ int main (int argc, char *argv[])
 	return 0;
 }
 
-void termination_handler (int signum)
+int handle_request (int fd, void *arg)
+{
+	if (process_command () < 0)
+	{
+		perror ("process_command ()");
+		// exit (EXIT_FAILURE);
+	}
+
+	if (g_debug)
+		dump_state ();
+	return 0;
+}
+
+int handle_wheel_tick (int fd, void *arg)
+{
+	/* take in the clients the workers have heard from, time out
+	   whichever clients and devices are due this second, see how the
+	   drivers' links are getting on, and give back any memory the
+	   clients that went had between them */
+	workers_touch_clients ();
+	wheel_advance (time (NULL));
+	link_drivers_poll ();
+	trim_pools ();
+
+	if (g_debug)
+		dump_state ();
+	return 0;
+}
+
+int handle_signal (int signum, void *arg)
+{
+	/* Tell the main loop to give up once it's done with this batch */
+	if (g_debug)
+		fprintf (stderr, "Caught signal %d\n", signum);
+	event_stop ();
+	return 0;
+}
+
+int handle_report_signal (int signum, void *arg)
+{
+	report_pools (stdout);
+	link_exec_report (stdout);
+	workers_report (stdout);
+	fflush (stdout);
+	return 0;
+}
+
+void publish_state (void)
+{
+	if (snapshot_publish () < 0)
+		perror ("snapshot_publish()");
+	/* the multicast clients hear about changes at the same point */
+	if (broadcast_changes () < 0)
+		perror ("broadcast_changes()");
+}
+
+void dump_state (void)
+{
+	printf ("---------------------------------------\n");
+	dump_device_list (g_devices);
+	dump_client_list (&g_clients);
+	report_pools (stdout);
+	printf ("---------------------------------------\n\n");
+}
+
+int recv_ring_init (recv_ring_t *ring, int fd, int size)
+{
+	/* preallocate everything recvmmsg() needs for a full batch, so that
+	   draining the socket never touches the heap */
+	int i;
+
+	memset (ring, 0, sizeof (recv_ring_t));
+	if (size < 1)
+		size = 1;
+
+	ring->fd    = fd;
+	ring->size  = size;
+	ring->bufs  = malloc (size * sizeof (*ring->bufs));
+	ring->msgs  = malloc (size * sizeof (struct mmsghdr));
+	ring->iovs  = malloc (size * sizeof (struct iovec));
+	ring->addrs = malloc (size * sizeof (struct sockaddr_in));
+	if (ring->bufs == NULL || ring->msgs == NULL ||
+	    ring->iovs == NULL || ring->addrs == NULL)
+		return (-1);
+
+	for (i = 0; i < size; i++)
+	{
+		ring->iovs[i].iov_base = ring->bufs[i];
+		ring->iovs[i].iov_len  = MAX_RECV_BUFFER;
+	}
+	return 0;
+}
+
+int recv_ring_fill (recv_ring_t *ring, int flags)
 {
-	/* Tell the main loop to give up next time round */
-	g_keep_going = 0;
+	/* read up to a full ring of datagrams.  Returns the number read, each
+	   of them turned into a real string, or -1 on error.  A datagram too
+	   big for its buffer is cut short, and its msg_len set one past
+	   MAX_RECV_BUFFER so that parse_request() turns it away. */
+	int i, n_msgs;
+
+	for (i = 0; i < ring->size; i++)
+	{
+		memset (&ring->msgs[i].msg_hdr, 0, sizeof (struct msghdr));
+		ring->msgs[i].msg_hdr.msg_name    = &ring->addrs[i];
+		ring->msgs[i].msg_hdr.msg_namelen = sizeof (struct sockaddr_in);
+		ring->msgs[i].msg_hdr.msg_iov     = &ring->iovs[i];
+		ring->msgs[i].msg_hdr.msg_iovlen  = 1;
+	}
 
-	/* register the signal handler again */
-	signal (signum, termination_handler);
+	if ((n_msgs = recvmmsg (ring->fd, ring->msgs, ring->size,
+				flags, NULL)) < 0)
+		return (-1);
+
+	for (i = 0; i < n_msgs; i++)
+	{
+		ring->bufs[i][ring->msgs[i].msg_len] = 0;
+		if (ring->msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+			ring->msgs[i].msg_len = MAX_RECV_BUFFER + 1;
+	}
+	return n_msgs;
 }
 
 int process_command ( void )
 {
-	struct sockaddr_in cli;
-	int recv_size, clilen = sizeof (cli);
-	char recv_buffer[MAX_RECV_BUFFER];
+	/* drain up to g_recv_batch datagrams in one go and handle every one
+	   of them before returning to the event loop */
+	int i, n_msgs;
 
-	if ((recv_size = recvfrom (g_socket_fd, recv_buffer,
-				   MAX_RECV_BUFFER, 0,
-				   (struct sockaddr *) &cli,
-				   &clilen)) < 0)
+	if ((n_msgs = recv_ring_fill (&s_recv_ring, MSG_DONTWAIT)) < 0)
 	{
-		perror("recvfrom()");
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0; /* somebody else got there first */
+		perror("recvmmsg()");
 		return (-1);
 	}
-	recv_buffer[recv_size] = 0; /* turn it into a real string */
 
-	/* Find out where the message came from */
-	if (strncmp (recv_buffer, CLIENT_PREFIX, strlen (CLIENT_PREFIX)) == 0)
+	for (i = 0; i < n_msgs; i++)
+	{
+		if (process_datagram (s_recv_ring.addrs[i],
+				      s_recv_ring.bufs[i],
+				      s_recv_ring.msgs[i].msg_len) < 0)
+		{
+			perror ("process_datagram()");
+		}
+	}
+
+	/* all the replies for this batch go out together */
+	return reply_queue_flush (&g_reply_queue);
+}
+
+int process_datagram (struct sockaddr_in cli, char *recv_buffer, size_t len)
+{
+	request_t request;
+
+	if (parse_request (recv_buffer, len, &request) < 0)
 	{
 		if (g_debug)
-			fprintf (stderr, "Received message from Client: %s\n",
+			fprintf (stderr, "Received invalid message: %s\n",
 				 recv_buffer);
-		return process_client (cli, recv_buffer);
+		return (-1);
 	}
-	else if (strncmp (recv_buffer, NOTIFY_PREFIX,
-			  strlen (NOTIFY_PREFIX)) == 0)
+
+	/* Find out where the message came from.  Binary requests get their
+	   replies in binary, but are otherwise just the same. */
+	if (request_from_peer (&request))
 	{
 		if (g_debug)
-			fprintf (stderr, "Received message from Peer: %s\n",
-				 recv_buffer);
-		return process_peer (recv_buffer);
+			fprintf (stderr, "Received message from Peer: %s%s\n",
+				 request_name (&request),
+				 request.device.str ? request.device.str : "");
+		return process_peer (&request);
 	}
 	else
 	{
 		if (g_debug)
-			fprintf (stderr, "Received invalid message: %s\n",
-				 recv_buffer);
-		errno = ENOTSUP; /* couldn't think of anything better */
-		return (-1);
+			fprintf (stderr, "Received message from Client: %s%s\n",
+				 request_name (&request),
+				 request.device.str ? request.device.str : "");
+		return process_client (cli, &request);
 	}
 }
@@ -13,82 +13,288 @@
 #define _LINK_SERVER_H_
 
 #include <time.h>
+#include <sys/uio.h>
 #include <cliserv.h>
+#include <wire.h>
+#include <link_driver.h>
 
 #define DEFAULT_CONFIG_FILE        "/etc/link_server.conf"
 #define DEFAULT_SRV_PORT           9876
 #define DEFAULT_POLL_TIME          5 /* seconds */
 #define DEFAULT_MULTICAST_GROUP    "239.255.42.42" /* site-local admin group */
 #define DEFAULT_MULTICAST_PORT     6789
+#define DEFAULT_MULTICAST_TTL      1  /* stay on the local segments */
+#define DEFAULT_MULTICAST_LOOP     1  /* clients on this host hear too */
 #define DEFAULT_CLIENT_TIMEOUT     (2 * 60 * 20) /* seconds */
 #define DEFAULT_RETRIES            2
 #define DEFAULT_CONNECT_TIMEOUT    60 /* seconds */
 #define DEFAULT_DISCONNECT_TIMEOUT 60 /* seconds */
+#define DEFAULT_RECV_BATCH         32 /* datagrams per wakeup */
+#define DEFAULT_WORKERS            1  /* threads serving requests */
+#define DEFAULT_LEGACY_STATUS      0  /* send deltas and snapshots */
+#define DEFAULT_SNAPSHOT_TIME      10 /* seconds between snapshots */
+#define DEFAULT_BINARY_BROADCAST   0  /* broadcast in text */
+#define DEFAULT_BROADCAST_DELAY    100 /* ms to gather changes for */
+#define DEFAULT_HEARTBEAT_MAX      30 /* seconds, a quarter of the
+					 clients' default server_timeout */
+#define DEFAULT_LINK_COMMANDS      8  /* link commands running at once */
+#define DEFAULT_COMMAND_LOG        4096 /* bytes of output kept per device */
 
 /* type definitions */
+typedef struct _wheel_timer_t wheel_timer_t;
+typedef void (*wheel_callback_t) (wheel_timer_t *timer, void *arg);
+
+/* a timer on the timing wheel, embedded in whatever it times out */
+struct _wheel_timer_t
+{
+	wheel_timer_t    *next; /* NULL when not scheduled */
+	wheel_timer_t    *prev;
+	time_t            expires;
+	wheel_callback_t  callback;
+	void             *arg;
+};
+
+typedef enum _link_command_t
+{
+	LINK_CMD_UP,
+	LINK_CMD_DOWN,
+	LINK_CMD_FORCE_DOWN
+} link_command_t;
+
+/* a link command, waiting to run or running, see link_exec.c */
+typedef struct _link_job_t link_job_t;
+
+/* The last command_log bytes the device's link commands wrote, as a ring:
+   len bytes of data, starting at start and wrapping round.  See
+   device_log.c */
+typedef struct _device_log_t
+{
+	size_t  start;
+	size_t  len;
+	int     dropped; /* the oldest output has made way for newer */
+	char    data[1]; /* command_log bytes, really */
+} device_log_t;
+
 typedef struct 
 {
+	int                    in_use;  /* this slot of g_clients is taken */
 	struct sockaddr_in     sa;
 	time_t                 last_heard_from; /*used to age the connection */
-	struct _device_list_t *devices_connected;
+	unsigned long         *device_bits; /* by device_index, NULL until
+					       the first UP */
+	int                   *device_pos;  /* where we are in each of those
+					       devices' members */
+	int                    n_devices;   /* how many bits are set */
+	wheel_timer_t          timeout; /* fires g_client_timeout after that */
+	int                    binary;  /* last request was binary, so reply
+					   in kind */
 } client_t;
 
-typedef struct _client_list_t
+/* The known clients, stored inline, see client_table.c */
+typedef struct _client_table_t
 {
-	struct _client_list_t *next;
-	client_t              *data;
-} client_list_t;
+	client_t     *slots;
+	unsigned int  size;  /* a power of two, or 0 before the first client */
+	unsigned int  count;
+} client_table_t;
+
+/* A string in the configuration arena (see read_config.c) or a received
+   datagram (see request.c).  The len bytes at str are followed by a NUL,
+   so str can also be handed straight to anything that wants a C string.
+   str is NULL if it was never set. */
+typedef struct _str_view_t
+{
+	const char *str;
+	size_t      len;
+} str_view_t;
 
 typedef struct _device_t
 {
-	char            *device_name;
-	char            *device_description;
-	char            *link_up_command;
-	char            *link_down_command;
-	char            *link_force_down_command;
-	device_status_t  status;
-	time_t           connect_time;
-	client_list_t   *clients_connected;
-	int              retries;
+	str_view_t       device_name;
+	str_view_t       device_description;
+	str_view_t       link_up_command;
+	str_view_t       link_down_command;
+	str_view_t       link_force_down_command;
+	int              shell;        /* run the commands with sh -c */
+	char           **link_argv[LINK_CMD_FORCE_DOWN + 1]; /* the commands,
+					  split up, or NULL for none */
+	str_view_t       driver;       /* unset: run the commands above */
+	str_view_t       driver_arg;
+	const link_driver_t *link_driver; /* driver, once found */
+	client_t       **members;      /* the clients connected, unordered */
+	int              members_size;
+	int              device_index; /* position in g_devices, and in
+					  g_device_state */
+	unsigned int     name_hash;    /* device_name_hash (device_name) */
+	struct _device_t *hash_next;   /* next in this find_device() bucket */
+	int              followup_timer; /* timerfd, -1 until needed */
+	link_command_t   followup_command;
+	link_job_t      *queued_job;     /* an up or down waiting to run */
+	int              force_down_queued; /* a force_down is waiting */
+	device_log_t    *log;          /* NULL until a command writes */
+	wheel_timer_t    timeout; /* connect/disconnect deadline */
 } device_t;
 
+/* The parts of the devices that change as the server runs, one array per
+   field, indexed by device_index.  Anything that goes over every device -
+   a status broadcast, a snapshot for the workers - reads only these, and
+   leaves the names and command lines in device_t alone.  See list_fns.c */
+typedef struct _device_state_t
+{
+	int              size;         /* room for this many devices */
+	device_status_t *status;
+	time_t          *connect_time; /* when the status last changed */
+	int             *retries;      /* left before the link is given up */
+	int             *n_users;      /* length of the device's members */
+} device_state_t;
+
+#define DEVICE_STATUS(device) \
+	(g_device_state.status[(device)->device_index])
+#define DEVICE_CONNECT_TIME(device) \
+	(g_device_state.connect_time[(device)->device_index])
+#define DEVICE_RETRIES(device) \
+	(g_device_state.retries[(device)->device_index])
+#define DEVICE_USERS(device) \
+	(g_device_state.n_users[(device)->device_index])
+
+/* A batch worth of datagrams read with one recvmmsg(), see server.c */
+typedef struct _recv_ring_t
+{
+	int                  fd;
+	int                  size;
+	char               (*bufs)[MAX_RECV_BUFFER + 1];
+	struct mmsghdr      *msgs;
+	struct iovec        *iovs;
+	struct sockaddr_in  *addrs;
+} recv_ring_t;
+
+/* A message being written into memory that belongs to somebody else,
+   see outbuf.c */
+typedef struct _outbuf_t
+{
+	char   *data;
+	size_t  len;
+	size_t  cap;
+	char   *spill;     /* where to move to if data fills up, or NULL */
+	size_t  spill_cap;
+	int     spilled;   /* data is now spill */
+	int     overflow;  /* something didn't fit and was left out */
+} outbuf_t;
+
+/* A request from a client or the peer, see request.c */
+typedef struct _request_t
+{
+	wire_type_t    type;   /* WIRE_NOTIFY_* or WIRE_CLIENT_* */
+	int            binary; /* it came in the binary encoding */
+	str_view_t     device; /* in the datagram, if the request has one */
+	unsigned long  lines;  /* LOG: the last so many, or 0 for all */
+} request_t;
+
+/* Unicast replies waiting to go out on a socket, see reply_queue.c */
+typedef struct _reply_queue_t
+{
+	int                 fd;
+	int                 size;  /* number of slots */
+	int                 count; /* slots currently in use */
+	struct mmsghdr     *msgs;
+	struct iovec       *iovs;
+	struct sockaddr_in *addrs;
+	char              **bufs;  /* MAX_SEND_BUFFER each */
+	char               *message; /* a reply too big for one slot */
+	size_t              message_cap;
+} reply_queue_t;
+
+/* Fixed-size objects carved out of slabs, see pool.c.  Only ever used
+   from the main thread. */
+typedef struct _pool_slab_t pool_slab_t;
+
+typedef struct _pool_t
+{
+	const char    *name;
+	size_t         object_size;
+	size_t         slab_size;   /* a power of two, and the slabs' alignment */
+	int            per_slab;
+	pool_slab_t   *available;   /* slabs with at least one free object */
+	int            n_slabs;
+	int            in_use;
+	int            peak_in_use;
+	unsigned long  allocs;      /* over the life of the pool */
+	unsigned long  released;    /* slabs given back by pool_trim() */
+} pool_t;
+
+/* One block that everything allocated from it is freed with, see
+   arena.c */
+typedef struct _arena_t
+{
+	char   *base;
+	size_t  size;
+	size_t  used;
+} arena_t;
+
+/* receives each datagram of a message from fragment_message() */
+typedef int (*fragment_sink_t) (void *arg, const char *datagram, size_t len);
+
 /* global variables */
 extern device_list_t *g_devices;
-extern client_list_t *g_clients;
+extern int            g_n_devices;
+extern device_state_t g_device_state;
+extern client_table_t g_clients;
 extern const char    *g_link_status_message[];
 extern char          *g_config_file;
 extern int            g_fork;
 extern int            g_debug;
 extern int            g_poll_time;
 extern unsigned short g_srv_port;
-extern char          *g_srv_inaddr;
-extern char          *g_multicast_group;
+extern const char    *g_srv_inaddr;
+extern const char    *g_multicast_group;
 extern unsigned short g_multicast_port;
+extern const char    *g_multicast_ifs;
+extern int            g_multicast_ttl;
+extern int            g_multicast_loop;
 extern int            g_client_timeout;
 extern int            g_socket_fd;
 extern int            g_retries;
 extern int            g_connect_timeout;
 extern int            g_disconnect_timeout;
+extern int            g_recv_batch;
+extern int            g_workers;
+extern int            g_legacy_status;
+extern int            g_snapshot_time;
+extern int            g_binary_broadcast;
+extern int            g_broadcast_delay;
+extern int            g_heartbeat_max;
+extern int            g_link_commands;
+extern int            g_command_log;
+extern reply_queue_t  g_reply_queue;
 
 /* exportable function prototypes */
+/* from server.c */
+int       recv_ring_init   (recv_ring_t *ring, int fd, int size);
+int       recv_ring_fill   (recv_ring_t *ring, int flags);
+int       process_datagram (struct sockaddr_in cli, char *recv_buffer,
+			    size_t len);
+
 /* from read_config.c */
 int       parse_command_line (int argc, char *argv[]);
 int       read_config (void);
 
 /* from list_fns.c */
-int       add_device (device_list_t **pp_devices, device_t *new_device);
-int       add_client (client_list_t **pp_clients, client_t *new_client);
-int       rm_device  (device_list_t **pp_devices, device_t *dev);
-int       rm_client  (client_list_t **pp_clients, client_t *client);
-device_t *get_device (device_list_t **pp_devices, char *dev_name);
-client_t *get_client (client_list_t **pp_clients, struct in_addr inet_addr);
+int       register_device  (device_t *new_device);
+device_t *find_device      (const char *dev_name, size_t len);
+device_t *device_by_index  (int index);
+unsigned int device_name_hash (const char *dev_name, size_t len);
+int       trim_pools       (void);
+void      report_pools     (FILE *out);
 
-int       timeout_old_clients ();
-int       timeout_old_devices ();
+int       schedule_device_timeout (device_t *device);
+void      device_timed_out        (wheel_timer_t *timer, void *arg);
+void      client_timed_out        (wheel_timer_t *timer, void *arg);
 
 int       remove_client_from_all_devices (client_t *client);
-int       remove_device_from_all_clients (device_t *device);
-int       remove_all_devices_from_client (client_t *client);
+void      client_moved                   (client_t *client);
+int       client_connected               (client_t *client, device_t *device);
+int       next_client_device             (client_t *client, int from);
+void      client_membership_free         (client_t *client);
 int       remove_all_clients_from_device (device_t *device);
 
 int       connect_client_to_device      (client_t *client, device_t *device);
@@ -100,26 +306,148 @@ int       link_up             (device_t *device);
 int       link_down           (device_t *device);
 int       link_force_down     (device_t *device);
 int       alter_device_status (device_t *device, device_status_t new_status);
+void      link_command_done   (device_t *device, link_command_t command,
+			       int status);
+int       link_command_followup (device_t *device, link_command_t command);
+
+/* from client_table.c */
+client_t *find_client       (struct in_addr inet_addr);
+client_t *register_client   (struct sockaddr_in *cli);
+int       unregister_client (client_t *client);
+
+/* from fragment.c */
+int       fragment_message (const char *prefix, const char *message,
+			    size_t len, char delim, fragment_sink_t sink,
+			    void *arg);
+int       fragment_binary  (wire_type_t type, const char *message,
+			    size_t len, fragment_sink_t sink, void *arg);
+
+/* from outbuf.c */
+void      outbuf_init      (outbuf_t *out, char *data, size_t cap);
+void      outbuf_set_spill (outbuf_t *out, char *spill, size_t spill_cap);
+void      outbuf_put_bytes (outbuf_t *out, const char *data, size_t len);
+void      outbuf_put_str   (outbuf_t *out, const char *str);
+void      outbuf_put_char  (outbuf_t *out, char c);
+void      outbuf_put_int   (outbuf_t *out, long value);
+void      outbuf_put_uint  (outbuf_t *out, unsigned long value);
+
+/* from arena.c */
+int       arena_init  (arena_t *arena, size_t size);
+void     *arena_alloc (arena_t *arena, size_t len);
+size_t    arena_space (size_t len);
+void      arena_free  (arena_t *arena);
+
+/* from pool.c */
+int       pool_init   (pool_t *pool, const char *name, size_t object_size);
+void     *pool_alloc  (pool_t *pool);
+void      pool_free   (pool_t *pool, void *object);
+int       pool_trim   (pool_t *pool);
+void      pool_report (pool_t *pool, FILE *out);
+
+/* from timer_wheel.c */
+int       wheel_init       (time_t now);
+void      wheel_timer_init (wheel_timer_t *timer, wheel_callback_t callback,
+			    void *arg);
+void      wheel_schedule   (wheel_timer_t *timer, time_t expires);
+void      wheel_cancel     (wheel_timer_t *timer);
+void      wheel_timer_moved (wheel_timer_t *timer);
+int       wheel_pending    (wheel_timer_t *timer);
+void      wheel_advance    (time_t now);
+
+/* from link_driver.c */
+int       link_drivers_init (void);
+int       link_driver_start (device_t *device, link_command_t command);
+void      link_drivers_poll (void);
+
+/* from link_exec.c */
+int       link_exec_init  (void);
+int       link_exec_start (device_t *device, link_command_t command);
+int       link_exec_after (device_t *device, link_command_t command);
+void      link_exec_report (FILE *out);
+
+/* from device_log.c */
+void      device_log_write (device_t *device, const char *data, size_t len);
+size_t    device_log_tail  (device_t *device, unsigned long lines,
+			    const char *part[2], size_t part_len[2]);
+
+/* from request.c */
+int         parse_request     (const char *data, size_t len,
+			       request_t *request);
+const char *request_name      (request_t *request);
+int         request_from_peer (request_t *request);
+
 /* from process_client.c */
-int process_client (struct sockaddr_in cli, char *recv_buffer);
+client_t *touch_client   (struct sockaddr_in *cli);
+int       process_client (struct sockaddr_in cli, request_t *request);
 
 /* from process_peer.c */
-int process_peer   (char *recv_buffer);
+int process_peer   (request_t *request);
 
 /* from send_message.c */
 int   send_device_list    (client_t *client);
 int   send_device_status  (client_t *client, device_t *device);
 int   send_client_status  (client_t *client);
-char *print_device_status (device_t *device);
+int   send_device_log     (client_t *client, device_t *device,
+			   unsigned long lines);
+void  put_device_status   (outbuf_t *out, device_t *device);
+size_t reply_max_len      (void);
+
+/* from reply_queue.c */
+int   reply_queue_init  (reply_queue_t *queue, int fd, int size,
+			 size_t message_cap);
+void  reply_queue_begin (reply_queue_t *queue, outbuf_t *out);
+int   reply_queue_commit (reply_queue_t *queue,
+			  const struct sockaddr_in *sa, outbuf_t *out,
+			  char delim);
+int   reply_queue_add   (reply_queue_t *queue, const struct sockaddr_in *sa,
+			 const char *message, size_t len);
+int   reply_queue_add_binary (reply_queue_t *queue,
+			      const struct sockaddr_in *sa,
+			      const char *message, size_t len);
+int   reply_queue_flush (reply_queue_t *queue);
+
+/* from multicast.c */
+int  multicast_init (void);
+int  multicast_send (const char *data, size_t len);
 
 /* from poll_clients.c */
-int broadcast_status_message (void);
+int  broadcast_status_init    (void);
+void status_slot_update       (device_t *device);
+int  broadcast_status_message   (void);
+int  broadcast_snapshot_message (void);
+int  broadcast_delta_message    (void);
+void broadcast_request_snapshot (void);
+int  broadcast_changes          (void);
+int  broadcast_schedule_init    (void);
 int broadcast_init_message (void);
 int broadcast_quit_message (void);
 
+/* from events.c */
+typedef int (*event_handler_t) (int fd, void *arg);
+
+int  event_init       (void);
+int  event_add        (int fd, event_handler_t handler, void *arg);
+int  event_remove     (int fd);
+int  event_timer_new  (event_handler_t handler, void *arg);
+int  event_timer_set  (int timer_fd, int initial_ms, int interval_ms);
+long event_now_ms     (void);
+int  event_signal_new (const int *signals, int n_signals,
+		       event_handler_t handler, void *arg);
+int  event_loop       (void);
+void event_set_batch_hook (void (*hook) (void));
+void event_stop       (void);
+
+/* from workers.c */
+int  workers_start         (void);
+int  workers_stop          (void);
+void workers_touch_clients (void);
+void workers_report        (FILE *out);
+void snapshot_invalidate   (void);
+int  snapshot_publish      (void);
+
 // functions to aid debugging
 #ifdef DEBUG
-void      dump_client_list (client_list_t *clients);
+void      dump_client_list (client_table_t *clients);
 void      dump_device_list (device_list_t *devices);
 #endif
 
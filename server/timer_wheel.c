@@ -0,0 +1,192 @@
+/* timer_wheel.c
+ * -------------
+ *
+ * A hierarchical timing wheel with one second resolution, used for the
+ * client and device timeouts.  Timers are embedded in the structure they
+ * time out, so scheduling, rescheduling and cancelling never allocate and
+ * are all O(1).  Each tick only looks at the slot that has come due (and,
+ * every 64 ticks, spreads the next slot of the level above back down), so
+ * clients and devices that are nowhere near their deadline are never
+ * touched.
+ *
+ * Level 0 has one slot per second for the next 64 seconds, level 1 one
+ * slot per 64 seconds, and so on.  Four levels reach a little over six
+ * months; anything further out is parked at the far end and re-filed as
+ * it comes closer.
+ */
+
+#include <errno.h>
+#include <string.h>
+
+#include "server.h"
+
+#define WHEEL_BITS   6
+#define WHEEL_SIZE   (1 << WHEEL_BITS)
+#define WHEEL_MASK   (WHEEL_SIZE - 1)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN   ((time_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+
+/* File-level variables */
+static wheel_timer_t s_slots[WHEEL_LEVELS][WHEEL_SIZE]; /* list heads */
+static time_t        s_now = 0; /* everything before this has fired */
+
+/* Local prototypes */
+static void wheel_link   (wheel_timer_t *head, wheel_timer_t *timer);
+static void wheel_unlink (wheel_timer_t *timer);
+static void wheel_file   (wheel_timer_t *timer);
+static void wheel_splice (wheel_timer_t *from, wheel_timer_t *to);
+
+int wheel_init (time_t now)
+{
+	int level, slot;
+
+	for (level = 0; level < WHEEL_LEVELS; level++)
+	{
+		for (slot = 0; slot < WHEEL_SIZE; slot++)
+		{
+			s_slots[level][slot].next = &s_slots[level][slot];
+			s_slots[level][slot].prev = &s_slots[level][slot];
+		}
+	}
+	s_now = now;
+	return 0;
+}
+
+void wheel_timer_init (wheel_timer_t *timer, wheel_callback_t callback,
+		       void *arg)
+{
+	memset (timer, 0, sizeof (wheel_timer_t));
+	timer->callback = callback;
+	timer->arg      = arg;
+}
+
+static void wheel_link (wheel_timer_t *head, wheel_timer_t *timer)
+{
+	timer->prev       = head->prev;
+	timer->next       = head;
+	head->prev->next  = timer;
+	head->prev        = timer;
+}
+
+static void wheel_unlink (wheel_timer_t *timer)
+{
+	timer->prev->next = timer->next;
+	timer->next->prev = timer->prev;
+	timer->next = timer->prev = NULL;
+}
+
+static void wheel_file (wheel_timer_t *timer)
+{
+	/* put the timer in the slot matching how far away it is */
+	time_t expires = timer->expires;
+	time_t delta   = expires - s_now;
+	int level;
+
+	if (delta < 0)
+	{
+		/* overdue - fire on the next tick */
+		expires = s_now;
+		delta   = 0;
+	}
+	else if (delta >= WHEEL_SPAN)
+	{
+		expires = s_now + WHEEL_SPAN - 1;
+		delta   = WHEEL_SPAN - 1;
+	}
+
+	for (level = 0; level < WHEEL_LEVELS - 1; level++)
+	{
+		if (delta < ((time_t)1 << (WHEEL_BITS * (level + 1))))
+			break;
+	}
+	wheel_link (&s_slots[level][(expires >> (WHEEL_BITS * level))
+				    & WHEEL_MASK],
+		    timer);
+}
+
+void wheel_schedule (wheel_timer_t *timer, time_t expires)
+{
+	if (timer->next != NULL)
+		wheel_unlink (timer);
+	timer->expires = expires;
+	wheel_file (timer);
+}
+
+void wheel_cancel (wheel_timer_t *timer)
+{
+	if (timer->next != NULL)
+		wheel_unlink (timer);
+}
+
+void wheel_timer_moved (wheel_timer_t *timer)
+{
+	/* the structure holding the timer has been copied somewhere else -
+	   point the neighbours at the copy */
+	if (timer->next != NULL)
+	{
+		timer->next->prev = timer;
+		timer->prev->next = timer;
+	}
+}
+
+int wheel_pending (wheel_timer_t *timer)
+{
+	return (timer->next != NULL);
+}
+
+static void wheel_splice (wheel_timer_t *from, wheel_timer_t *to)
+{
+	/* move every timer in the list headed by from onto the (empty)
+	   list headed by to */
+	if (from->next == from)
+	{
+		to->next = to->prev = to;
+		return;
+	}
+	to->next       = from->next;
+	to->prev       = from->prev;
+	to->next->prev = to;
+	to->prev->next = to;
+	from->next = from->prev = from;
+}
+
+void wheel_advance (time_t now)
+{
+	while (s_now <= now)
+	{
+		wheel_timer_t due;
+		int level;
+
+		/* at the start of each lap, bring the next slot of the level
+		   above down into the levels below */
+		for (level = 1; level < WHEEL_LEVELS; level++)
+		{
+			wheel_timer_t cascade;
+			int shift = WHEEL_BITS * level;
+
+			if ((s_now >> (shift - WHEEL_BITS)) & WHEEL_MASK)
+				break;
+			wheel_splice (&s_slots[level][(s_now >> shift)
+						      & WHEEL_MASK],
+				      &cascade);
+			while (cascade.next != &cascade)
+			{
+				wheel_timer_t *timer = cascade.next;
+				wheel_unlink (timer);
+				wheel_file (timer);
+			}
+		}
+
+		/* a callback may cancel or reschedule any other timer, even
+		   one of the others that are due now, so take them off the
+		   list one at a time */
+		wheel_splice (&s_slots[0][s_now & WHEEL_MASK], &due);
+		s_now++;
+		while (due.next != &due)
+		{
+			wheel_timer_t *timer = due.next;
+			wheel_unlink (timer);
+			timer->callback (timer, timer->arg);
+		}
+	}
+}
@@ -0,0 +1,718 @@
+/* workers.c
+ * ---------
+ *
+ * Multi-worker mode.  With workers > 1 in the [Server] section, every
+ * extra worker thread owns its own SO_REUSEPORT socket on the server port
+ * and the kernel spreads incoming datagrams across them.
+ *
+ * The device and client lists are still only ever touched by the main
+ * thread (the state owner).  Workers answer the read-only commands (PING,
+ * DEVICES, STATUS and CLIENT_STATUS) from an immutable snapshot of the
+ * device state, published by the owner whenever something changes and
+ * reclaimed once no worker can still be reading it (epoch based
+ * reclamation).  Everything else - UP, DOWN, FORCE_DOWN, NOTIFY and so on
+ * - is passed to the owner through a queue and handled in its event loop.
+ *
+ * The clients a worker answers itself still have to be kept alive in the
+ * owner's table.  Rather than one queue entry per datagram, each worker
+ * notes the addresses it has heard from in a small table of its own, and
+ * the owner takes them all in once a second, when the timing wheel ticks.
+ */
+
+#define _GNU_SOURCE /* for recvmmsg() */
+#include <errno.h>
+#include <limits.h>
+#include <string.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/eventfd.h>
+
+#include <protocol.h>
+#include <wire.h>
+#include "server.h"
+
+#define MAX_WORKERS 64
+
+/* most clients a worker notes between two of the owner's ticks (a power
+   of two); past three quarters full, any more are left for next time */
+#define SEEN_SLOTS 1024
+
+/* snapshot of the state visible to the read-only commands */
+typedef struct _snap_device_t
+{
+	const char      *device_name;        /* owned by the device_t */
+	const char      *device_description;
+	device_status_t  status;
+	time_t           connect_time;
+	int              no_users;
+} snap_device_t;
+
+typedef struct _snap_client_t
+{
+	in_addr_t  addr;
+	int        n_devices;
+	int       *devices;   /* indices into snapshot_t.devices */
+} snap_client_t;
+
+typedef struct _snapshot_t
+{
+	struct _snapshot_t *next_retired;
+	unsigned long       retire_epoch;
+	int                 n_devices;
+	snap_device_t      *devices;
+	int                 n_clients;
+	snap_client_t      *clients;     /* sorted by address */
+} snapshot_t;
+
+/* a datagram passed on to the state owner */
+typedef struct _forward_t
+{
+	struct sockaddr_in sa;
+	size_t             len;
+	char               message[MAX_RECV_BUFFER + 1];
+} forward_t;
+
+typedef struct _forward_queue_t
+{
+	forward_t *entries;
+	int        count;
+	int        size;
+} forward_queue_t;
+
+/* the clients a worker has heard from, keyed on address */
+typedef struct _seen_table_t
+{
+	struct sockaddr_in addrs[SEEN_SLOTS]; /* sin_family 0 if free */
+	int                n_used;
+} seen_table_t;
+
+typedef struct _worker_t
+{
+	pthread_t        thread;
+	int              id;
+	int              fd;
+	atomic_ulong     epoch; /* 0 while not looking at a snapshot */
+	recv_ring_t      ring;
+	reply_queue_t    replies;
+	wire_buf_t       wire_buf; /* binary replies, kept between them */
+	pthread_mutex_t  seen_mutex;
+	seen_table_t    *seen;     /* filled by the worker */
+	seen_table_t    *merging;  /* taken in by the owner */
+	unsigned long    seen_dropped;
+} worker_t;
+
+/* File-level variables */
+static worker_t                *s_workers   = NULL;
+static int                      s_n_workers = 0;
+static _Atomic(snapshot_t *)    s_snapshot  = NULL;
+static atomic_ulong             s_epoch     = 1;
+static snapshot_t              *s_retired   = NULL;
+static int                      s_dirty     = TRUE;
+static atomic_int               s_running   = FALSE;
+
+static pthread_mutex_t          s_forward_mutex = PTHREAD_MUTEX_INITIALIZER;
+static forward_queue_t          s_pending;    /* filled by the workers */
+static forward_queue_t          s_processing; /* drained by the owner */
+static int                      s_wake_fd = -1;
+
+/* Local prototypes */
+static snapshot_t *snapshot_build   (void);
+static void        snapshot_reclaim (void);
+static void       *worker_main      (void *arg);
+static int         worker_process   (worker_t *worker, snapshot_t *snap,
+				     struct sockaddr_in *cli, char *message,
+				     size_t len);
+static void        worker_seen      (worker_t *worker,
+				     struct sockaddr_in *cli);
+static int         worker_forward   (struct sockaddr_in *cli,
+				     char *message, size_t len);
+static int         handle_forwarded (int fd, void *arg);
+
+int workers_start (void)
+{
+	struct sockaddr_in serv;
+	socklen_t serv_len = sizeof (serv);
+	int i, on = 1;
+
+	if (g_workers <= 1)
+		return 0; /* single threaded, nothing to do */
+	if (g_workers > MAX_WORKERS)
+		g_workers = MAX_WORKERS;
+
+	/* workers bind to exactly the same address as the main socket */
+	if (getsockname (g_socket_fd, (struct sockaddr *) &serv, &serv_len)
+	    < 0)
+		return (-1);
+
+	if ((s_wake_fd = eventfd (0, EFD_NONBLOCK | EFD_CLOEXEC)) < 0)
+		return (-1);
+	if (event_add (s_wake_fd, handle_forwarded, NULL) < 0)
+		return (-1);
+
+	/* the workers need something to read before they start */
+	s_dirty = TRUE;
+	snapshot_publish ();
+
+	s_n_workers = g_workers - 1; /* the main thread is a worker too */
+	s_workers = calloc (s_n_workers, sizeof (worker_t));
+	if (s_workers == NULL)
+		return (-1);
+
+	atomic_store (&s_running, TRUE);
+	for (i = 0; i < s_n_workers; i++)
+	{
+		worker_t *worker = &s_workers[i];
+
+		worker->id = i + 1;
+		if ((worker->fd = socket (PF_INET, SOCK_DGRAM, 0)) < 0)
+			return (-1);
+		if (setsockopt (worker->fd, SOL_SOCKET, SO_REUSEPORT,
+				&on, sizeof (on)) < 0)
+			return (-1);
+		if (bind (worker->fd, (struct sockaddr *) &serv,
+			  sizeof (serv)) < 0)
+			return (-1);
+
+		if (recv_ring_init (&worker->ring, worker->fd,
+				    g_recv_batch) < 0)
+			return (-1);
+		if (reply_queue_init (&worker->replies, worker->fd,
+				      g_recv_batch, reply_max_len ()) < 0)
+			return (-1);
+		wire_buf_init (&worker->wire_buf);
+		pthread_mutex_init (&worker->seen_mutex, NULL);
+		worker->seen    = calloc (1, sizeof (seen_table_t));
+		worker->merging = calloc (1, sizeof (seen_table_t));
+		if (worker->seen == NULL || worker->merging == NULL)
+			return (-1);
+
+		if (pthread_create (&worker->thread, NULL, worker_main,
+				    worker) != 0)
+			return (-1);
+	}
+
+	if (g_debug)
+		fprintf (stderr, "Started %d worker threads\n", s_n_workers);
+	return 0;
+}
+
+int workers_stop (void)
+{
+	int i;
+
+	if (!atomic_load (&s_running))
+		return 0;
+	atomic_store (&s_running, FALSE);
+
+	/* shutdown() wakes up a thread blocked in recvmmsg() - on an
+	   unconnected UDP socket it complains with ENOTCONN, but still
+	   does the job */
+	for (i = 0; i < s_n_workers; i++)
+		shutdown (s_workers[i].fd, SHUT_RD);
+
+	for (i = 0; i < s_n_workers; i++)
+	{
+		pthread_join (s_workers[i].thread, NULL);
+		close (s_workers[i].fd);
+	}
+	return 0;
+}
+
+void workers_touch_clients (void)
+{
+	/* take in the clients the workers have heard from since last
+	   time.  Each worker gets a fresh table to fill while we go through
+	   the one it had. */
+	int i, slot;
+
+	for (i = 0; i < s_n_workers; i++)
+	{
+		worker_t *worker = &s_workers[i];
+		seen_table_t *table;
+
+		pthread_mutex_lock (&worker->seen_mutex);
+		table           = worker->seen;
+		worker->seen    = worker->merging;
+		worker->merging = table;
+		pthread_mutex_unlock (&worker->seen_mutex);
+
+		for (slot = 0; table->n_used > 0 && slot < SEEN_SLOTS; slot++)
+		{
+			if (table->addrs[slot].sin_family == 0)
+				continue;
+			if (touch_client (&table->addrs[slot]) == NULL)
+				perror ("touch_client()");
+			table->addrs[slot].sin_family = 0;
+			table->n_used--;
+		}
+	}
+}
+
+void workers_report (FILE *out)
+{
+	unsigned long dropped = 0;
+	int i, waiting;
+
+	if (s_n_workers == 0)
+		return;
+	pthread_mutex_lock (&s_forward_mutex);
+	waiting = s_pending.count;
+	pthread_mutex_unlock (&s_forward_mutex);
+	for (i = 0; i < s_n_workers; i++)
+	{
+		pthread_mutex_lock (&s_workers[i].seen_mutex);
+		dropped += s_workers[i].seen_dropped;
+		pthread_mutex_unlock (&s_workers[i].seen_mutex);
+	}
+
+	fprintf (out, "workers: %d, forwarded to main thread: %d waiting, "
+		 "%lu clients not noted (more than %d a second)\n",
+		 s_n_workers, waiting, dropped, SEEN_SLOTS * 3 / 4);
+}
+
+void snapshot_invalidate (void)
+{
+	/* called by the state owner whenever something visible to the
+	   read-only commands has changed */
+	s_dirty = TRUE;
+}
+
+int snapshot_publish (void)
+{
+	snapshot_t *snap, *old;
+
+	if (s_wake_fd == -1) // no workers
+		return 0;
+
+	if (s_dirty)
+	{
+		if ((snap = snapshot_build ()) == NULL)
+			return (-1);
+		s_dirty = FALSE;
+
+		old = atomic_exchange (&s_snapshot, snap);
+		if (old != NULL)
+		{
+			/* anybody who might still be reading the old one
+			   entered before the epoch moved on */
+			old->retire_epoch = atomic_fetch_add (&s_epoch, 1);
+			old->next_retired = s_retired;
+			s_retired = old;
+		}
+	}
+
+	if (s_retired != NULL)
+		snapshot_reclaim ();
+	return 0;
+}
+
+static int compare_snap_clients (const void *a, const void *b)
+{
+	in_addr_t addr_a = ((const snap_client_t *) a)->addr;
+	in_addr_t addr_b = ((const snap_client_t *) b)->addr;
+
+	return (addr_a > addr_b) - (addr_a < addr_b);
+}
+
+static snapshot_t *snapshot_build (void)
+{
+	/* everything goes into a single allocation, so that retiring a
+	   snapshot is a single free() */
+	device_list_t *d_list_pos;
+	snapshot_t *snap;
+	int n_clients = 0, n_refs = 0, *refs;
+	unsigned int slot;
+	size_t size;
+
+	for (slot = 0; slot < g_clients.size; slot++)
+	{
+		client_t *client = &g_clients.slots[slot];
+
+		/* only clients connected to something are interesting */
+		if (!client->in_use || client->n_devices == 0)
+			continue;
+		n_clients++;
+		n_refs += client->n_devices;
+	}
+
+	size = sizeof (snapshot_t) + g_n_devices * sizeof (snap_device_t) +
+		n_clients * sizeof (snap_client_t) + n_refs * sizeof (int);
+	if ((snap = (snapshot_t *)malloc (size)) == NULL)
+		return NULL;
+
+	snap->next_retired = NULL;
+	snap->retire_epoch = 0;
+	snap->n_devices    = g_n_devices;
+	snap->devices      = (snap_device_t *)(snap + 1);
+	snap->n_clients    = n_clients;
+	snap->clients      = (snap_client_t *)(snap->devices + g_n_devices);
+	refs               = (int *)(snap->clients + n_clients);
+
+	for (d_list_pos = g_devices; d_list_pos; d_list_pos = d_list_pos->next)
+	{
+		device_t      *device = d_list_pos->data;
+		snap_device_t *entry  = &snap->devices[device->device_index];
+
+		entry->device_name        = device->device_name.str;
+		entry->device_description = device->device_description.str;
+		entry->status             = DEVICE_STATUS (device);
+		entry->connect_time       = DEVICE_CONNECT_TIME (device);
+		entry->no_users           = DEVICE_USERS (device);
+	}
+
+	n_clients = 0;
+	for (slot = 0; slot < g_clients.size; slot++)
+	{
+		client_t *client = &g_clients.slots[slot];
+		snap_client_t *entry;
+		int index;
+
+		if (!client->in_use || client->n_devices == 0)
+			continue;
+		entry = &snap->clients[n_clients++];
+		entry->addr      = client->sa.sin_addr.s_addr;
+		entry->n_devices = 0;
+		entry->devices   = refs;
+		for (index = next_client_device (client, 0); index >= 0;
+		     index = next_client_device (client, index + 1))
+			entry->devices[entry->n_devices++] = index;
+		refs += entry->n_devices;
+	}
+	qsort (snap->clients, n_clients, sizeof (snap_client_t),
+	       compare_snap_clients);
+
+	return snap;
+}
+
+static void snapshot_reclaim (void)
+{
+	/* free every retired snapshot that was retired before the oldest
+	   epoch any worker is currently reading in */
+	unsigned long oldest = ULONG_MAX;
+	snapshot_t **pp_snap = &s_retired;
+	int i;
+
+	for (i = 0; i < s_n_workers; i++)
+	{
+		unsigned long epoch = atomic_load (&s_workers[i].epoch);
+		if (epoch != 0 && epoch < oldest)
+			oldest = epoch;
+	}
+
+	while (*pp_snap)
+	{
+		snapshot_t *snap = *pp_snap;
+		if (snap->retire_epoch < oldest)
+		{
+			*pp_snap = snap->next_retired;
+			free (snap);
+		}
+		else
+		{
+			pp_snap = &snap->next_retired;
+		}
+	}
+}
+
+static void *worker_main (void *arg)
+{
+	worker_t *worker = (worker_t *)arg;
+
+	while (atomic_load (&s_running))
+	{
+		snapshot_t *snap;
+		int i, n_msgs;
+
+		n_msgs = recv_ring_fill (&worker->ring, MSG_WAITFORONE);
+		if (n_msgs < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			perror ("worker recvmmsg()");
+			break;
+		}
+		if (!atomic_load (&s_running))
+			break; /* woken up by workers_stop() */
+
+		/* announce the epoch we're reading in before looking at the
+		   snapshot, so the owner won't free it from under us */
+		atomic_store (&worker->epoch, atomic_load (&s_epoch));
+		snap = atomic_load (&s_snapshot);
+
+		for (i = 0; i < n_msgs; i++)
+		{
+			if (worker_process (worker, snap,
+					    &worker->ring.addrs[i],
+					    worker->ring.bufs[i],
+					    worker->ring.msgs[i].msg_len) < 0)
+			{
+				perror ("worker_process()");
+			}
+		}
+
+		atomic_store (&worker->epoch, 0);
+
+		reply_queue_flush (&worker->replies);
+	}
+	return NULL;
+}
+
+static void worker_put_status (outbuf_t *out, snap_device_t *device)
+{
+	/* same format as put_device_status() */
+	outbuf_put_str (out, device->device_name);
+	outbuf_put_str (out, g_link_status_message[device->status]);
+
+	if (device->status == LINK_UP)
+	{
+		outbuf_put_int (out, (int)(time (NULL) - device->connect_time));
+		outbuf_put_char (out, ' ');
+		outbuf_put_int (out, device->no_users);
+	}
+}
+
+static int worker_process (worker_t *worker, snapshot_t *snap,
+			   struct sockaddr_in *cli, char *message, size_t len)
+{
+	char delim = '\n'; /* between the entries of the reply */
+	request_t request;
+	outbuf_t out;
+	int i;
+
+	if (g_debug)
+		fprintf (stderr, "Worker %d received message: %s\n",
+			 worker->id, message);
+
+	/* nothing the owner couldn't make sense of either gets passed on */
+	if (parse_request (message, len, &request) < 0)
+		return (-1);
+
+	switch (request.type)
+	{
+	case WIRE_CLIENT_PING:
+		/* the owner just needs to know the client is still there */
+		worker_seen (worker, cli);
+		return 0;
+
+	case WIRE_CLIENT_DEVICES:
+		if (request.binary)
+		{
+			wire_begin (&worker->wire_buf, WIRE_SERVER_DEVICES);
+			wire_put_varint (&worker->wire_buf, snap->n_devices);
+			for (i = 0; i < snap->n_devices; i++)
+			{
+				wire_put_string (&worker->wire_buf,
+						 snap->devices[i].device_name);
+				wire_put_string (&worker->wire_buf,
+					snap->devices[i].device_description);
+			}
+			break;
+		}
+		reply_queue_begin (&worker->replies, &out);
+		outbuf_put_str (&out, SERVER_DEVICES);
+		for (i = 0; i < snap->n_devices; i++)
+		{
+			outbuf_put_str (&out, snap->devices[i].device_name);
+			outbuf_put_char (&out, '\t');
+			outbuf_put_str (&out,
+					snap->devices[i].device_description);
+			outbuf_put_char (&out, '\n');
+		}
+		break;
+
+	case WIRE_CLIENT_STATUS:
+	{
+		/* the device index is fixed once the config is read, so it's
+		   as safe to use here as the snapshot */
+		device_t *device = find_device (request.device.str,
+						request.device.len);
+		snap_device_t *entry;
+
+		if (device == NULL || device->device_index >= snap->n_devices)
+		{
+			worker_seen (worker, cli);
+			errno = ENODEV;
+			return (-1);
+		}
+
+		entry = &snap->devices[device->device_index];
+		if (request.binary)
+		{
+			wire_begin (&worker->wire_buf, WIRE_SERVER_STATUS);
+			wire_put_status (&worker->wire_buf, entry->device_name,
+					 entry->status,
+					 time (NULL) - entry->connect_time,
+					 entry->no_users);
+			break;
+		}
+		reply_queue_begin (&worker->replies, &out);
+		outbuf_put_str (&out, SERVER_STATUS_PREFIX);
+		worker_put_status (&out, entry);
+		break;
+	}
+
+	case WIRE_CLIENT_CLIENT_STATUS:
+	{
+		snap_client_t key, *client;
+
+		key.addr = cli->sin_addr.s_addr;
+		client = bsearch (&key, snap->clients, snap->n_clients,
+				  sizeof (snap_client_t), compare_snap_clients);
+		if (request.binary)
+		{
+			wire_begin (&worker->wire_buf,
+				    WIRE_SERVER_CLIENT_STATUS);
+			wire_put_varint (&worker->wire_buf,
+					 client ? client->n_devices : 0);
+			for (i = 0; client && i < client->n_devices; i++)
+				wire_put_string (&worker->wire_buf,
+						 snap->devices[
+						 client->devices[i]].device_name);
+			break;
+		}
+
+		reply_queue_begin (&worker->replies, &out);
+		outbuf_put_str (&out, SERVER_CLIENT_STATUS);
+		delim = '\t';
+		for (i = 0; client && i < client->n_devices; i++)
+		{
+			if (i > 0)
+				outbuf_put_char (&out, '\t');
+			outbuf_put_str (&out, snap->devices[
+						client->devices[i]].device_name);
+		}
+		break;
+	}
+
+	default:
+		/* anything that changes state belongs to the owner */
+		return worker_forward (cli, message, len);
+	}
+
+	if (request.binary)
+	{
+		if (worker->wire_buf.error)
+		{
+			errno = ENOMEM;
+			return (-1);
+		}
+		if (reply_queue_add_binary (&worker->replies, cli,
+					    (char *)worker->wire_buf.data,
+					    worker->wire_buf.len) < 0)
+			return (-1);
+	}
+	else if (reply_queue_commit (&worker->replies, cli, &out, delim) < 0)
+		return (-1);
+	worker_seen (worker, cli);
+	return 0;
+}
+
+static unsigned int seen_slot (struct in_addr inet_addr)
+{
+	/* as client_slot() */
+	unsigned int hash = ntohl (inet_addr.s_addr) * 2654435761u;
+
+	return (hash ^ (hash >> 16)) & (SEEN_SLOTS - 1);
+}
+
+static void worker_seen (worker_t *worker, struct sockaddr_in *cli)
+{
+	/* note that we've heard from the client, for the owner to take in
+	   on its next tick.  A client already noted just has its address
+	   brought up to date.  Losing one to a full table costs nothing
+	   but a client that keeps quiet for its whole client_timeout. */
+	seen_table_t *table;
+	unsigned int slot;
+
+	pthread_mutex_lock (&worker->seen_mutex);
+	table = worker->seen;
+	for (slot = seen_slot (cli->sin_addr);
+	     table->addrs[slot].sin_family != 0;
+	     slot = (slot + 1) & (SEEN_SLOTS - 1))
+	{
+		if (table->addrs[slot].sin_addr.s_addr == cli->sin_addr.s_addr)
+			break;
+	}
+	if (table->addrs[slot].sin_family != 0 ||
+	    table->n_used < SEEN_SLOTS * 3 / 4)
+	{
+		if (table->addrs[slot].sin_family == 0)
+			table->n_used++;
+		memcpy (&table->addrs[slot], cli, sizeof (struct sockaddr_in));
+	}
+	else
+	{
+		worker->seen_dropped++;
+	}
+	pthread_mutex_unlock (&worker->seen_mutex);
+}
+
+static int worker_forward (struct sockaddr_in *cli, char *message, size_t len)
+{
+	/* pass a request on to the owner.  These change state, so however
+	   far behind the owner is, they all wait for it. */
+	forward_t *entry;
+	int was_empty;
+
+	pthread_mutex_lock (&s_forward_mutex);
+	if (s_pending.count == s_pending.size)
+	{
+		int new_size = s_pending.size ? s_pending.size * 2 : 64;
+		forward_t *new_entries = realloc (s_pending.entries,
+						  new_size * sizeof (forward_t));
+		if (new_entries == NULL)
+		{
+			pthread_mutex_unlock (&s_forward_mutex);
+			return (-1);
+		}
+		s_pending.entries = new_entries;
+		s_pending.size    = new_size;
+	}
+
+	entry = &s_pending.entries[s_pending.count];
+	memcpy (&entry->sa, cli, sizeof (struct sockaddr_in));
+	entry->len = len;
+	memcpy (entry->message, message, len + 1);
+	was_empty = (s_pending.count++ == 0);
+	pthread_mutex_unlock (&s_forward_mutex);
+
+	/* only the first entry needs to wake the owner up */
+	if (was_empty)
+	{
+		uint64_t one = 1;
+		if (write (s_wake_fd, &one, sizeof (one)) < 0 &&
+		    errno != EAGAIN)
+			return (-1);
+	}
+	return 0;
+}
+
+static int handle_forwarded (int fd, void *arg)
+{
+	forward_queue_t swap;
+	uint64_t count;
+	int i;
+
+	if (read (fd, &count, sizeof (count)) < 0 && errno != EAGAIN)
+		perror ("handle_forwarded()");
+
+	/* swap the queues over, so the workers can carry on filling one
+	   while we work through the other */
+	pthread_mutex_lock (&s_forward_mutex);
+	swap         = s_processing;
+	s_processing = s_pending;
+	s_pending    = swap;
+	pthread_mutex_unlock (&s_forward_mutex);
+
+	for (i = 0; i < s_processing.count; i++)
+	{
+		forward_t *entry = &s_processing.entries[i];
+
+		if (process_datagram (entry->sa, entry->message,
+				      entry->len) < 0)
+			perror ("process_datagram()");
+	}
+	s_processing.count = 0;
+
+	return reply_queue_flush (&g_reply_queue);
+}